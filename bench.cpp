@@ -0,0 +1,817 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blip2.h"
+#include "ggml/ggml.h"
+
+
+static void print_usage(const char * prog) {
+    fprintf(stderr, "usage: %s load <model.gguf> [n_iter] [n_threads]\n", prog);
+    fprintf(stderr, "       %s preprocess <model.gguf> <image> [n_iter]\n", prog);
+    fprintf(stderr, "       %s decode <image> [min_size] [n_iter]\n", prog);
+    fprintf(stderr, "       %s malformed\n", prog);
+    fprintf(stderr, "       %s encode <model.gguf> <image> [n_batch] [n_iter] [n_threads] [feature_layer] [tome_r] [image_size]\n", prog);
+    fprintf(stderr, "       %s attn [n_batch] [n_iter] [n_threads]\n", prog);
+    fprintf(stderr, "       %s cache <model.gguf> <image> <cache_file> [n_iter] [n_threads]\n", prog);
+    fprintf(stderr, "       %s qformer <model.gguf> <image> [n_batch] [n_iter] [n_threads]\n", prog);
+    fprintf(stderr, "       %s itm <model.gguf> <image> [n_texts] [n_threads]\n", prog);
+    fprintf(stderr, "       %s classify <model.gguf> <image> <labels.txt> <bank_file> [n_threads]\n", prog);
+    fprintf(stderr, "       %s caption <model.gguf> <image> [max_tokens] [n_ctx] [n_threads] [kv_type: f32|f16|q8_0|q4_0]\n", prog);
+}
+
+// Touch one byte of every page of every tensor so that the cost of paging in an mmap-ed model
+// shows up in the numbers instead of being hidden behind the first inference
+static uint64_t touch_tensors(struct ggml_context * ctx) {
+    uint64_t sum = 0;
+    for (struct ggml_tensor * t = ggml_get_first_tensor(ctx); t; t = ggml_get_next_tensor(ctx, t)) {
+        const uint8_t * data = (const uint8_t *) t->data;
+        const size_t n_bytes = ggml_nbytes(t);
+        for (size_t i = 0; i < n_bytes; i += 4096) {
+            sum += data[i];
+        }
+    }
+
+    return sum;
+}
+
+// Compare the time it takes to get a usable blip2_ctx when reading the whole file into memory
+// and when mapping it. Runs are interleaved so that both paths see the same page cache state.
+static int bench_load(const char * fname, int n_iter, int n_threads) {
+    const char * names[2] = { "read", "mmap" };
+    int64_t t_load_us[2] = { 0, 0 };
+    int64_t t_touch_us[2] = { 0, 0 };
+    int64_t t_load_min_us[2] = { INT64_MAX, INT64_MAX };
+    double read_mbps = 0.0;
+
+    for (int it = 0; it < n_iter; ++it) {
+        for (int m = 0; m < 2; ++m) {
+            struct blip2_model_params params = blip2_model_default_params();
+            params.use_mmap = m == 1;
+            if (n_threads > 0) {
+                params.n_threads = n_threads;
+            }
+
+            const int64_t t_start_us = ggml_time_us();
+            blip2_ctx * ctx = blip2_model_load(fname, params);
+            const int64_t t_loaded_us = ggml_time_us();
+            if (!ctx) {
+                fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+                return 1;
+            }
+
+            if (!params.use_mmap && ctx->load_stats.t_read_us > 0) {
+                read_mbps += ctx->load_stats.n_bytes / 1024.0 / 1024.0 / (ctx->load_stats.t_read_us / 1e6) / n_iter;
+            }
+
+            volatile uint64_t sum = touch_tensors(ctx->ctx);
+            (void) sum;
+            const int64_t t_touched_us = ggml_time_us();
+
+            blip2_free(ctx);
+
+            t_load_us[m] += t_loaded_us - t_start_us;
+            t_touch_us[m] += t_touched_us - t_loaded_us;
+            t_load_min_us[m] = std::min(t_load_min_us[m], t_loaded_us - t_start_us);
+        }
+    }
+
+    printf("%-6s %14s %14s %16s\n", "path", "load avg (ms)", "load min (ms)", "first touch (ms)");
+    for (int m = 0; m < 2; ++m) {
+        printf("%-6s %14.2f %14.2f %16.2f\n", names[m],
+            t_load_us[m] / 1000.0 / n_iter, t_load_min_us[m] / 1000.0, t_touch_us[m] / 1000.0 / n_iter);
+    }
+    printf("read throughput: %.2f MB/s\n", read_mbps);
+
+    return 0;
+}
+
+// Time blip2_image_preprocess alone, only the vision hparams of the model are needed
+static int bench_preprocess(const char * fname, const char * fname_img, int n_iter) {
+    struct blip2_model_params params = blip2_model_default_params();
+    params.towers = BLIP2_TOWER_VISION;
+    blip2_ctx * ctx = blip2_model_load(fname, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return 1;
+    }
+
+    image_u8 img;
+    if (!load_image_from_file(fname_img, &img)) {
+        blip2_free(ctx);
+        return 1;
+    }
+
+    // Preprocess straight into the patches of an input tensor, as the vision graph does
+    const int image_size = ctx->vision_image_size;
+    const int patch_size = ctx->vision_model.hparams.patch_size;
+    const int patch_len = 3 * patch_size * patch_size;
+    const int n_positions = blip2_vision_n_positions(ctx);
+    struct ggml_init_params init_params = {
+        .mem_size = ggml_tensor_overhead() + (size_t) patch_len * n_positions * sizeof(float) + GGML_MEM_ALIGN,
+        .mem_buffer = NULL,
+        .no_alloc = false,
+    };
+    struct ggml_context * ctx_inp = ggml_init(init_params);
+    struct ggml_tensor * inp = ggml_new_tensor_3d(ctx_inp, GGML_TYPE_F32, patch_len, n_positions, 1);
+
+    int64_t t_min_us = INT64_MAX;
+    int64_t t_total_us = 0;
+    for (int it = 0; it < n_iter; ++it) {
+        const int64_t t_start_us = ggml_time_us();
+        blip2_image_preprocess_to_patches(ctx, &img, inp, 0);
+        const int64_t t_us = ggml_time_us() - t_start_us;
+
+        t_total_us += t_us;
+        t_min_us = std::min(t_min_us, t_us);
+    }
+
+    printf("%dx%d -> %d: preprocess avg %.3f ms, min %.3f ms\n", img.nx, img.ny, image_size,
+        t_total_us / 1000.0 / n_iter, t_min_us / 1000.0);
+
+    ggml_free(ctx_inp);
+    blip2_image_u8_free(&img);
+    blip2_free(ctx);
+
+    return 0;
+}
+
+// Compare a full size decode with the reduced-resolution one used for ingestion, from a file
+// and from a buffer already in memory decoding into a reused arena
+static int bench_decode(const char * fname_img, int min_size, int n_iter) {
+    const char * names[3] = { "full", "scaled", "memory" };
+    int64_t t_total_us[3] = { 0, 0, 0 };
+    int64_t t_min_us[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+    int nx[3] = { 0, 0, 0 };
+    int ny[3] = { 0, 0, 0 };
+
+    std::ifstream fin(fname_img, std::ios::binary);
+    const std::vector<uint8_t> buf((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    blip2_buffer arena;
+
+    for (int it = 0; it < n_iter; ++it) {
+        for (int m = 0; m < 3; ++m) {
+            image_u8 img;
+            const int64_t t_start_us = ggml_time_us();
+            bool ok = false;
+            switch (m) {
+                case 0: ok = load_image_from_file(fname_img, &img); break;
+                case 1: ok = load_image_from_file_scaled(fname_img, &img, min_size); break;
+                case 2: ok = load_image_from_memory(buf.data(), buf.size(), &img, min_size, &arena); break;
+            }
+            const int64_t t_us = ggml_time_us() - t_start_us;
+            if (!ok) {
+                return 1;
+            }
+            nx[m] = img.nx;
+            ny[m] = img.ny;
+            blip2_image_u8_free(&img);
+
+            t_total_us[m] += t_us;
+            t_min_us[m] = std::min(t_min_us[m], t_us);
+        }
+    }
+
+    printf("%-7s %11s %14s %14s\n", "decode", "size", "avg (ms)", "min (ms)");
+    for (int m = 0; m < 3; ++m) {
+        printf("%-7s %5dx%-5d %14.2f %14.2f\n", names[m], nx[m], ny[m], t_total_us[m] / 1000.0 / n_iter, t_min_us[m] / 1000.0);
+    }
+
+    return 0;
+}
+
+// Baseline JPEG of one 8-bit component of size nx x ny, with the DHT segments given and a few bytes of scan data
+static std::vector<uint8_t> bench_jpeg(int nx, int ny, const std::vector<std::vector<uint8_t>> & dht) {
+    std::vector<uint8_t> buf = { 0xFF, 0xD8 };
+
+    const uint8_t dqt[5] = { 0xFF, 0xDB, 0x00, 0x43, 0x00 };
+    buf.insert(buf.end(), dqt, dqt + 5);
+    buf.insert(buf.end(), 64, 1);
+
+    const uint8_t sof[13] = { 0xFF, 0xC0, 0x00, 0x0B, 0x08, (uint8_t) (ny >> 8), (uint8_t) ny, (uint8_t) (nx >> 8), (uint8_t) nx, 0x01, 0x01, 0x11, 0x00 };
+    buf.insert(buf.end(), sof, sof + 13);
+
+    for (const auto & table : dht) {
+        const int len = 2 + table.size();
+        const uint8_t marker[4] = { 0xFF, 0xC4, (uint8_t) (len >> 8), (uint8_t) len };
+        buf.insert(buf.end(), marker, marker + 4);
+        buf.insert(buf.end(), table.begin(), table.end());
+    }
+
+    const uint8_t sos[14] = { 0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0xFF, 0xD9 };
+    buf.insert(buf.end(), sos, sos + 14);
+
+    return buf;
+}
+
+// Huffman table of class tc and id 0 with counts[l] codes of length l + 1, all of them for the value 0
+static std::vector<uint8_t> bench_jpeg_dht(int tc, const std::vector<int> & counts) {
+    std::vector<uint8_t> table(17, 0);
+    table[0] = tc << 4;
+    int n_values = 0;
+    for (size_t l = 0; l < counts.size(); ++l) {
+        table[1 + l] = counts[l];
+        n_values += counts[l];
+    }
+    table.insert(table.end(), n_values, 0);
+
+    return table;
+}
+
+// Malformed JPEGs the scaled decoder must reject, best run in a build with -fsanitize=address
+// stb may still decode what it can of them, at full size, so only a scaled result is a failure
+static int bench_malformed() {
+    struct test {
+        const char * name;
+        int nx;
+        int ny;
+        std::vector<uint8_t> buf;
+    };
+    const std::vector<uint8_t> dc = bench_jpeg_dht(0, { 1 });
+    const std::vector<uint8_t> ac = bench_jpeg_dht(1, { 1 });
+    const test tests[] = {
+        // 200 codes of length 1, far more than the 2 that exist
+        { "dht-oversubscribed", 1024, 1024, bench_jpeg(1024, 1024, { bench_jpeg_dht(0, { 200 }), ac }) },
+        { "dht-oversubscribed-ac", 1024, 1024, bench_jpeg(1024, 1024, { dc, bench_jpeg_dht(1, { 2, 3 }) }) },
+        // Planes of several GB for a header of a few bytes
+        { "sof-65535x65535", 65535, 65535, bench_jpeg(65535, 65535, { dc, ac }) },
+    };
+
+    int n_failed = 0;
+    for (const auto & t : tests) {
+        image_u8 img;
+        blip2_buffer arena;
+        const bool ok = load_image_from_memory(t.buf.data(), t.buf.size(), &img, 224, &arena);
+        const bool scaled = ok && (img.nx != t.nx || img.ny != t.ny);
+        if (ok) {
+            blip2_image_u8_free(&img);
+        }
+        n_failed += scaled;
+        printf("%-24s %s\n", t.name, scaled ? "FAILED, decoded scaled" : ok ? "ok, decoded by stb" : "ok, rejected");
+    }
+
+    return n_failed ? 1 : 0;
+}
+
+// Vision encoder throughput of n_batch images encoded one at a time and in a single batched graph
+static int bench_encode(const char * fname, const char * fname_img, int n_batch, int n_iter, int n_threads, int feature_layer, int tome_r, int image_size) {
+    struct blip2_model_params params = blip2_model_default_params();
+    params.towers = BLIP2_TOWER_VISION;
+    params.vision_feature_layer = feature_layer;
+    params.tome_r = tome_r;
+    params.vision_image_size = image_size;
+    blip2_ctx * ctx = blip2_model_load(fname, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return 1;
+    }
+
+    image_u8 img;
+    if (!load_image_from_file_scaled(fname_img, &img, ctx->vision_image_size)) {
+        blip2_free(ctx);
+        return 1;
+    }
+
+    const std::vector<image_u8> imgs(n_batch, img);
+    const int n_tokens = blip2_vision_n_output_tokens(ctx);
+    const size_t n_embd = (size_t) n_tokens * ctx->vision_model.hparams.hidden_size;
+    std::vector<float> embd(n_batch * n_embd);
+
+    // The first run of each mode builds and plans its graph, the following ones reuse it
+    const char * names[2] = { "single", "batched" };
+    int64_t t_first_us[2] = { 0, 0 };
+    int64_t t_min_us[2] = { INT64_MAX, INT64_MAX };
+    for (int m = 0; m < 2; ++m) {
+        for (int it = 0; it <= n_iter; ++it) {
+            const int64_t t_start_us = ggml_time_us();
+            bool ok = true;
+            if (m == 0) {
+                for (int i = 0; i < n_batch && ok; ++i) {
+                    ok = blip2_vision_encode_batch(ctx, &imgs[i], 1, n_threads, embd.data() + i * n_embd);
+                }
+            } else {
+                ok = blip2_vision_encode_batch(ctx, imgs.data(), n_batch, n_threads, embd.data());
+            }
+            const int64_t t_us = ggml_time_us() - t_start_us;
+            if (!ok) {
+                blip2_image_u8_free(&img);
+                blip2_free(ctx);
+                return 1;
+            }
+
+            if (it == 0) {
+                t_first_us[m] = t_us;
+            } else {
+                t_min_us[m] = std::min(t_min_us[m], t_us);
+            }
+        }
+    }
+
+    printf("%-8s %8s %8s %14s %14s %14s\n", "encode", "images", "tokens", "first (ms)", "min (ms)", "images/s");
+    for (int m = 0; m < 2; ++m) {
+        printf("%-8s %8d %8d %14.2f %14.2f %14.2f\n", names[m], n_batch, n_tokens, t_first_us[m] / 1000.0, t_min_us[m] / 1000.0, n_batch / (t_min_us[m] / 1e6));
+    }
+
+    blip2_image_u8_free(&img);
+    blip2_free(ctx);
+
+    return 0;
+}
+
+// Encoder outputs through the embedding cache: a miss, a hit read from the cache file by a freshly
+// opened cache, and a hit in memory. The image is decoded once, keying it is part of every lookup.
+static int bench_cache(const char * fname, const char * fname_img, const char * fname_cache, int n_iter, int n_threads) {
+    struct blip2_model_params params = blip2_model_default_params();
+    params.towers = BLIP2_TOWER_VISION;
+    blip2_ctx * ctx = blip2_model_load(fname, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return 1;
+    }
+
+    image_u8 img;
+    if (!load_image_from_file(fname_img, &img)) {
+        blip2_free(ctx);
+        return 1;
+    }
+
+    const size_t n_embd = (size_t) blip2_vision_n_output_tokens(ctx) * ctx->vision_model.hparams.hidden_size;
+    std::vector<float> embd(n_embd);
+
+    const char * names[3] = { "miss", "file", "memory" };
+    int64_t t_min_us[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+    bool ok = true;
+    for (int it = 0; it < n_iter && ok; ++it) {
+        // Start from an empty file so that the first lookup misses
+        remove(fname_cache);
+        for (int m = 0; m < 3 && ok; ++m) {
+            blip2_embd_cache cache;
+            ok = blip2_embd_cache_open(&cache, fname_cache, m == 2 ? 1 : 0);
+            if (ok && m == 2) {
+                ok = blip2_vision_encode_batch_cached(ctx, &cache, &img, 1, n_threads, embd.data());
+            }
+
+            const int64_t t_start_us = ggml_time_us();
+            ok = ok && blip2_vision_encode_batch_cached(ctx, &cache, &img, 1, n_threads, embd.data());
+            t_min_us[m] = std::min(t_min_us[m], ggml_time_us() - t_start_us);
+
+            if (ok && cache.n_hits_mem + cache.n_hits_file != (m == 0 ? 0 : 1u + (m == 2))) {
+                fprintf(stderr, "%s: unexpected cache %s for the %s lookup\n", __func__, m == 0 ? "hit" : "miss", names[m]);
+                ok = false;
+            }
+        }
+    }
+
+    if (ok) {
+        printf("%-8s %14s\n", "cache", "min (ms)");
+        for (int m = 0; m < 3; ++m) {
+            printf("%-8s %14.3f\n", names[m], t_min_us[m] / 1000.0);
+        }
+    }
+
+    remove(fname_cache);
+    blip2_image_u8_free(&img);
+    blip2_free(ctx);
+
+    return ok ? 0 : 1;
+}
+
+// Q-Former over a batch of encoded images, the vision encoder runs once outside of the timing
+static int bench_qformer(const char * fname, const char * fname_img, int n_batch, int n_iter, int n_threads) {
+    struct blip2_model_params params = blip2_model_default_params();
+    params.towers = BLIP2_TOWER_VISION | BLIP2_TOWER_QFORMER;
+    blip2_ctx * ctx = blip2_model_load(fname, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return 1;
+    }
+
+    image_u8 img;
+    if (!load_image_from_file_scaled(fname_img, &img, ctx->vision_image_size)) {
+        blip2_free(ctx);
+        return 1;
+    }
+
+    const int n_tokens = blip2_vision_n_output_tokens(ctx);
+    const size_t n_embd = (size_t) n_tokens * ctx->vision_model.hparams.hidden_size;
+    std::vector<float> embd(n_batch * n_embd);
+    std::vector<float> out((size_t) n_batch * ctx->num_query_tokens * ctx->qformer_model.hparams.hidden_size);
+
+    bool ok = blip2_vision_encode_batch(ctx, &img, 1, n_threads, embd.data());
+    for (int i = 1; i < n_batch && ok; ++i) {
+        memcpy(embd.data() + i * n_embd, embd.data(), n_embd * sizeof(float));
+    }
+
+    // The keys and values of the cross-attention are projected once per image, the queries attend to them
+    // for every text the image goes with
+    const char * names[3] = { "kv", "queries", "total" };
+    int64_t t_first_us[3] = { 0, 0, 0 };
+    int64_t t_min_us[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+    blip2_qformer_kv kv;
+    for (int it = 0; it <= n_iter && ok; ++it) {
+        int64_t t_us[3];
+        int64_t t_start_us = ggml_time_us();
+        ok = blip2_qformer_project_kv(ctx, embd.data(), n_batch, n_tokens, n_threads, &kv);
+        t_us[0] = ggml_time_us() - t_start_us;
+
+        t_start_us = ggml_time_us();
+        ok = ok && blip2_qformer_encode_batch_kv(ctx, &kv, n_threads, out.data());
+        t_us[1] = ggml_time_us() - t_start_us;
+        t_us[2] = t_us[0] + t_us[1];
+
+        for (int m = 0; m < 3; ++m) {
+            if (it == 0) {
+                t_first_us[m] = t_us[m];
+            } else {
+                t_min_us[m] = std::min(t_min_us[m], t_us[m]);
+            }
+        }
+    }
+
+    if (ok) {
+        printf("%-8s %8s %8s %14s %14s %14s\n", "qformer", "images", "tokens", "first (ms)", "min (ms)", "images/s");
+        for (int m = 0; m < 3; ++m) {
+            printf("%-8s %8d %8d %14.2f %14.2f %14.2f\n", names[m], n_batch, n_tokens, t_first_us[m] / 1000.0, t_min_us[m] / 1000.0, n_batch / (t_min_us[m] / 1e6));
+        }
+    }
+
+    blip2_image_u8_free(&img);
+    blip2_free(ctx);
+
+    return ok ? 0 : 1;
+}
+
+// Ranking of n_texts candidate texts against one image with a retrieval model: one vision pass and one
+// projection of the cross-attention keys and values, then the texts in batches of the same length.
+// The texts are made up token ids of 6 to 29 tokens, [CLS] first and [SEP] last.
+static int bench_itm(const char * fname, const char * fname_img, int n_texts, int n_threads) {
+    struct blip2_model_params params = blip2_model_default_params();
+    params.towers = BLIP2_TOWER_VISION | BLIP2_TOWER_QFORMER;
+    blip2_ctx * ctx = blip2_model_load(fname, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return 1;
+    }
+
+    image_u8 img;
+    if (!load_image_from_file_scaled(fname_img, &img, ctx->vision_image_size)) {
+        blip2_free(ctx);
+        return 1;
+    }
+
+    std::vector<std::vector<blip2_vocab_id>> texts(n_texts);
+    for (int t = 0; t < n_texts; ++t) {
+        const int n_tokens = 6 + (t * 7) % 24;
+        texts[t].push_back(101);
+        for (int i = 1; i < n_tokens - 1; ++i) {
+            texts[t].push_back(1000 + (t * 31 + i * 17) % 20000);
+        }
+        texts[t].push_back(102);
+    }
+
+    const int n_tokens = blip2_vision_n_output_tokens(ctx);
+    const auto & qformer = ctx->qformer_model;
+    std::vector<float> embd((size_t) n_tokens * ctx->vision_model.hparams.hidden_size);
+    std::vector<float> image_feats((size_t) ctx->num_query_tokens * std::max(1, qformer.proj_dim));
+    std::vector<float> text_feats((size_t) n_texts * std::max(1, qformer.proj_dim));
+    std::vector<float> scores(n_texts);
+    blip2_qformer_kv kv;
+
+    const char * names[5] = { "vision", "kv", "itc", "itm", "total" };
+    int64_t t_us[5] = { 0, 0, 0, 0, 0 };
+
+    int64_t t_start_us = ggml_time_us();
+    bool ok = blip2_vision_encode_batch(ctx, &img, 1, n_threads, embd.data());
+    t_us[0] = ggml_time_us() - t_start_us;
+
+    t_start_us = ggml_time_us();
+    ok = ok && blip2_qformer_project_kv(ctx, embd.data(), 1, n_tokens, n_threads, &kv);
+    t_us[1] = ggml_time_us() - t_start_us;
+
+    t_start_us = ggml_time_us();
+    ok = ok && blip2_itc_image_features(ctx, &kv, n_threads, image_feats.data());
+    ok = ok && blip2_itc_text_features(ctx, texts.data(), n_texts, n_threads, text_feats.data());
+    if (ok) {
+        blip2_itc_scores(ctx, image_feats.data(), 1, text_feats.data(), n_texts, scores.data());
+    }
+    t_us[2] = ggml_time_us() - t_start_us;
+
+    t_start_us = ggml_time_us();
+    ok = ok && blip2_itm_scores(ctx, &kv, texts.data(), n_texts, n_threads, scores.data());
+    t_us[3] = ggml_time_us() - t_start_us;
+    t_us[4] = t_us[0] + t_us[1] + t_us[2] + t_us[3];
+
+    if (ok) {
+        printf("%-8s %8s %14s %14s\n", "itm", "texts", "time (ms)", "texts/s");
+        for (int m = 0; m < 5; ++m) {
+            printf("%-8s %8d %14.2f %14.2f\n", names[m], n_texts, t_us[m] / 1000.0, n_texts / (t_us[m] / 1e6));
+        }
+    }
+
+    blip2_image_u8_free(&img);
+    blip2_free(ctx);
+
+    return ok ? 0 : 1;
+}
+
+// Zero-shot classification against a label bank, built from labels.txt (one label per line) when bank_file
+// does not hold one yet. Only the image side runs per image, then one pass over the bank.
+static int bench_classify(const char * fname, const char * fname_img, const char * fname_labels, const char * fname_bank, int n_threads) {
+    struct blip2_model_params params = blip2_model_default_params();
+    params.towers = BLIP2_TOWER_VISION | BLIP2_TOWER_QFORMER;
+    blip2_ctx * ctx = blip2_model_load(fname, params);
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return 1;
+    }
+
+    image_u8 img;
+    if (!load_image_from_file_scaled(fname_img, &img, ctx->vision_image_size)) {
+        blip2_free(ctx);
+        return 1;
+    }
+
+    blip2_label_bank bank;
+    bool ok = blip2_label_bank_load(ctx, &bank, fname_bank);
+    if (!ok) {
+        std::vector<std::string> labels;
+        std::ifstream fin(fname_labels);
+        for (std::string line; std::getline(fin, line); ) {
+            if (!line.empty()) {
+                labels.push_back(line);
+            }
+        }
+        ok = blip2_label_bank_build(ctx, labels, "a photo of {}", n_threads, fname_bank) && blip2_label_bank_load(ctx, &bank, fname_bank);
+    }
+
+    const int k = 5;
+    const int n_tokens = blip2_vision_n_output_tokens(ctx);
+    std::vector<float> embd((size_t) n_tokens * ctx->vision_model.hparams.hidden_size);
+    std::vector<float> image_feats((size_t) ctx->num_query_tokens * std::max(1, bank.dim));
+    std::vector<int> top_ids(k);
+    std::vector<float> top_scores(k);
+    blip2_qformer_kv kv;
+
+    const char * names[4] = { "vision", "qformer", "bank", "total" };
+    int64_t t_us[4] = { 0, 0, 0, 0 };
+
+    int64_t t_start_us = ggml_time_us();
+    ok = ok && blip2_vision_encode_batch(ctx, &img, 1, n_threads, embd.data());
+    t_us[0] = ggml_time_us() - t_start_us;
+
+    t_start_us = ggml_time_us();
+    ok = ok && blip2_qformer_project_kv(ctx, embd.data(), 1, n_tokens, n_threads, &kv);
+    ok = ok && blip2_itc_image_features(ctx, &kv, n_threads, image_feats.data());
+    t_us[1] = ggml_time_us() - t_start_us;
+
+    if (ok) {
+        t_start_us = ggml_time_us();
+        blip2_label_bank_classify(ctx, &bank, image_feats.data(), 1, k, n_threads, top_ids.data(), top_scores.data());
+        t_us[2] = ggml_time_us() - t_start_us;
+        t_us[3] = t_us[0] + t_us[1] + t_us[2];
+
+        for (int j = 0; j < k && top_ids[j] >= 0; ++j) {
+            printf("%2d %8.4f %s\n", j + 1, top_scores[j], bank.labels[top_ids[j]].c_str());
+        }
+        printf("%-8s %8s %14s\n", "classify", "labels", "time (ms)");
+        for (int m = 0; m < 4; ++m) {
+            printf("%-8s %8d %14.2f\n", names[m], bank.n_labels, t_us[m] / 1000.0);
+        }
+    }
+
+    blip2_image_u8_free(&img);
+    blip2_free(ctx);
+
+    return ok ? 0 : 1;
+}
+
+// Greedy captioning: the Q-Former output and the BOS token prefilled in one graph, then one reused graph per token
+static int bench_caption(const char * fname, const char * fname_img, int max_tokens, int n_ctx, int n_threads, enum ggml_type kv_type) {
+    blip2_ctx * ctx = blip2_model_load(fname, blip2_model_default_params());
+    if (!ctx) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return 1;
+    }
+
+    image_u8 img;
+    if (!load_image_from_file_scaled(fname_img, &img, ctx->vision_image_size)) {
+        blip2_free(ctx);
+        return 1;
+    }
+
+    // BLIP-2 OPT captions start after </s> and end at a newline, "Ċ" in the byte-level vocabulary
+    const auto & vocab = ctx->vocab;
+    const blip2_vocab_id bos = vocab.token_to_id.count("</s>") ? vocab.token_to_id.at("</s>") : 2;
+    const blip2_vocab_id eos = vocab.token_to_id.count("\u010a") ? vocab.token_to_id.at("\u010a") : bos;
+
+    const int n_tokens = blip2_vision_n_output_tokens(ctx);
+    const int n_query = ctx->num_query_tokens;
+    std::vector<float> embd((size_t) n_tokens * ctx->vision_model.hparams.hidden_size);
+    std::vector<float> query((size_t) n_query * ctx->qformer_model.hparams.hidden_size);
+    std::vector<blip2_vocab_id> caption;
+    blip2_qformer_kv kv;
+    blip2_text_session session;
+
+    const char * names[4] = { "vision", "qformer", "prefill", "decode" };
+    int64_t t_us[4] = { 0, 0, 0, 0 };
+
+    int64_t t_start_us = ggml_time_us();
+    bool ok = blip2_vision_encode_batch(ctx, &img, 1, n_threads, embd.data());
+    t_us[0] = ggml_time_us() - t_start_us;
+
+    t_start_us = ggml_time_us();
+    ok = ok && blip2_qformer_project_kv(ctx, embd.data(), 1, n_tokens, n_threads, &kv);
+    ok = ok && blip2_qformer_encode_batch_kv(ctx, &kv, n_threads, query.data());
+    t_us[1] = ggml_time_us() - t_start_us;
+
+    ok = ok && blip2_text_session_init(ctx, &session, n_ctx, kv_type);
+
+    t_start_us = ggml_time_us();
+    ok = ok && blip2_text_prefill(ctx, &session, query.data(), n_query, &bos, 1, n_threads);
+    t_us[2] = ggml_time_us() - t_start_us;
+
+    t_start_us = ggml_time_us();
+    ok = ok && blip2_text_generate(ctx, &session, max_tokens, eos, n_threads, caption);
+    t_us[3] = ggml_time_us() - t_start_us;
+
+    if (ok) {
+        printf("%s\n", blip2_detokenize_bpe(vocab, caption.data(), caption.size()).c_str());
+        printf("%-8s %8s %14s %14s\n", "caption", "tokens", "time (ms)", "ms/token");
+        const int n_step[4] = { 1, 1, n_query + 1, std::max(1, (int) caption.size() - 1) };
+        for (int m = 0; m < 4; ++m) {
+            printf("%-8s %8d %14.2f %14.2f\n", names[m], n_step[m], t_us[m] / 1000.0, t_us[m] / 1000.0 / n_step[m]);
+        }
+        printf("KV cache: %s, %d positions, %.2f MB\n", ggml_type_name(session.kv.type), session.kv.n_ctx,
+               (session.kv.k.size() + session.kv.v.size()) / 1024.0 / 1024.0);
+    }
+
+    blip2_image_u8_free(&img);
+    blip2_free(ctx);
+
+    return ok ? 0 : 1;
+}
+
+// Vision self-attention alone, ggml_mul_mat + ggml_soft_max_ext against the tiled kernel,
+// on random q, k, v laid out as in the fused qkv projection of ViT-g (257 tokens, 16 heads of 88)
+static int bench_attn(int n_batch, int n_iter, int n_threads) {
+    const int n_pos = 257;
+    const int n_head = 16;
+    const int d_head = 88;
+    const int hidden_size = n_head * d_head;
+
+    struct ggml_init_params init_params = {
+        .mem_size = 64 * ggml_tensor_overhead() + 2 * ggml_graph_overhead() + 1024 * GGML_MEM_ALIGN +
+            ((size_t) 10 * hidden_size * n_pos + (size_t) 2 * n_head * n_pos * n_pos) * n_batch * sizeof(float),
+        .mem_buffer = NULL,
+        .no_alloc = false,
+    };
+    struct ggml_context * ctx0 = ggml_init(init_params);
+
+    struct ggml_tensor * qkv = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 3 * hidden_size, n_pos, n_batch);
+    float * data = (float *) qkv->data;
+    uint32_t seed = 1;
+    for (int64_t i = 0; i < ggml_nelements(qkv); ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        data[i] = (seed >> 8) / (float) (1 << 24) * 4.0f - 2.0f;
+    }
+
+    const size_t es = sizeof(float);
+    struct ggml_tensor * Q = ggml_view_4d(ctx0, qkv, d_head, n_head, n_pos, n_batch, d_head*es, qkv->nb[1], qkv->nb[2], 0);
+    struct ggml_tensor * K = ggml_view_4d(ctx0, qkv, d_head, n_head, n_pos, n_batch, d_head*es, qkv->nb[1], qkv->nb[2], hidden_size*es);
+    struct ggml_tensor * V = ggml_view_4d(ctx0, qkv, d_head, n_head, n_pos, n_batch, d_head*es, qkv->nb[1], qkv->nb[2], 2*hidden_size*es);
+
+    const char * names[2] = { "naive", "flash" };
+    struct ggml_tensor * out[2];
+    int64_t t_min_us[2] = { INT64_MAX, INT64_MAX };
+    std::vector<uint8_t> buf_work;
+    for (int m = 0; m < 2; ++m) {
+        out[m] = blip2_attention(ctx0, Q, K, V, m == 1);
+        struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+        ggml_build_forward_expand(gf, out[m]);
+
+        struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+        buf_work.resize(plan.work_size);
+        plan.work_data = buf_work.data();
+
+        for (int it = 0; it < n_iter; ++it) {
+            const int64_t t_start_us = ggml_time_us();
+            ggml_graph_compute(gf, &plan);
+            t_min_us[m] = std::min(t_min_us[m], ggml_time_us() - t_start_us);
+        }
+    }
+
+    float max_diff = 0.0f;
+    for (int64_t i = 0; i < ggml_nelements(out[0]); ++i) {
+        max_diff = std::max(max_diff, std::abs(((float *) out[0]->data)[i] - ((float *) out[1]->data)[i]));
+    }
+
+    // The naive path holds the scores and the probabilities of every head at once
+    const double scores_mb = 2.0 * n_head * n_pos * n_pos * n_batch * sizeof(float) / 1024.0 / 1024.0;
+
+    printf("%-6s %8s %14s %14s\n", "attn", "images", "min (ms)", "scores (MB)");
+    for (int m = 0; m < 2; ++m) {
+        printf("%-6s %8d %14.3f %14.2f\n", names[m], n_batch, t_min_us[m] / 1000.0, m == 0 ? scores_mb : 0.0);
+    }
+    printf("max abs diff: %g\n", max_diff);
+
+    ggml_free(ctx0);
+
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const std::string mode = argv[1];
+    if (mode == "malformed") {
+        return bench_malformed();
+    }
+    if (mode == "attn") {
+        const int n_batch = argc > 2 ? std::max(1, atoi(argv[2])) : 1;
+        const int n_iter = argc > 3 ? std::max(1, atoi(argv[3])) : 10;
+        const int n_threads = argc > 4 ? atoi(argv[4]) : (int) std::thread::hardware_concurrency();
+        return bench_attn(n_batch, n_iter, std::max(1, n_threads));
+    }
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (mode == "load") {
+        const int n_iter = argc > 3 ? std::max(1, atoi(argv[3])) : 3;
+        const int n_threads = argc > 4 ? atoi(argv[4]) : 0;
+        return bench_load(argv[2], n_iter, n_threads);
+    }
+    if (mode == "decode") {
+        const int min_size = argc > 3 ? atoi(argv[3]) : 224;
+        const int n_iter = argc > 4 ? std::max(1, atoi(argv[4])) : 10;
+        return bench_decode(argv[2], min_size, n_iter);
+    }
+    if (mode == "encode" && argc > 3) {
+        const int n_batch = argc > 4 ? std::max(1, atoi(argv[4])) : 8;
+        const int n_iter = argc > 5 ? std::max(1, atoi(argv[5])) : 3;
+        const int n_threads = argc > 6 ? atoi(argv[6]) : (int) std::thread::hardware_concurrency();
+        const int feature_layer = argc > 7 ? atoi(argv[7]) : -1;
+        const int tome_r = argc > 8 ? std::max(0, atoi(argv[8])) : 0;
+        const int image_size = argc > 9 ? std::max(0, atoi(argv[9])) : 0;
+        return bench_encode(argv[2], argv[3], n_batch, n_iter, std::max(1, n_threads), feature_layer, tome_r, image_size);
+    }
+    if (mode == "cache" && argc > 4) {
+        const int n_iter = argc > 5 ? std::max(1, atoi(argv[5])) : 3;
+        const int n_threads = argc > 6 ? atoi(argv[6]) : (int) std::thread::hardware_concurrency();
+        return bench_cache(argv[2], argv[3], argv[4], n_iter, std::max(1, n_threads));
+    }
+    if (mode == "qformer" && argc > 3) {
+        const int n_batch = argc > 4 ? std::max(1, atoi(argv[4])) : 8;
+        const int n_iter = argc > 5 ? std::max(1, atoi(argv[5])) : 3;
+        const int n_threads = argc > 6 ? atoi(argv[6]) : (int) std::thread::hardware_concurrency();
+        return bench_qformer(argv[2], argv[3], n_batch, n_iter, std::max(1, n_threads));
+    }
+    if (mode == "itm" && argc > 3) {
+        const int n_texts = argc > 4 ? std::max(1, atoi(argv[4])) : 1000;
+        const int n_threads = argc > 5 ? atoi(argv[5]) : (int) std::thread::hardware_concurrency();
+        return bench_itm(argv[2], argv[3], n_texts, std::max(1, n_threads));
+    }
+    if (mode == "classify" && argc > 5) {
+        const int n_threads = argc > 6 ? atoi(argv[6]) : (int) std::thread::hardware_concurrency();
+        return bench_classify(argv[2], argv[3], argv[4], argv[5], std::max(1, n_threads));
+    }
+    if (mode == "caption" && argc > 3) {
+        const int max_tokens = argc > 4 ? std::max(1, atoi(argv[4])) : 30;
+        const int n_ctx = argc > 5 ? atoi(argv[5]) : 0;
+        const int n_threads = argc > 6 ? atoi(argv[6]) : (int) std::thread::hardware_concurrency();
+        enum ggml_type kv_type = GGML_TYPE_F16;
+        if (argc > 7) {
+            const enum ggml_type types[4] = { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 };
+            kv_type = GGML_TYPE_COUNT;
+            for (enum ggml_type type : types) {
+                if (strcmp(argv[7], ggml_type_name(type)) == 0) {
+                    kv_type = type;
+                }
+            }
+            if (kv_type == GGML_TYPE_COUNT) {
+                fprintf(stderr, "unknown KV cache type '%s'\n", argv[7]);
+                return 1;
+            }
+        }
+        return bench_caption(argv[2], argv[3], max_tokens, n_ctx, std::max(1, n_threads), kv_type);
+    }
+    if (mode == "preprocess" && argc > 3) {
+        const int n_iter = argc > 4 ? std::max(1, atoi(argv[4])) : 100;
+        return bench_preprocess(argv[2], argv[3], n_iter);
+    }
+
+    print_usage(argv[0]);
+    return 1;
+}
@@ -1,17 +1,46 @@
+#include <atomic>
+#include <climits>
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <map>
+#include <thread>
 
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+            #include <fcntl.h>
+        #endif
+    #endif
+#endif
+
+// Largest image side decoded, larger headers are most likely corrupt and would take gigabytes to decode
+#define BLIP2_IMAGE_MAX_SIDE 16384
+
+#define STBI_MAX_DIMENSIONS BLIP2_IMAGE_MAX_SIDE
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "stb_image_write.h"
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "blip2.h"
 #include "ggml/ggml.h"
+#include "ggml/ggml-alloc.h"
 
 
 // Hparams names
+#define KEY_FILE_TYPE "general.file_type"
 #define KEY_VISION_USE_GELU "blip2.vision.use_gelu"
+#define KEY_VISION_LN_FOLDED "blip2.vision.layer_norm_folded"
 #define KEY_QFORMER_USE_GELU "blip2.q_former.use_gelu"
 #define KEY_IMAGE_SIZE "blip2.vision.image_size"
 #define KEY_PATCH_SIZE "blip2.vision.patch_size"
@@ -24,6 +53,16 @@
 #define KEY_ATTENTION_HEAD_COUNT "blip2.%s.attention.head_count"
 #define KEY_FEED_FORWARD_LENGTH "blip2.%s.feed_forward_length"
 #define KEY_ATTENTION_LAYERNORM_EPS "blip2.%s.attention.layer_norm_epsilon"
+#define KEY_ENCODER_HIDDEN_SIZE "blip2.q_former.encoder_hidden_size"
+#define KEY_CONTEXT_LENGTH "blip2.%s.context_length"
+#define KEY_TOKENS "tokenizer.ggml.tokens"
+
+// Tensor name prefixes of each tower
+#define TN_VISION_PREFIX "vision_model."
+#define TN_QFORMER_PREFIX "qformer."
+#define TN_QUERY_TOKENS "query_tokens"
+#define TN_TEXT_PREFIX "language_model."
+#define TN_LANGUAGE_PROJ_PREFIX "language_projection."
 
 // Tensor names
 // Vision
@@ -37,6 +76,40 @@
 #define V_MHA_FF2 "vision_model.encoder.layers.%d.mlp.fc2.%s"
 #define V_MHA_LN2 "vision_model.encoder.layers.%d.layer_norm2.%s"
 #define V_LN_POST "vision_model.post_layernorm.%s"
+// Q-Former
+#define Q_QUERY_TOKENS "query_tokens"
+#define Q_LN "qformer.layernorm.%s"
+#define Q_SELF_ATTN "qformer.encoder.layer.%d.attention.attention.%s.%s"
+#define Q_SELF_OUT "qformer.encoder.layer.%d.attention.output.dense.%s"
+#define Q_SELF_LN "qformer.encoder.layer.%d.attention.output.LayerNorm.%s"
+#define Q_CROSS_ATTN "qformer.encoder.layer.%d.crossattention.attention.%s.%s"
+#define Q_CROSS_OUT "qformer.encoder.layer.%d.crossattention.output.dense.%s"
+#define Q_CROSS_LN "qformer.encoder.layer.%d.crossattention.output.LayerNorm.%s"
+#define Q_FF1 "qformer.encoder.layer.%d.intermediate_query.dense.%s"
+#define Q_FF2 "qformer.encoder.layer.%d.output_query.dense.%s"
+#define Q_FF_LN "qformer.encoder.layer.%d.output_query.LayerNorm.%s"
+#define Q_FF1_TEXT "qformer.encoder.layer.%d.intermediate.dense.%s"
+#define Q_FF2_TEXT "qformer.encoder.layer.%d.output.dense.%s"
+#define Q_FF_LN_TEXT "qformer.encoder.layer.%d.output.LayerNorm.%s"
+#define Q_WORD_EMBD "embeddings.word_embeddings.weight"
+#define Q_POS_EMBD "embeddings.position_embeddings.weight"
+#define Q_EMBD_LN "embeddings.layernorm.%s"
+#define Q_VISION_PROJ "vision_projection.%s"
+#define Q_TEXT_PROJ "text_projection.%s"
+#define Q_ITM_HEAD "itm_head.%s"
+// Language model, the names longer than GGML_MAX_NAME - 1 are stored truncated
+#define T_LANGUAGE_PROJ "language_projection.%s"
+#define T_TOK_EMBD "language_model.model.decoder.embed_tokens.weight"
+#define T_POS_EMBD "language_model.model.decoder.embed_positions.weight"
+#define T_LN_F "language_model.model.decoder.final_layer_norm.%s"
+#define T_ATTN "language_model.model.decoder.layers.%d.self_attn.%s_proj.%s"
+#define T_ATTN_LN "language_model.model.decoder.layers.%d.self_attn_layer_norm.%s"
+#define T_FF1 "language_model.model.decoder.layers.%d.fc1.%s"
+#define T_FF2 "language_model.model.decoder.layers.%d.fc2.%s"
+#define T_FF_LN "language_model.model.decoder.layers.%d.final_layer_norm.%s"
+#define T_LM_HEAD "language_model.lm_head.weight"
+// The learned positions of OPT start at row 2 of embed_positions
+#define BLIP2_TEXT_POS_OFFSET 2
 
 
 static std::string format(const char * fmt, ...) {
@@ -86,6 +159,146 @@ struct ggml_tensor* get_tensor(struct ggml_context* ctx, std::string name) {
     return cur;
 }
 
+// New tensor computed from the weights at load time, owned by the model
+static struct ggml_tensor * blip2_new_derived_tensor(blip2_ctx * ctx, enum ggml_type type, int64_t ne0, int64_t ne1, const char * name) {
+    struct ggml_init_params params = {
+        .mem_size = ggml_tensor_overhead() + ggml_row_size(type, ne0) * ne1 + GGML_MEM_ALIGN,
+        .mem_buffer = NULL,
+        .no_alloc = false,
+    };
+    struct ggml_context * ctx_derived = ggml_init(params);
+    if (!ctx_derived) {
+        return NULL;
+    }
+    ctx->ctx_derived.push_back(ctx_derived);
+
+    struct ggml_tensor * cur = ggml_new_tensor_2d(ctx_derived, type, ne0, ne1);
+    ggml_set_name(cur, name);
+
+    return cur;
+}
+
+// Values of a tensor of any type as floats
+static std::vector<float> blip2_tensor_to_f32(const struct ggml_tensor * t) {
+    std::vector<float> res(ggml_nelements(t));
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(res.data(), t->data, res.size() * sizeof(float));
+    } else {
+        ggml_internal_get_type_traits(t->type).to_float(t->data, res.data(), res.size());
+    }
+
+    return res;
+}
+
+static inline float blip2_vec_dot_f32(const float * x, const float * y, int n) {
+    int i = 0;
+    float sum = 0.0f;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc);
+    }
+    sum = _mm512_reduce_add_ps(acc);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_movehdup_ps(acc4));
+    sum = _mm_cvtss_f32(acc4);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        acc = vfmaq_f32(acc, vld1q_f32(x + i), vld1q_f32(y + i));
+    }
+    sum = vaddvq_f32(acc);
+#endif
+    for (; i < n; i++) {
+        sum += x[i]*y[i];
+    }
+
+    return sum;
+}
+
+// y += a*x
+static inline void blip2_vec_mad_f32(float * y, const float * x, float a, int n) {
+    int i = 0;
+#if defined(__AVX512F__)
+    const __m512 va = _mm512_set1_ps(a);
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(_mm512_loadu_ps(x + i), va, _mm512_loadu_ps(y + i)));
+    }
+#elif defined(__AVX2__)
+    const __m256 va = _mm256_set1_ps(a);
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_mul_ps(_mm256_loadu_ps(x + i), va)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(y + i, vfmaq_n_f32(vld1q_f32(y + i), vld1q_f32(x + i), a));
+    }
+#endif
+    for (; i < n; i++) {
+        y[i] += a*x[i];
+    }
+}
+
+static const char * blip2_tower_names[BLIP2_N_TOWERS] = { "vision", "qformer", "text" };
+
+static bool starts_with(const char * str, const char * prefix) {
+    return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+// Text embeddings and image-text heads of the retrieval models, which go with the Q-Former
+static const char * blip2_qformer_head_prefixes[] = { "embeddings.", "vision_projection.", "text_projection.", "itm_head." };
+
+// Tower a tensor belongs to, or 0 if it is not part of any known tower
+// The query tokens are only consumed by the Q-Former and the language projection only feeds the text model
+static int blip2_tensor_tower(const char * name) {
+    if (starts_with(name, TN_VISION_PREFIX)) {
+        return BLIP2_TOWER_VISION;
+    }
+    if (starts_with(name, TN_QFORMER_PREFIX) || starts_with(name, TN_QUERY_TOKENS)) {
+        return BLIP2_TOWER_QFORMER;
+    }
+    for (const char * prefix : blip2_qformer_head_prefixes) {
+        if (starts_with(name, prefix)) {
+            return BLIP2_TOWER_QFORMER;
+        }
+    }
+    if (starts_with(name, TN_TEXT_PREFIX) || starts_with(name, TN_LANGUAGE_PROJ_PREFIX)) {
+        return BLIP2_TOWER_TEXT;
+    }
+
+    return 0;
+}
+
+// Index of the vision encoder layer a tensor belongs to, -1 for the other tensors
+static int blip2_vision_layer_index(const char * name) {
+    int il = -1;
+    if (sscanf(name, TN_VISION_PREFIX "encoder.layers.%d.", &il) != 1) {
+        return -1;
+    }
+
+    return il;
+}
+
+// Unknown tensors are only kept when the whole model is requested,
+// vision layers past the last one that runs are never needed
+static bool blip2_tensor_wanted(const char * name, uint32_t towers, int n_vision_layer) {
+    const int tower = blip2_tensor_tower(name);
+    if (tower == 0) {
+        return towers == BLIP2_TOWER_ALL;
+    }
+    if (blip2_vision_layer_index(name) >= n_vision_layer) {
+        return false;
+    }
+
+    return (towers & tower) != 0;
+}
+
 // Function to print the shape of a tensor
 void printShape(struct ggml_tensor* tensor) {
     int p = GGML_MAX_DIMS - 1; // Start from the last element
@@ -113,6 +326,15 @@ void printTensorInfo(struct ggml_tensor* tensor) {
     }
 }
 
+// The stb_image buffer is kept as the image data, it is released with stbi_image_free
+static void blip2_image_adopt_stb(image_u8* img, uint8_t* data, int nx, int ny) {
+    img->nx = nx;
+    img->ny = ny;
+    img->size = (size_t) nx * ny * 3;
+    img->data = data;
+    img->owner = BLIP2_IMAGE_OWNER_STB;
+}
+
 bool load_image_from_file(const char* fname, image_u8* img) {
     int nx, ny, nc;
     auto data = stbi_load(fname, &nx, &ny, &nc, 3);
@@ -121,275 +343,4744 @@ bool load_image_from_file(const char* fname, image_u8* img) {
         return false;
     }
 
-    img->nx = nx;
-    img->ny = ny;
-    img->size = nx * ny * 3;
-    img->data = new uint8_t[img->size]();
-    memcpy(img->data, data, img->size);
-
-    stbi_image_free(data);
+    blip2_image_adopt_stb(img, data, nx, ny);
 
     return true;
 }
 
-bool blip2_image_preprocess(const blip2_ctx* ctx, const image_u8* img, image_f32* res) {
-    const int nx = img->nx;
-    const int ny = img->ny;
-
-    const int nx2 = ctx->vision_model.hparams.image_size;
-    const int ny2 = ctx->vision_model.hparams.image_size;
-
-    res->nx = nx2;
-    res->ny = ny2;
-    res->size = 3 * nx2 * ny2;
-    res->data = new float[res->size]();
-
-    const float scale = std::max(nx, ny) / (float)ctx->vision_model.hparams.image_size;
-
-    const int nx3 = int(nx / scale + 0.5f);
-    const int ny3 = int(ny / scale + 0.5f);
+void blip2_image_u8_free(image_u8* img) {
+    switch (img->owner) {
+        case BLIP2_IMAGE_OWNER_NEW: delete[] img->data; break;
+        case BLIP2_IMAGE_OWNER_STB: stbi_image_free(img->data); break;
+        case BLIP2_IMAGE_OWNER_NONE: break;
+    }
+    img->data = NULL;
+    img->size = 0;
+    img->owner = BLIP2_IMAGE_OWNER_NONE;
+}
 
-    const auto & m3 = ctx->image_mean;
-    const auto & s3 = ctx->image_std;
+// Reduced-resolution JPEG decoding
+//
+// Baseline and extended sequential Huffman JPEGs are decoded with a scaled IDCT that keeps only the
+// N x N lowest frequencies of each 8x8 block, which yields the image at 1/2, 1/4 or 1/8 of its size
+// without ever producing the full resolution pixels. Progressive, arithmetic coded, 12-bit and CMYK
+// files are left to stb_image.
 
-    for (int y = 0; y < ny3; y++) {
-        for (int x = 0; x < nx3; x++) {
-            for (int c = 0; c < 3; c++) {
-                // linear interpolation
-                const float sx = (x + 0.5f) * scale - 0.5f;
-                const float sy = (y + 0.5f) * scale - 0.5f;
+#define BLIP2_JPEG_FAST_BITS 9
 
-                const int x0 = std::max(0, (int)std::floor(sx));
-                const int y0 = std::max(0, (int)std::floor(sy));
+// Natural order index of the k-th coefficient in zigzag order
+static const uint8_t blip2_jpeg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
 
-                const int x1 = std::min(x0 + 1, nx - 1);
-                const int y1 = std::min(y0 + 1, ny - 1);
+struct blip2_jpeg_huffman {
+    uint8_t fast_len[1 << BLIP2_JPEG_FAST_BITS];
+    uint8_t fast_sym[1 << BLIP2_JPEG_FAST_BITS];
+    // AC code and its value in one lookup: value << 8 | run << 4 | total length, 0 if they do not fit
+    int16_t fast_ac[1 << BLIP2_JPEG_FAST_BITS];
+    int32_t maxcode[17];
+    int32_t valoff[17];
+    uint8_t values[256];
+};
 
-                const float dx = sx - x0;
-                const float dy = sy - y0;
+struct blip2_jpeg_component {
+    int id;
+    int h;
+    int v;
+    int tq;
+    int td;
+    int ta;
+    int dc_pred;
+    bool scanned;
 
-                const int j00 = 3 * (y0 * nx + x0) + c;
-                const int j01 = 3 * (y0 * nx + x1) + c;
-                const int j10 = 3 * (y1 * nx + x0) + c;
-                const int j11 = 3 * (y1 * nx + x1) + c;
+    // Blocks per row and column, padded to whole MCUs, and the decoded samples at N per block side
+    int bw;
+    int bh;
+    std::vector<uint8_t> plane;
+};
 
-                const float v00 = img->data[j00];
-                const float v01 = img->data[j01];
-                const float v10 = img->data[j10];
-                const float v11 = img->data[j11];
+struct blip2_jpeg_decoder {
+    const uint8_t * p;
+    const uint8_t * end;
 
-                const float v0 = v00 * (1.0f - dx) + v01 * dx;
-                const float v1 = v10 * (1.0f - dx) + v11 * dx;
+    // Tables are only used once a DQT / DHT segment has defined them
+    uint16_t qt[4][64] = {};
+    blip2_jpeg_huffman huff[2][4] = {};
+    bool qt_defined[4] = {};
+    bool huff_defined[2][4] = {};
+    std::vector<blip2_jpeg_component> comps;
 
-                const float v = v0 * (1.0f - dy) + v1 * dy;
+    int width = 0;
+    int height = 0;
+    int hmax = 1;
+    int vmax = 1;
+    int mcux = 0;
+    int mcuy = 0;
+    int restart_interval = 0;
+    int adobe_transform = -1;
 
-                const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
+    // Samples per block side
+    int n = 0;
 
-                const int i = 3 * (y * nx3 + x) + c;
+    // Entropy coded data, MSB aligned
+    uint32_t acc = 0;
+    int nbits = 0;
+    bool marker = false;
+};
 
-                res->data[i] = ((float(v2) / 255.0f) - m3[c]) / s3[c];
+static void blip2_jpeg_fill(blip2_jpeg_decoder & dec) {
+    while (dec.nbits <= 24) {
+        uint32_t b = 0;
+        if (!dec.marker && dec.p < dec.end) {
+            b = *dec.p++;
+            if (b == 0xFF) {
+                if (dec.p < dec.end && *dec.p == 0) {
+                    dec.p++;
+                } else {
+                    // A marker ends the entropy coded data, the decoder sees zeros from here on
+                    dec.marker = true;
+                    dec.p--;
+                    b = 0;
+                }
             }
         }
+        dec.acc |= b << (24 - dec.nbits);
+        dec.nbits += 8;
     }
-
-    return true;
 }
 
-void blip2_free(blip2_ctx* ctx) {
-    ggml_free(ctx->ctx);
-    gguf_free(ctx->ctx_gguf);
-    delete ctx;
+static int blip2_jpeg_bits(blip2_jpeg_decoder & dec, int k) {
+    if (k == 0) {
+        return 0;
+    }
+    if (dec.nbits < k) {
+        blip2_jpeg_fill(dec);
+    }
+    const int v = dec.acc >> (32 - k);
+    dec.acc <<= k;
+    dec.nbits -= k;
+    return v;
 }
 
-struct blip2_ctx* blip2_model_load(const char* fname) {
-    struct ggml_context* meta = NULL;
+// Value of an s-bit magnitude category
+static int blip2_jpeg_extend(int v, int s) {
+    return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
 
-    struct gguf_init_params params = {
-        /*.no_alloc = */ true,
-        /*.ctx      = */ &meta,
-    };
+static int blip2_jpeg_decode_huffman(blip2_jpeg_decoder & dec, const blip2_jpeg_huffman & h) {
+    if (dec.nbits < 16) {
+        blip2_jpeg_fill(dec);
+    }
 
-    struct gguf_context* ctx = gguf_init_from_file(fname, params);
+    const uint32_t idx = dec.acc >> (32 - BLIP2_JPEG_FAST_BITS);
+    if (h.fast_len[idx]) {
+        const int len = h.fast_len[idx];
+        dec.acc <<= len;
+        dec.nbits -= len;
+        return h.fast_sym[idx];
+    }
 
-    if (!ctx) {
-        std::cerr << "Failed to initialize gguf_context" << std::endl;
-        return nullptr;
+    for (int l = BLIP2_JPEG_FAST_BITS + 1; l <= 16; l++) {
+        const int32_t code = dec.acc >> (32 - l);
+        if (code <= h.maxcode[l]) {
+            dec.acc <<= l;
+            dec.nbits -= l;
+            return h.values[code + h.valoff[l]];
         }
+    }
 
-    // Compute context size
-    size_t ctx_size = 0;
-    size_t vision_ctx_size = 0;
-    {
-        const int n_tensors = gguf_get_n_tensors(ctx);
-
-        for (int i = 0; i < n_tensors; ++i) {
-            const char * name = gguf_get_tensor_name(ctx, i);
-            const size_t offset = gguf_get_tensor_offset(ctx, i);
+    return -1;
+}
 
-            struct ggml_tensor * cur = ggml_get_tensor(meta, name);
-            ctx_size += sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE;
-            size_t tensor_size = ggml_nbytes(cur);
-            size_t padded_size = ggml_nbytes_pad(cur);
-            ctx_size += padded_size;
+static bool blip2_jpeg_build_huffman(blip2_jpeg_huffman & h, const uint8_t * counts, const uint8_t * values, int n_values) {
+    memset(h.fast_len, 0, sizeof(h.fast_len));
+    memcpy(h.values, values, n_values);
 
-            if (strncmp(name, "vision_model", strlen("vision_model")) == 0) {
-                vision_ctx_size += sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE;
-                vision_ctx_size += padded_size;
+    int code = 0;
+    int k = 0;
+    for (int l = 1; l <= 16; l++) {
+        h.valoff[l] = k - code;
+        for (int i = 0; i < counts[l - 1]; i++, code++, k++) {
+            // An over-subscribed table has more codes of this length than fit in l bits
+            if (code >= (1 << l)) {
+                return false;
+            }
+            if (l <= BLIP2_JPEG_FAST_BITS) {
+                const int shift = BLIP2_JPEG_FAST_BITS - l;
+                for (int j = 0; j < (1 << shift); j++) {
+                    h.fast_len[(code << shift) | j] = l;
+                    h.fast_sym[(code << shift) | j] = values[k];
+                }
             }
         }
+        h.maxcode[l] = counts[l - 1] ? code - 1 : -1;
+        code <<= 1;
     }
 
+    for (int i = 0; i < (1 << BLIP2_JPEG_FAST_BITS); i++) {
+        h.fast_ac[i] = 0;
+        const int len = h.fast_len[i];
+        const int r = h.fast_sym[i] >> 4;
+        const int s = h.fast_sym[i] & 15;
+        if (len && s && len + s <= BLIP2_JPEG_FAST_BITS) {
+            const int v = blip2_jpeg_extend(((i << len) & ((1 << BLIP2_JPEG_FAST_BITS) - 1)) >> (BLIP2_JPEG_FAST_BITS - s), s);
+            if (v >= -128 && v <= 127) {
+                h.fast_ac[i] = (int16_t)(v * 256 + r * 16 + len + s);
+            }
+        }
+    }
 
-    blip2_ctx* new_blip2 = new blip2_ctx;
-
+    return true;
+}
 
-    // Model configuration
-    {
-        int idx = gguf_find_key(ctx, KEY_VISION_USE_GELU);
-        new_blip2->vision_gelu = gguf_get_val_bool(ctx, idx);
+// Byte align and consume the RSTn marker expected after every restart_interval MCUs
+static bool blip2_jpeg_restart(blip2_jpeg_decoder & dec, const std::vector<int> & scan) {
+    dec.acc = 0;
+    dec.nbits = 0;
+    while (dec.p + 1 < dec.end && !(dec.p[0] == 0xFF && dec.p[1] >= 0xD0 && dec.p[1] <= 0xD7)) {
+        dec.p++;
+    }
+    if (dec.p + 1 >= dec.end) {
+        return false;
+    }
+    dec.p += 2;
+    dec.marker = false;
+    for (int ci : scan) {
+        dec.comps[ci].dc_pred = 0;
+    }
 
-        idx = gguf_find_key(ctx, KEY_QFORMER_USE_GELU);
-        new_blip2->qformer_gelu = gguf_get_val_bool(ctx, idx);
+    return true;
+}
 
-        idx = gguf_find_key(ctx, NUM_QUERY_TOKENS);
-        new_blip2->num_query_tokens = gguf_get_val_u32(ctx, idx);
+// N-point IDCT of the N lowest frequencies, x[k] = sum_u C(u)/2 F(u) cos((2k+1) u pi / 2N)
+template <int N>
+static inline void blip2_jpeg_idct_1d(const float * f, int sf, float * x, int sx) {
+    const float c4 = 0.353553391f; // cos(pi/4)/2
+    if (N == 2) {
+        x[0]  = c4 * (f[0] + f[sf]);
+        x[sx] = c4 * (f[0] - f[sf]);
+    } else {
+        const float c1 = 0.461939766f; // cos(pi/8)/2
+        const float c3 = 0.191341716f; // cos(3pi/8)/2
+        const float e0 = c4 * (f[0] + f[2 * sf]);
+        const float e1 = c4 * (f[0] - f[2 * sf]);
+        const float o0 = c1 * f[sf] + c3 * f[3 * sf];
+        const float o1 = c3 * f[sf] - c1 * f[3 * sf];
+        x[0]      = e0 + o0;
+        x[sx]     = e1 + o1;
+        x[2 * sx] = e1 - o1;
+        x[3 * sx] = e0 - o0;
+    }
+}
 
-        idx = gguf_find_key(ctx, CROSS_ATTENTION_FREQUENCY);
-        new_blip2->cross_attention_frequency = gguf_get_val_u32(ctx, idx);
+// 2-D IDCT of the N x N low frequencies of a dequantized block, level shifted to uint8
+template <int N>
+static void blip2_jpeg_idct(const int32_t * blk, bool ac, uint8_t * out, int stride) {
+    if (!ac || N == 1) {
+        // Flat block, every basis function of u = 0 is 1/(2 sqrt(2))
+        const float v = blk[0] * 0.125f + 128.0f;
+        const uint8_t p = (uint8_t) std::min(std::max(v + 0.5f, 0.0f), 255.0f);
+        for (int y = 0; y < N; y++) {
+            memset(out + y * stride, p, N);
+        }
+        return;
     }
 
+    float f[N][N];
+    for (int v = 0; v < N; v++) {
+        for (int u = 0; u < N; u++) {
+            f[v][u] = (float) blk[v * 8 + u];
+        }
+    }
 
-    // Load tensors
-    {
-        struct ggml_init_params params = {
-            .mem_size = ctx_size,
-            .mem_buffer = NULL,
-            .no_alloc = false,
-        };
+    // Rows then columns
+    float tmp[N][N];
+    float res[N][N];
+    for (int v = 0; v < N; v++) {
+        blip2_jpeg_idct_1d<N>(f[v], 1, tmp[v], 1);
+    }
+    for (int x = 0; x < N; x++) {
+        blip2_jpeg_idct_1d<N>(&tmp[0][x], N, &res[0][x], N);
+    }
 
-        new_blip2->ctx = ggml_init(params);
-        if (!new_blip2->ctx) {
-            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
-            blip2_free(new_blip2);
-            return nullptr;
+    for (int y = 0; y < N; y++) {
+        for (int x = 0; x < N; x++) {
+            out[y * stride + x] = (uint8_t) std::min(std::max(res[y][x] + 128.5f, 0.0f), 255.0f);
         }
+    }
+}
 
-        auto fin = std::ifstream(fname, std::ios::binary);
-        if (!fin) {
-            printf("cannot open model file for loading tensors\n");
-            blip2_free(new_blip2);
-            return nullptr;
-        }
+// Entropy decode one block and write its N x N samples at block position (bx, by) of the component plane
+static bool blip2_jpeg_decode_block(blip2_jpeg_decoder & dec, blip2_jpeg_component & comp, int bx, int by) {
+    const uint16_t * q = dec.qt[comp.tq];
+    const int n = dec.n;
+    int32_t blk[64] = { 0 };
 
-        const int n_tensors = gguf_get_n_tensors(ctx);
-        for (int i = 0; i < n_tensors; ++i) {
-            const char * name = gguf_get_tensor_name(ctx, i);
-            struct ggml_tensor * t = ggml_get_tensor(meta, name);
-            struct ggml_tensor * cur = ggml_dup_tensor(new_blip2->ctx, t);
-            ggml_set_name(cur, name);
-            
-            size_t data_offset = gguf_get_data_offset(ctx);
-            size_t tensor_offset = gguf_get_tensor_offset(ctx, i);
+    const int t = blip2_jpeg_decode_huffman(dec, dec.huff[0][comp.td]);
+    if (t < 0 || t > 11) {
+        return false;
+    }
+    comp.dc_pred += t ? blip2_jpeg_extend(blip2_jpeg_bits(dec, t), t) : 0;
+    blk[0] = comp.dc_pred * q[0];
 
-            const size_t offset = data_offset + tensor_offset;
-            fin.seekg(offset, std::ios::beg);
-            if (!fin) {
-                printf("%s: failed to seek for tensor %s\n", __func__, name);
-                blip2_free(new_blip2);
-                return nullptr;
+    // All AC codes have to be read, only the low frequencies are kept
+    const blip2_jpeg_huffman & ac = dec.huff[1][comp.ta];
+    bool ac_kept = false;
+    for (int k = 1; k < 64;) {
+        if (dec.nbits < 16) {
+            blip2_jpeg_fill(dec);
+        }
+        const int fac = ac.fast_ac[dec.acc >> (32 - BLIP2_JPEG_FAST_BITS)];
+        if (fac) {
+            k += (fac >> 4) & 15;
+            dec.acc <<= fac & 15;
+            dec.nbits -= fac & 15;
+            if (k > 63) {
+                return false;
+            }
+            const int z = blip2_jpeg_zigzag[k];
+            if ((z & 7) < n && (z >> 3) < n) {
+                blk[z] = (fac >> 8) * q[k];
+                ac_kept = true;
             }
+            k++;
+            continue;
+        }
 
-            // Because of limited memory, read each component's tensors for debugging before reading everything
-            // fin.read(reinterpret_cast<char *>(cur->data), ggml_nbytes(t));
+        const int rs = blip2_jpeg_decode_huffman(dec, ac);
+        if (rs < 0) {
+            return false;
+        }
+        const int r = rs >> 4;
+        const int s = rs & 15;
+        if (s == 0) {
+            if (r != 15) {
+                break;
+            }
+            k += 16;
+            continue;
+        }
+        k += r;
+        if (k > 63) {
+            return false;
         }
-        fin.close();
+        const int v = blip2_jpeg_bits(dec, s);
+        const int z = blip2_jpeg_zigzag[k];
+        if ((z & 7) < n && (z >> 3) < n) {
+            blk[z] = blip2_jpeg_extend(v, s) * q[k];
+            ac_kept = true;
+        }
+        k++;
     }
 
+    const int stride = comp.bw * n;
+    uint8_t * out = comp.plane.data() + (size_t)(by * n) * stride + bx * n;
 
-    // Load vision model
-    {
-        // Vision config and hparams
-        auto &vision_model = new_blip2->vision_model;
-        auto &hparams = vision_model.hparams;
+    switch (n) {
+        case 1: blip2_jpeg_idct<1>(blk, ac_kept, out, stride); break;
+        case 2: blip2_jpeg_idct<2>(blk, ac_kept, out, stride); break;
+        case 4: blip2_jpeg_idct<4>(blk, ac_kept, out, stride); break;
+        default: return false;
+    }
 
-        hparams.image_size = get_u32(ctx, KEY_IMAGE_SIZE);
-        hparams.patch_size = get_u32(ctx, KEY_PATCH_SIZE);
-        
-        hparams.hidden_size = get_u32(ctx, format(KEY_EMBEDDING_LENGTH, "vision"));
-        hparams.n_layer = get_u32(ctx, format(KEY_BLOCK_COUNT, "vision"));
-        hparams.n_head = get_u32(ctx, format(KEY_ATTENTION_HEAD_COUNT, "vision"));
-        hparams.n_intermediate = get_u32(ctx, format(KEY_FEED_FORWARD_LENGTH, "vision"));
-        hparams.eps = get_f32(ctx, format(KEY_ATTENTION_LAYERNORM_EPS, "vision"));
+    return true;
+}
 
-        int idx_mean = get_key_idx(ctx, KEY_IMAGE_MEAN);
-        int idx_std = get_key_idx(ctx, KEY_IMAGE_STD);
-        for (int i = 0; i < 3; ++i) {
-            new_blip2->image_mean[i] = *((float *)gguf_get_arr_data(ctx, idx_mean));
-            new_blip2->image_std[i] = *((float *)gguf_get_arr_data(ctx, idx_std));
-        }
+static bool blip2_jpeg_decode_scan(blip2_jpeg_decoder & dec, const std::vector<int> & scan) {
+    dec.acc = 0;
+    dec.nbits = 0;
+    dec.marker = false;
+    for (int ci : scan) {
+        dec.comps[ci].dc_pred = 0;
+    }
 
-        // Load vision weights
-        vision_model.patch_embeddings_w = get_tensor(new_blip2->ctx, format(V_PATCH_EMBD, "weight"));
-        vision_model.patch_embeddings_b = get_tensor(new_blip2->ctx, format(V_PATCH_EMBD, "bias"));
-        vision_model.class_embedding = get_tensor(new_blip2->ctx, V_CLASS_EMBD);
-        vision_model.position_embeddings = get_tensor(new_blip2->ctx, V_POS_EMBD);
+    // A single component scan is not interleaved, its MCU is one block and it only covers the component itself
+    const bool single = scan.size() == 1;
+    int units_x = dec.mcux;
+    int units_y = dec.mcuy;
+    if (single) {
+        const blip2_jpeg_component & comp = dec.comps[scan[0]];
+        units_x = ((dec.width * comp.h + dec.hmax - 1) / dec.hmax + 7) / 8;
+        units_y = ((dec.height * comp.v + dec.vmax - 1) / dec.vmax + 7) / 8;
+    }
 
-        vision_model.layers.resize(hparams.n_layer);
-        for (int i = 0; i < hparams.n_layer; ++i) {
-            auto & layer = vision_model.layers[i];
-            layer.qkv_w = get_tensor(new_blip2->ctx, format(V_QKV, i, "weight"));
-            layer.qkv_b = get_tensor(new_blip2->ctx, format(V_QKV, i, "bias"));
-            
-            layer.proj_w = get_tensor(new_blip2->ctx, format(V_MHA_PROJ, i, "weight"));
-            layer.proj_b = get_tensor(new_blip2->ctx, format(V_MHA_PROJ, i, "bias"));
+    int n_units = 0;
+    for (int uy = 0; uy < units_y; uy++) {
+        for (int ux = 0; ux < units_x; ux++) {
+            if (dec.restart_interval && n_units > 0 && n_units % dec.restart_interval == 0) {
+                if (!blip2_jpeg_restart(dec, scan)) {
+                    return false;
+                }
+            }
+            n_units++;
 
-            layer.ln_1_w = get_tensor(new_blip2->ctx, format(V_MHA_LN1, i, "weight"));
-            layer.ln_1_b = get_tensor(new_blip2->ctx, format(V_MHA_LN1, i, "bias"));
-            
-            layer.ff_1_w = get_tensor(new_blip2->ctx, format(V_MHA_FF1, i, "weight"));
-            layer.ff_1_b = get_tensor(new_blip2->ctx, format(V_MHA_FF1, i, "bias"));
-            layer.ff_2_w = get_tensor(new_blip2->ctx, format(V_MHA_FF2, i, "weight"));
-            layer.ff_2_b = get_tensor(new_blip2->ctx, format(V_MHA_FF2, i, "bias"));
-            
-            layer.ln_2_w = get_tensor(new_blip2->ctx, format(V_MHA_LN2, i, "weight"));
-            layer.ln_2_b = get_tensor(new_blip2->ctx, format(V_MHA_LN2, i, "bias"));
+            if (single) {
+                if (!blip2_jpeg_decode_block(dec, dec.comps[scan[0]], ux, uy)) {
+                    return false;
+                }
+                continue;
+            }
+            for (int ci : scan) {
+                blip2_jpeg_component & comp = dec.comps[ci];
+                for (int v = 0; v < comp.v; v++) {
+                    for (int h = 0; h < comp.h; h++) {
+                        if (!blip2_jpeg_decode_block(dec, comp, ux * comp.h + h, uy * comp.v + v)) {
+                            return false;
+                        }
+                    }
+                }
+            }
         }
+    }
 
-        vision_model.post_ln_w = get_tensor(new_blip2->ctx, format(V_LN_POST, "weight"));
-        vision_model.post_ln_b = get_tensor(new_blip2->ctx, format(V_LN_POST, "bias"));
+    for (int ci : scan) {
+        dec.comps[ci].scanned = true;
     }
 
-    ggml_free(meta);
-    new_blip2->ctx_gguf = ctx;
+    return true;
+}
 
-    return new_blip2;
+static bool blip2_jpeg_parse_frame(blip2_jpeg_decoder & dec, const uint8_t * seg, int len, int min_size) {
+    if (len < 6 || seg[0] != 8) {
+        return false;
+    }
+    dec.height = (seg[1] << 8) | seg[2];
+    dec.width = (seg[3] << 8) | seg[4];
+    const int nc = seg[5];
+    if (dec.width == 0 || dec.height == 0 || (nc != 1 && nc != 3) || len < 6 + 3 * nc) {
+        return false;
+    }
+    // Rejected before the planes are allocated, stb then reports it too large
+    if (dec.width > BLIP2_IMAGE_MAX_SIDE || dec.height > BLIP2_IMAGE_MAX_SIDE) {
+        return false;
+    }
+
+    // Largest reduction that keeps the longer side at least min_size, a full size decode is left to stb
+    const int max_side = std::max(dec.width, dec.height);
+    int d = 8;
+    while (d > 1 && (max_side + d - 1) / d < min_size) {
+        d /= 2;
+    }
+    if (d == 1) {
+        return false;
+    }
+    dec.n = 8 / d;
+
+    dec.comps.resize(nc);
+    for (int i = 0; i < nc; i++) {
+        blip2_jpeg_component & comp = dec.comps[i];
+        comp.id = seg[6 + 3 * i];
+        comp.h = nc == 1 ? 1 : seg[7 + 3 * i] >> 4;
+        comp.v = nc == 1 ? 1 : seg[7 + 3 * i] & 15;
+        comp.tq = seg[8 + 3 * i];
+        comp.scanned = false;
+        if (comp.h < 1 || comp.h > 4 || comp.v < 1 || comp.v > 4 || comp.tq > 3) {
+            return false;
+        }
+        dec.hmax = std::max(dec.hmax, comp.h);
+        dec.vmax = std::max(dec.vmax, comp.v);
+    }
+
+    dec.mcux = (dec.width + 8 * dec.hmax - 1) / (8 * dec.hmax);
+    dec.mcuy = (dec.height + 8 * dec.vmax - 1) / (8 * dec.vmax);
+    for (auto & comp : dec.comps) {
+        if (dec.hmax % comp.h || dec.vmax % comp.v) {
+            return false;
+        }
+        comp.bw = dec.mcux * comp.h;
+        comp.bh = dec.mcuy * comp.v;
+        comp.plane.resize((size_t)(comp.bw * dec.n) * (comp.bh * dec.n));
+    }
+
+    return true;
 }
 
-int main() {
-    const char* filename = "../models/blip2-opt-2.7b_ggml-two_tower_blip2-1.gguf";
-    blip2_ctx* new_blip2  = blip2_model_load(filename);
-    blip2_free(new_blip2);
+static bool blip2_jpeg_decode(const uint8_t * buf, size_t len, int min_size, image_u8 * img, blip2_buffer * arena) {
+    if (len < 4 || buf[0] != 0xFF || buf[1] != 0xD8 || min_size <= 0) {
+        return false;
+    }
+
+    blip2_jpeg_decoder dec;
+    dec.p = buf + 2;
+    dec.end = buf + len;
+
+    while (true) {
+        while (dec.p < dec.end && *dec.p != 0xFF) {
+            dec.p++;
+        }
+        while (dec.p < dec.end && *dec.p == 0xFF) {
+            dec.p++;
+        }
+        if (dec.p >= dec.end) {
+            break;
+        }
+        const int m = *dec.p++;
+        if (m == 0xD9) {
+            break;
+        }
+        if (m == 0x00 || m == 0x01 || (m >= 0xD0 && m <= 0xD8)) {
+            continue;
+        }
+        if (dec.end - dec.p < 2) {
+            return false;
+        }
+        const int seg_len = ((dec.p[0] << 8) | dec.p[1]) - 2;
+        if (seg_len < 0 || dec.end - dec.p < seg_len + 2) {
+            return false;
+        }
+        const uint8_t * seg = dec.p + 2;
+        dec.p += seg_len + 2;
 
-    // Image testing
-    const char* img_filename = "../pascal_muller_panda.jpg";
-    image_u8 img;
-    if (load_image_from_file(img_filename, &img)) {
-        std::cout << "Image Properties:" << std::endl;
-        std::cout << "nx: " << img.nx << std::endl;
-        std::cout << "ny: " << img.ny << std::endl;
-        std::cout << "size: " << img.size << std::endl;
+        switch (m) {
+            case 0xDB: // DQT
+                for (int i = 0; i < seg_len;) {
+                    const int pq = seg[i] >> 4;
+                    const int tq = seg[i] & 15;
+                    if (tq > 3 || pq > 1 || i + 1 + 64 * (pq + 1) > seg_len) {
+                        return false;
+                    }
+                    for (int k = 0; k < 64; k++) {
+                        dec.qt[tq][k] = pq ? (seg[i + 1 + 2 * k] << 8) | seg[i + 2 + 2 * k] : seg[i + 1 + k];
+                    }
+                    dec.qt_defined[tq] = true;
+                    i += 1 + 64 * (pq + 1);
+                }
+                break;
+            case 0xC4: // DHT
+                for (int i = 0; i < seg_len;) {
+                    if (i + 17 > seg_len) {
+                        return false;
+                    }
+                    const int tc = seg[i] >> 4;
+                    const int th = seg[i] & 15;
+                    int n_values = 0;
+                    for (int l = 0; l < 16; l++) {
+                        n_values += seg[i + 1 + l];
+                    }
+                    if (tc > 1 || th > 3 || n_values > 256 || i + 17 + n_values > seg_len) {
+                        return false;
+                    }
+                    if (!blip2_jpeg_build_huffman(dec.huff[tc][th], seg + i + 1, seg + i + 17, n_values)) {
+                        return false;
+                    }
+                    dec.huff_defined[tc][th] = true;
+                    i += 17 + n_values;
+                }
+                break;
+            case 0xC0: // SOF0, baseline
+            case 0xC1: // SOF1, extended sequential with Huffman coding
+                if (!dec.comps.empty() || !blip2_jpeg_parse_frame(dec, seg, seg_len, min_size)) {
+                    return false;
+                }
+                break;
+            case 0xDD: // DRI
+                if (seg_len < 2) {
+                    return false;
+                }
+                dec.restart_interval = (seg[0] << 8) | seg[1];
+                break;
+            case 0xEE: // APP14, Adobe tells whether three components are RGB or YCbCr
+                if (seg_len >= 12 && memcmp(seg, "Adobe", 5) == 0) {
+                    dec.adobe_transform = seg[11];
+                }
+                break;
+            case 0xDA: // SOS
+                {
+                    if (dec.comps.empty() || seg_len < 1) {
+                        return false;
+                    }
+                    const int ns = seg[0];
+                    if (ns < 1 || ns > (int) dec.comps.size() || seg_len < 4 + 2 * ns) {
+                        return false;
+                    }
+                    std::vector<int> scan;
+                    for (int i = 0; i < ns; i++) {
+                        int ci = 0;
+                        while (ci < (int) dec.comps.size() && dec.comps[ci].id != seg[1 + 2 * i]) {
+                            ci++;
+                        }
+                        if (ci == (int) dec.comps.size() || (seg[2 + 2 * i] >> 4) > 3 || (seg[2 + 2 * i] & 15) > 3) {
+                            return false;
+                        }
+                        dec.comps[ci].td = seg[2 + 2 * i] >> 4;
+                        dec.comps[ci].ta = seg[2 + 2 * i] & 15;
+                        // A malformed file may refer to tables it never defined
+                        if (!dec.qt_defined[dec.comps[ci].tq] || !dec.huff_defined[0][dec.comps[ci].td] || !dec.huff_defined[1][dec.comps[ci].ta]) {
+                            return false;
+                        }
+                        scan.push_back(ci);
+                    }
+                    if (!blip2_jpeg_decode_scan(dec, scan)) {
+                        return false;
+                    }
+                }
+                break;
+            default:
+                // Other frame types are not sequential Huffman, everything else can be skipped
+                if (m >= 0xC2 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+                    return false;
+                }
+                break;
+        }
+    }
 
-        // Print the first 20 pixel values in the top left corner
-        std::cout << "Top Left Corner Pixel Values:" << std::endl;
-        for (int i = 0; i < 20; i++) {
-            std::cout << "Pixel " << i + 1 << ": ";
-            std::cout << static_cast<int>(img.data[i]) << std::endl; // Assuming uint8_t represents pixel values
+    if (dec.comps.empty()) {
+        return false;
+    }
+    for (const auto & comp : dec.comps) {
+        if (!comp.scanned) {
+            return false;
         }
+    }
 
-        delete[] img.data; // Free the image data memory when done
+    const int nx = (dec.width * dec.n + 7) / 8;
+    const int ny = (dec.height * dec.n + 7) / 8;
+    img->nx = nx;
+    img->ny = ny;
+    img->size = (size_t) nx * ny * 3;
+    if (arena) {
+        if (arena->size < img->size) {
+            arena->resize(img->size);
+        }
+        img->data = arena->data;
+        img->owner = BLIP2_IMAGE_OWNER_NONE;
     } else {
-        std::cerr << "Failed to load image." << std::endl;
+        img->data = new uint8_t[img->size];
+        img->owner = BLIP2_IMAGE_OWNER_NEW;
     }
 
-    return 0;
+    // Subsampled chroma is replicated
+    const uint8_t * rows[3];
+    const int nc = dec.comps.size();
+    const bool rgb = nc == 3 && (dec.adobe_transform == 0 ||
+        (dec.comps[0].id == 'R' && dec.comps[1].id == 'G' && dec.comps[2].id == 'B'));
+    for (int y = 0; y < ny; y++) {
+        for (int c = 0; c < nc; c++) {
+            const auto & comp = dec.comps[c];
+            rows[c] = comp.plane.data() + (size_t)(y * comp.v / dec.vmax) * comp.bw * dec.n;
+        }
+        uint8_t * dst = img->data + (size_t) y * nx * 3;
+        for (int x = 0; x < nx; x++) {
+            if (nc == 1) {
+                dst[3 * x + 0] = dst[3 * x + 1] = dst[3 * x + 2] = rows[0][x];
+                continue;
+            }
+            const int c0 = rows[0][x * dec.comps[0].h / dec.hmax];
+            const int c1 = rows[1][x * dec.comps[1].h / dec.hmax];
+            const int c2 = rows[2][x * dec.comps[2].h / dec.hmax];
+            if (rgb) {
+                dst[3 * x + 0] = c0;
+                dst[3 * x + 1] = c1;
+                dst[3 * x + 2] = c2;
+                continue;
+            }
+            const float cb = c1 - 128.0f;
+            const float cr = c2 - 128.0f;
+            dst[3 * x + 0] = (uint8_t) std::min(std::max(c0 + 1.402f * cr + 0.5f, 0.0f), 255.0f);
+            dst[3 * x + 1] = (uint8_t) std::min(std::max(c0 - 0.344136f * cb - 0.714136f * cr + 0.5f, 0.0f), 255.0f);
+            dst[3 * x + 2] = (uint8_t) std::min(std::max(c0 + 1.772f * cb + 0.5f, 0.0f), 255.0f);
+        }
+    }
+
+    return true;
+}
+
+bool load_image_from_memory(const uint8_t* buf, size_t len, image_u8* img, int min_size, blip2_buffer* arena) {
+    if (min_size > 0 && blip2_jpeg_decode(buf, len, min_size, img, arena)) {
+        return true;
+    }
+
+    // stb takes the length as an int
+    if (len > INT_MAX) {
+        fprintf(stderr, "%s: %zu bytes is too large for an image\n", __func__, len);
+        return false;
+    }
+
+    int nx, ny, nc;
+    auto data = stbi_load_from_memory(buf, (int) len, &nx, &ny, &nc, 3);
+    if (!data) {
+        fprintf(stderr, "%s: failed to decode image: %s\n", __func__, stbi_failure_reason());
+        return false;
+    }
+
+    blip2_image_adopt_stb(img, data, nx, ny);
+
+    return true;
+}
+
+bool load_image_from_file_scaled(const char* fname, image_u8* img, int min_size) {
+    std::ifstream fin(fname, std::ios::binary | std::ios::ate);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+    std::vector<uint8_t> buf(fin.tellg());
+    fin.seekg(0);
+    if (!fin.read((char *) buf.data(), buf.size())) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname);
+        return false;
+    }
+
+    if (!load_image_from_memory(buf.data(), buf.size(), img, min_size)) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        return false;
+    }
+
+    return true;
+}
+
+// Resize coefficients of one output coordinate: source taps i0/i1 and the weight of i1
+struct blip2_resize_coef {
+    int i0;
+    int i1;
+    float w;
+};
+
+// Same sampling as a per-pixel bilinear resize: pixel centers, taps clamped to the image but not the weight
+static std::vector<blip2_resize_coef> blip2_resize_coefs(int n_dst, int n_src, float scale) {
+    std::vector<blip2_resize_coef> coefs(n_dst);
+    for (int i = 0; i < n_dst; i++) {
+        const float s = (i + 0.5f) * scale - 0.5f;
+        const int i0 = std::min(std::max(0, (int)std::floor(s)), n_src - 1);
+        coefs[i].i0 = i0;
+        coefs[i].i1 = std::min(i0 + 1, n_src - 1);
+        coefs[i].w = s - i0;
+    }
+
+    return coefs;
+}
+
+// dst[i] = round(clamp(a[i] * wa + b[i] * wb, 0, 255))
+static void blip2_blend_rows(const float * a, const float * b, float wa, float wb, uint8_t * dst, int n) {
+    int i = 0;
+#if defined(__AVX512F__)
+    const __m512 va = _mm512_set1_ps(wa);
+    const __m512 vb = _mm512_set1_ps(wb);
+    const __m512 lo = _mm512_setzero_ps();
+    const __m512 hi = _mm512_set1_ps(255.0f);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(a + i), va), _mm512_mul_ps(_mm512_loadu_ps(b + i), vb));
+        v = _mm512_add_ps(_mm512_min_ps(_mm512_max_ps(v, lo), hi), half);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm512_cvtusepi32_epi8(_mm512_cvttps_epi32(v)));
+    }
+#elif defined(__AVX2__)
+    const __m256 va = _mm256_set1_ps(wa);
+    const __m256 vb = _mm256_set1_ps(wb);
+    const __m256 lo = _mm256_setzero_ps();
+    const __m256 hi = _mm256_set1_ps(255.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), va), _mm256_mul_ps(_mm256_loadu_ps(b + i), vb));
+        v = _mm256_add_ps(_mm256_min_ps(_mm256_max_ps(v, lo), hi), half);
+        const __m256i q = _mm256_cvttps_epi32(v);
+        const __m128i q16 = _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(q16, q16));
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t lo = vdupq_n_f32(0.0f);
+    const float32x4_t hi = vdupq_n_f32(255.0f);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t v0 = vaddq_f32(vmulq_n_f32(vld1q_f32(a + i), wa), vmulq_n_f32(vld1q_f32(b + i), wb));
+        float32x4_t v1 = vaddq_f32(vmulq_n_f32(vld1q_f32(a + i + 4), wa), vmulq_n_f32(vld1q_f32(b + i + 4), wb));
+        v0 = vaddq_f32(vminq_f32(vmaxq_f32(v0, lo), hi), half);
+        v1 = vaddq_f32(vminq_f32(vmaxq_f32(v1, lo), hi), half);
+        const uint16x8_t q16 = vcombine_u16(vmovn_u32(vcvtq_u32_f32(v0)), vmovn_u32(vcvtq_u32_f32(v1)));
+        vst1_u8(dst + i, vmovn_u16(q16));
+    }
+#endif
+    for (; i < n; i++) {
+        const float v = a[i] * wa + b[i] * wb;
+        dst[i] = (uint8_t)(std::min(std::max(v, 0.0f), 255.0f) + 0.5f);
+    }
+}
+
+// Resize and normalize img into dst, element (x, y, c) is stored at dst[x_offset[x] + y_offset[y] + c*stride_c]
+// Only the resized area is written, the caller provides a zeroed image_size x image_size destination
+static void blip2_image_preprocess_strided(const blip2_ctx* ctx, const image_u8* img, float* dst, const std::vector<size_t> & x_offset, const std::vector<size_t> & y_offset, size_t stride_c) {
+    const int nx = img->nx;
+    const int ny = img->ny;
+
+    const float scale = std::max(nx, ny) / (float)ctx->vision_image_size;
+
+    const int nx3 = int(nx / scale + 0.5f);
+    const int ny3 = int(ny / scale + 0.5f);
+
+    const auto & m3 = ctx->image_mean;
+    const auto & s3 = ctx->image_std;
+
+    // The resized pixels are rounded to uint8 before normalization, so normalization is a table lookup
+    float lut[3][256];
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            lut[c][v] = ((float(v) / 255.0f) - m3[c]) / s3[c];
+        }
+    }
+
+    const std::vector<blip2_resize_coef> cx = blip2_resize_coefs(nx3, nx, scale);
+    const std::vector<blip2_resize_coef> cy = blip2_resize_coefs(ny3, ny, scale);
+
+    // Horizontal pass, one source row at a time. Output rows only move forward in the source,
+    // so the two rows of the current output row are all that needs to be kept.
+    const int n_row = 3 * nx3;
+    std::vector<float> rows[2] = { std::vector<float>(n_row), std::vector<float>(n_row) };
+    int row_src[2] = { -1, -1 };
+    std::vector<uint8_t> row_u8(n_row);
+
+    auto resize_row = [&](int sy, int keep) -> const float * {
+        for (int s = 0; s < 2; s++) {
+            if (row_src[s] == sy) {
+                return rows[s].data();
+            }
+        }
+
+        const int s = row_src[0] == keep ? 1 : 0;
+        const uint8_t * src = img->data + 3 * (size_t)sy * nx;
+        float * dst = rows[s].data();
+        for (int x = 0; x < nx3; x++) {
+            const uint8_t * p0 = src + 3 * cx[x].i0;
+            const uint8_t * p1 = src + 3 * cx[x].i1;
+            const float w1 = cx[x].w;
+            const float w0 = 1.0f - w1;
+            dst[3 * x + 0] = p0[0] * w0 + p1[0] * w1;
+            dst[3 * x + 1] = p0[1] * w0 + p1[1] * w1;
+            dst[3 * x + 2] = p0[2] * w0 + p1[2] * w1;
+        }
+        row_src[s] = sy;
+
+        return dst;
+    };
+
+    // Vertical pass fused with rounding and normalization
+    for (int y = 0; y < ny3; y++) {
+        const float * r0 = resize_row(cy[y].i0, cy[y].i1);
+        const float * r1 = resize_row(cy[y].i1, cy[y].i0);
+
+        blip2_blend_rows(r0, r1, 1.0f - cy[y].w, cy[y].w, row_u8.data(), n_row);
+
+        for (int c = 0; c < 3; c++) {
+            float * dst_row = dst + y_offset[y] + c * stride_c;
+            const float * lut_c = lut[c];
+            for (int x = 0; x < nx3; x++) {
+                dst_row[x_offset[x]] = lut_c[row_u8[3 * x + c]];
+            }
+        }
+    }
+}
+
+bool blip2_image_preprocess(const blip2_ctx* ctx, const image_u8* img, image_f32* res) {
+    const int nx2 = ctx->vision_image_size;
+    const int ny2 = ctx->vision_image_size;
+
+    res->nx = nx2;
+    res->ny = ny2;
+    res->size = 3 * nx2 * ny2;
+    res->data = new float[res->size]();
+
+    std::vector<size_t> x_offset(nx2);
+    std::vector<size_t> y_offset(ny2);
+    for (int x = 0; x < nx2; x++) {
+        x_offset[x] = 3 * (size_t)x;
+    }
+    for (int y = 0; y < ny2; y++) {
+        y_offset[y] = 3 * (size_t)nx2 * y;
+    }
+
+    blip2_image_preprocess_strided(ctx, img, res->data, x_offset, y_offset, 1);
+
+    return true;
+}
+
+bool blip2_image_preprocess_to_tensor(const blip2_ctx* ctx, const image_u8* img, struct ggml_tensor* dst, int batch_idx) {
+    const int image_size = ctx->vision_image_size;
+
+    if (dst->type != GGML_TYPE_F32 || dst->ne[0] != image_size || dst->ne[1] != image_size || dst->ne[2] != 3) {
+        fprintf(stderr, "%s: expected a f32 tensor of shape [%d, %d, 3, n]\n", __func__, image_size, image_size);
+        return false;
+    }
+    if (batch_idx < 0 || batch_idx >= dst->ne[3]) {
+        fprintf(stderr, "%s: batch index %d out of range [0, %d)\n", __func__, batch_idx, (int) dst->ne[3]);
+        return false;
+    }
+    if (dst->nb[0] != sizeof(float) || dst->data == NULL) {
+        fprintf(stderr, "%s: the destination tensor must be allocated with contiguous rows\n", __func__);
+        return false;
+    }
+
+    // The letterbox padding is left at zero
+    float * data = (float *)((char *) dst->data + batch_idx * dst->nb[3]);
+    for (int c = 0; c < 3; c++) {
+        for (int y = 0; y < image_size; y++) {
+            memset((char *) data + c * dst->nb[2] + y * dst->nb[1], 0, image_size * sizeof(float));
+        }
+    }
+
+    std::vector<size_t> x_offset(image_size);
+    std::vector<size_t> y_offset(image_size);
+    for (int i = 0; i < image_size; i++) {
+        x_offset[i] = i;
+        y_offset[i] = i * (dst->nb[1] / sizeof(float));
+    }
+
+    blip2_image_preprocess_strided(ctx, img, data, x_offset, y_offset, dst->nb[2] / sizeof(float));
+
+    return true;
+}
+
+bool blip2_image_preprocess_to_patches(const blip2_ctx* ctx, const image_u8* img, struct ggml_tensor* dst, int batch_idx) {
+    const int image_size = ctx->vision_image_size;
+    const int patch_size = ctx->vision_model.hparams.patch_size;
+    const int n_side = image_size / patch_size;
+    const int patch_len = patch_size * patch_size * 3;
+
+    if (image_size % patch_size != 0) {
+        fprintf(stderr, "%s: image size %d is not a multiple of the patch size %d\n", __func__, image_size, patch_size);
+        return false;
+    }
+    if (dst->type != GGML_TYPE_F32 || dst->ne[0] != patch_len || dst->ne[1] != n_side * n_side + 1 || !ggml_is_contiguous(dst)) {
+        fprintf(stderr, "%s: expected a contiguous f32 tensor of shape [%d, %d, n]\n", __func__, patch_len, n_side * n_side + 1);
+        return false;
+    }
+    if (batch_idx < 0 || batch_idx >= dst->ne[2]) {
+        fprintf(stderr, "%s: batch index %d out of range [0, %d)\n", __func__, batch_idx, (int) dst->ne[2]);
+        return false;
+    }
+    if (dst->data == NULL) {
+        fprintf(stderr, "%s: the destination tensor must be allocated\n", __func__);
+        return false;
+    }
+
+    // The class token column and the letterbox padding are left at zero
+    float * data = (float *)((char *) dst->data + batch_idx * dst->nb[2]);
+    memset(data, 0, dst->nb[2]);
+
+    // Pixel (x, y) of channel c is element (x % p) + (y % p)*p + c*p*p of patch 1 + (y / p)*n_side + (x / p)
+    std::vector<size_t> x_offset(image_size);
+    std::vector<size_t> y_offset(image_size);
+    for (int i = 0; i < image_size; i++) {
+        x_offset[i] = (i % patch_size) + (size_t)(i / patch_size) * patch_len;
+        y_offset[i] = (i % patch_size) * patch_size + (size_t)((i / patch_size) * n_side + 1) * patch_len;
+    }
+
+    blip2_image_preprocess_strided(ctx, img, data, x_offset, y_offset, (size_t) patch_size * patch_size);
+
+    return true;
+}
+
+void blip2_image_f32_free(image_f32* img) {
+    delete[] img->data;
+    img->data = nullptr;
+    img->size = 0;
+}
+
+// Maximum number of bytes read by one request of the tensor loader
+static const size_t BLIP2_READ_CHUNK_SIZE = 16u * 1024 * 1024;
+
+struct blip2_read_chunk {
+    void * dst;
+    size_t offset;
+    size_t size;
+};
+
+// Read all chunks of a file with n_threads workers pulling from a shared counter,
+// so that many reads are in flight at once and a slow chunk does not hold the others back
+static bool blip2_read_chunks(const char * fname, const std::vector<blip2_read_chunk> & chunks, int n_threads) {
+    blip2_file file;
+    if (!file.open(fname, false)) {
+        return false;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+
+    auto worker = [&]() {
+        while (!failed) {
+            const size_t i = next++;
+            if (i >= chunks.size()) {
+                break;
+            }
+            if (!file.read(chunks[i].dst, chunks[i].size, chunks[i].offset)) {
+                fprintf(stderr, "%s: failed to read %zu bytes at offset %zu: %s\n", __func__,
+                    chunks[i].size, chunks[i].offset, strerror(errno));
+                failed = true;
+            }
+        }
+    };
+
+    n_threads = std::max(1, std::min<int>(n_threads, chunks.size()));
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return !failed;
+}
+
+bool blip2_file::open(const char * fname, bool write) {
+    close();
+
+#ifdef _POSIX_MAPPED_FILES
+    fd = write ? ::open(fname, O_RDWR | O_CREAT, 0644) : ::open(fname, O_RDONLY);
+#else
+    fp = fopen(fname, write ? "r+b" : "rb");
+    if (!fp && write) {
+        fp = fopen(fname, "w+b");
+    }
+#endif
+    if (!is_open()) {
+        fprintf(stderr, "%s: failed to open '%s': %s\n", __func__, fname, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void blip2_file::close() {
+#ifdef _POSIX_MAPPED_FILES
+    if (fd != -1) {
+        ::close(fd);
+    }
+#endif
+    if (fp) {
+        fclose(fp);
+    }
+    fd = -1;
+    fp = NULL;
+}
+
+bool blip2_file::size(size_t & n_bytes) const {
+#ifdef _POSIX_MAPPED_FILES
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    n_bytes = st.st_size;
+#else
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        return false;
+    }
+    const long pos = ftell(fp);
+    if (pos < 0) {
+        return false;
+    }
+    n_bytes = pos;
+#endif
+
+    return true;
+}
+
+bool blip2_file::read(void * dst, size_t n_bytes, size_t offset) const {
+#ifdef _POSIX_MAPPED_FILES
+    size_t done = 0;
+    while (done < n_bytes) {
+        const ssize_t n = pread(fd, (uint8_t *) dst + done, n_bytes - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0) {
+            // The file ends before the range, callers report errno
+            errno = EIO;
+            return false;
+        }
+        if (n < 0) {
+            return false;
+        }
+        done += n;
+    }
+
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fseek(fp, (long) offset, SEEK_SET) != 0) {
+        return false;
+    }
+    if (fread(dst, 1, n_bytes, fp) != n_bytes) {
+        if (feof(fp)) {
+            errno = EIO;
+        }
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+bool blip2_file::write(const void * src, size_t n_bytes, size_t offset) {
+#ifdef _POSIX_MAPPED_FILES
+    size_t done = 0;
+    while (done < n_bytes) {
+        const ssize_t n = pwrite(fd, (const uint8_t *) src + done, n_bytes - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        if (n < 0) {
+            return false;
+        }
+        done += n;
+    }
+
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(mutex);
+    return fseek(fp, (long) offset, SEEK_SET) == 0 && fwrite(src, 1, n_bytes, fp) == n_bytes && fflush(fp) == 0;
+#endif
+}
+
+bool blip2_file::truncate(size_t n_bytes) {
+#ifdef _POSIX_MAPPED_FILES
+    return ftruncate(fd, n_bytes) == 0;
+#else
+    GGML_UNUSED(n_bytes);
+    return true;
+#endif
+}
+
+bool blip2_mmap::map(const char * fname) {
+#ifdef _POSIX_MAPPED_FILES
+    unmap();
+
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: failed to open '%s': %s\n", __func__, fname, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: failed to stat '%s': %s\n", __func__, fname, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    // The mapping keeps its own reference to the file, so the descriptor can go right away
+    void * res = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (res == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap of '%s' failed: %s\n", __func__, fname, strerror(errno));
+        return false;
+    }
+
+    addr = res;
+    size = st.st_size;
+
+    return true;
+#else
+    fprintf(stderr, "%s: mmap is not supported on this platform\n", __func__);
+    GGML_UNUSED(fname);
+    return false;
+#endif
+}
+
+void blip2_mmap::prefetch(size_t offset, size_t len) const {
+#ifdef _POSIX_MAPPED_FILES
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t begin = offset & ~(page_size - 1);
+    const size_t end = std::min(offset + len, size);
+    if (addr && begin < end) {
+        posix_madvise((uint8_t *) addr + begin, end - begin, POSIX_MADV_WILLNEED);
+    }
+#else
+    GGML_UNUSED(offset);
+    GGML_UNUSED(len);
+#endif
+}
+
+void blip2_mmap::evict(size_t offset, size_t len) const {
+#if defined(_POSIX_MAPPED_FILES) && defined(MADV_DONTNEED)
+    // Only whole pages inside the range are dropped so that neighbouring tensors stay resident
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t begin = (offset + page_size - 1) & ~(page_size - 1);
+    const size_t end = std::min(offset + len, size) & ~(page_size - 1);
+    if (addr && begin < end) {
+        madvise((uint8_t *) addr + begin, end - begin, MADV_DONTNEED);
+    }
+#else
+    GGML_UNUSED(offset);
+    GGML_UNUSED(len);
+#endif
+}
+
+void blip2_mmap::unmap() {
+#ifdef _POSIX_MAPPED_FILES
+    if (addr) {
+        munmap(addr, size);
+    }
+#endif
+    addr = NULL;
+    size = 0;
+}
+
+void blip2_free(blip2_ctx* ctx) {
+    auto & stream = ctx->vision_stream;
+    if (stream.prefetch.joinable()) {
+        stream.prefetch.join();
+    }
+    stream.file.close();
+
+    for (auto * ctx_derived : ctx->ctx_derived) {
+        ggml_free(ctx_derived);
+    }
+    ggml_free(ctx->ctx);
+    gguf_free(ctx->ctx_gguf);
+    delete ctx;
+}
+
+// The patch embedding adds the patch bias to every patch, the class embedding is prepended and the position
+// embeddings are added to everything. With the class token entering the patch projection as a zero column,
+// all of this is a single table added to the projection output.
+static bool blip2_vision_init_pos_table(blip2_ctx * ctx) {
+    auto & model = ctx->vision_model;
+    const int hidden_size = model.hparams.hidden_size;
+    const int num_positions = blip2_vision_n_positions(ctx);
+
+    if (ggml_nelements(model.position_embeddings) != (int64_t) hidden_size * num_positions ||
+        ggml_nelements(model.class_embedding) != hidden_size || ggml_nelements(model.patch_embeddings_b) != hidden_size) {
+        fprintf(stderr, "%s: unexpected shape of the vision embeddings\n", __func__);
+        return false;
+    }
+
+    model.pos_table = blip2_new_derived_tensor(ctx, GGML_TYPE_F32, hidden_size, num_positions, "vision_model.embeddings.pos_table");
+    if (!model.pos_table) {
+        fprintf(stderr, "%s: failed to allocate the position table\n", __func__);
+        return false;
+    }
+
+    const std::vector<float> pos = blip2_tensor_to_f32(model.position_embeddings);
+    const std::vector<float> cls = blip2_tensor_to_f32(model.class_embedding);
+    const std::vector<float> bias = blip2_tensor_to_f32(model.patch_embeddings_b);
+
+    float * dst = (float *) model.pos_table->data;
+    for (int p = 0; p < num_positions; ++p) {
+        const std::vector<float> & add = p == 0 ? cls : bias;
+        for (int i = 0; i < hidden_size; ++i) {
+            dst[p*hidden_size + i] = pos[p*hidden_size + i] + add[i];
+        }
+    }
+
+    model.pos_tables[ctx->vision_image_size] = model.pos_table;
+
+    return true;
+}
+
+// Weights of the taps i - 1 .. i + 2 of cubic convolution at fraction t, with a = -0.75 as in PyTorch
+static void blip2_cubic_weights(float t, float w[4]) {
+    const float a = -0.75f;
+    auto near = [&](float x) { return ((a + 2.0f)*x - (a + 3.0f))*x*x + 1.0f; };
+    auto far = [&](float x) { return ((a*x - 5.0f*a)*x + 8.0f*a)*x - 4.0f*a; };
+    w[0] = far(t + 1.0f);
+    w[1] = near(t);
+    w[2] = near(1.0f - t);
+    w[3] = far(2.0f - t);
+}
+
+// Bicubic resampling of the n x n grid of rows of src to m x m rows of dst, hidden_size values each,
+// sampling pixel centers like F.interpolate(mode="bicubic", align_corners=False)
+static void blip2_resample_bicubic(const float * src, int n, float * dst, int m, int hidden_size) {
+    std::vector<int> idx(4*m);
+    std::vector<float> w(4*m);
+    const float scale = (float) n / m;
+    for (int o = 0; o < m; ++o) {
+        const float x = (o + 0.5f)*scale - 0.5f;
+        const int i = (int) floorf(x);
+        blip2_cubic_weights(x - i, &w[4*o]);
+        for (int k = 0; k < 4; ++k) {
+            idx[4*o + k] = std::min(std::max(i - 1 + k, 0), n - 1);
+        }
+    }
+
+    // Along x into tmp, n rows of m, then along y
+    std::vector<float> tmp((size_t) n*m*hidden_size, 0.0f);
+    for (int y = 0; y < n; ++y) {
+        for (int x = 0; x < m; ++x) {
+            float * out = &tmp[((size_t) y*m + x)*hidden_size];
+            for (int k = 0; k < 4; ++k) {
+                blip2_vec_mad_f32(out, src + ((size_t) y*n + idx[4*x + k])*hidden_size, w[4*x + k], hidden_size);
+            }
+        }
+    }
+    for (int y = 0; y < m; ++y) {
+        for (int x = 0; x < m; ++x) {
+            float * out = dst + ((size_t) y*m + x)*hidden_size;
+            memset(out, 0, hidden_size*sizeof(float));
+            for (int k = 0; k < 4; ++k) {
+                blip2_vec_mad_f32(out, &tmp[((size_t) idx[4*y + k]*m + x)*hidden_size], w[4*y + k], hidden_size);
+            }
+        }
+    }
+}
+
+bool blip2_vision_set_image_size(blip2_ctx * ctx, int image_size) {
+    auto & model = ctx->vision_model;
+    const int patch_size = model.hparams.patch_size;
+
+    if (image_size <= 0 || image_size % patch_size != 0) {
+        fprintf(stderr, "%s: image size %d is not a multiple of the patch size %d\n", __func__, image_size, patch_size);
+        return false;
+    }
+    if (!(ctx->towers & BLIP2_TOWER_VISION)) {
+        fprintf(stderr, "%s: the vision tower was not loaded\n", __func__);
+        return false;
+    }
+    if (image_size == ctx->vision_image_size) {
+        return true;
+    }
+
+    auto it = model.pos_tables.find(image_size);
+    if (it == model.pos_tables.end()) {
+        const int hidden_size = model.hparams.hidden_size;
+        const int n = model.hparams.image_size / patch_size;
+        const int m = image_size / patch_size;
+
+        struct ggml_tensor * table = blip2_new_derived_tensor(ctx, GGML_TYPE_F32, hidden_size, m*m + 1,
+            format("vision_model.embeddings.pos_table.%d", image_size).c_str());
+        if (!table) {
+            fprintf(stderr, "%s: failed to allocate the position table\n", __func__);
+            return false;
+        }
+
+        // The class token keeps its row, the patch rows are a grid
+        const float * src = (const float *) model.pos_tables.at(model.hparams.image_size)->data;
+        float * dst = (float *) table->data;
+        memcpy(dst, src, hidden_size*sizeof(float));
+        blip2_resample_bicubic(src + hidden_size, n, dst + hidden_size, m, hidden_size);
+
+        it = model.pos_tables.emplace(image_size, table).first;
+    }
+
+    model.pos_table = it->second;
+    ctx->vision_image_size = image_size;
+
+    // The cached graphs were built for the previous number of positions
+    ctx->vision_graph.clear();
+
+    return true;
+}
+
+// A layernorm and the linear layer after it: W (g*n + beta) + c = (W diag(g)) n + (W beta + c)
+// The folded weights and bias are written to w_out and b_out, which may be w and b themselves
+struct blip2_fold_job {
+    const struct ggml_tensor * ln_w;
+    const struct ggml_tensor * ln_b;
+    const struct ggml_tensor * w;
+    const struct ggml_tensor * b;
+    struct ggml_tensor * w_out;
+    struct ggml_tensor * b_out;
+};
+
+static void blip2_fold_layer_norm(const blip2_fold_job & job) {
+    const int64_t n_in = job.w->ne[0];
+    const int64_t n_out = job.w->ne[1];
+
+    const std::vector<float> g = blip2_tensor_to_f32(job.ln_w);
+    const std::vector<float> beta = blip2_tensor_to_f32(job.ln_b);
+    const std::vector<float> bias = blip2_tensor_to_f32(job.b);
+
+    std::vector<float> row(n_in);
+    for (int64_t j = 0; j < n_out; ++j) {
+        const uint8_t * src = (const uint8_t *) job.w->data + j*job.w->nb[1];
+        uint8_t * dst = (uint8_t *) job.w_out->data + j*job.w_out->nb[1];
+
+        if (job.w->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, row.data(), n_in);
+        } else {
+            memcpy(row.data(), src, n_in*sizeof(float));
+        }
+
+        double acc = bias[j];
+        for (int64_t i = 0; i < n_in; ++i) {
+            acc += (double) row[i]*beta[i];
+            row[i] *= g[i];
+        }
+        ((float *) job.b_out->data)[j] = (float) acc;
+
+        if (job.w->type == GGML_TYPE_F16) {
+            ggml_fp32_to_fp16_row(row.data(), (ggml_fp16_t *) dst, n_in);
+        } else {
+            memcpy(dst, row.data(), n_in*sizeof(float));
+        }
+    }
+}
+
+// Fold ln_1 into qkv and ln_2 into ff_1 in every vision layer whose matrices are f32 or f16,
+// the quantized ones keep their layernorms. Mapped weights are read-only pages of the file,
+// so with mmap the folded tensors are new ones, otherwise they are overwritten.
+static bool blip2_vision_fold_layer_norms(blip2_ctx * ctx, int n_threads) {
+    const bool in_place = ctx->mapping.addr == NULL;
+
+    std::vector<blip2_fold_job> jobs;
+    int n_skipped = 0;
+    for (auto & layer : ctx->vision_model.layers) {
+        struct { struct ggml_tensor ** ln_w; struct ggml_tensor ** ln_b; struct ggml_tensor ** w; struct ggml_tensor ** b; } pairs[2] = {
+            { &layer.ln_1_w, &layer.ln_1_b, &layer.qkv_w, &layer.qkv_b },
+            { &layer.ln_2_w, &layer.ln_2_b, &layer.ff_1_w, &layer.ff_1_b },
+        };
+        for (auto & p : pairs) {
+            if (!*p.ln_w) {
+                continue;
+            }
+            struct ggml_tensor * w = *p.w;
+            struct ggml_tensor * b = *p.b;
+            if (w->type != GGML_TYPE_F32 && w->type != GGML_TYPE_F16) {
+                n_skipped++;
+                continue;
+            }
+
+            blip2_fold_job job = { *p.ln_w, *p.ln_b, w, b, w, b };
+            if (!in_place) {
+                job.w_out = blip2_new_derived_tensor(ctx, w->type, w->ne[0], w->ne[1], w->name);
+            }
+            if (!in_place || b->type != GGML_TYPE_F32) {
+                job.b_out = blip2_new_derived_tensor(ctx, GGML_TYPE_F32, w->ne[1], 1, b->name);
+            }
+            if (!job.w_out || !job.b_out) {
+                fprintf(stderr, "%s: failed to allocate the folded weights\n", __func__);
+                return false;
+            }
+
+            jobs.push_back(job);
+            *p.w = job.w_out;
+            *p.b = job.b_out;
+            *p.ln_w = NULL;
+            *p.ln_b = NULL;
+        }
+    }
+
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        while (true) {
+            const int i = next++;
+            if (i >= (int) jobs.size()) {
+                break;
+            }
+            blip2_fold_layer_norm(jobs[i]);
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, (int) jobs.size()));
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    printf("%s: folded %zu layernorms%s\n", __func__, jobs.size(), n_skipped ? format(", %d left before quantized matrices", n_skipped).c_str() : "");
+
+    return true;
+}
+
+// Stack the key and value projections of the cross-attention layers into one matrix. The rows are
+// copied as they are when all the projections have the same type, converted to F32 otherwise.
+static bool blip2_qformer_init_cross_kv(blip2_ctx * ctx) {
+    auto & model = ctx->qformer_model;
+    const int hidden_size = model.hparams.hidden_size;
+    const int n_embd = model.hparams.encoder_hidden_size;
+
+    model.cross_kv_w = NULL;
+    model.cross_kv_b = NULL;
+
+    std::vector<const struct ggml_tensor *> ws;
+    std::vector<const struct ggml_tensor *> bs;
+    for (const auto & layer : model.layers) {
+        if (layer.has_cross_attn) {
+            ws.push_back(layer.cross_attn.k_w);
+            ws.push_back(layer.cross_attn.v_w);
+            bs.push_back(layer.cross_attn.k_b);
+            bs.push_back(layer.cross_attn.v_b);
+        }
+    }
+    if (ws.empty()) {
+        return true;
+    }
+
+    enum ggml_type type = ws[0]->type;
+    for (const auto * w : ws) {
+        if (w->ne[0] != n_embd || w->ne[1] != hidden_size || ggml_nelements(w) != (int64_t) n_embd * hidden_size) {
+            fprintf(stderr, "%s: unexpected shape of %s\n", __func__, w->name);
+            return false;
+        }
+        if (w->type != type) {
+            type = GGML_TYPE_F32;
+        }
+    }
+
+    const int64_t n_rows = (int64_t) ws.size() * hidden_size;
+    model.cross_kv_w = blip2_new_derived_tensor(ctx, type, n_embd, n_rows, "qformer.cross_kv.weight");
+    model.cross_kv_b = blip2_new_derived_tensor(ctx, GGML_TYPE_F32, n_rows, 1, "qformer.cross_kv.bias");
+    if (!model.cross_kv_w || !model.cross_kv_b) {
+        fprintf(stderr, "%s: failed to allocate the stacked projections\n", __func__);
+        return false;
+    }
+
+    char * dst_w = (char *) model.cross_kv_w->data;
+    float * dst_b = (float *) model.cross_kv_b->data;
+    for (size_t i = 0; i < ws.size(); ++i) {
+        if (ws[i]->type == type) {
+            memcpy(dst_w, ws[i]->data, ggml_nbytes(ws[i]));
+        } else {
+            const auto w = blip2_tensor_to_f32(ws[i]);
+            memcpy(dst_w, w.data(), w.size() * sizeof(float));
+        }
+        dst_w += ggml_row_size(type, n_embd) * hidden_size;
+
+        const auto b = blip2_tensor_to_f32(bs[i]);
+        memcpy(dst_b + i * hidden_size, b.data(), hidden_size * sizeof(float));
+    }
+
+    return true;
+}
+
+// The image-text heads in F32: they run outside of the graphs, on a few rows per image or text
+static bool blip2_qformer_init_heads(blip2_ctx * ctx) {
+    auto & model = ctx->qformer_model;
+    const int hidden_size = model.hparams.hidden_size;
+
+    model.proj_dim = model.text_proj_w->ne[1];
+    if (model.word_embd->ne[0] != hidden_size || model.pos_embd->ne[0] != hidden_size ||
+        model.text_proj_w->ne[0] != hidden_size || model.vision_proj_w->ne[0] != hidden_size || model.vision_proj_w->ne[1] != model.proj_dim ||
+        model.itm_w->ne[0] != hidden_size || model.itm_w->ne[1] != 2) {
+        fprintf(stderr, "%s: unexpected shape of the text embeddings or image-text heads\n", __func__);
+        return false;
+    }
+
+    struct ggml_tensor ** heads[6] = {
+        &model.vision_proj_w, &model.vision_proj_b, &model.text_proj_w, &model.text_proj_b, &model.itm_w, &model.itm_b,
+    };
+    for (struct ggml_tensor ** t : heads) {
+        if ((*t)->type == GGML_TYPE_F32) {
+            continue;
+        }
+        struct ggml_tensor * cur = blip2_new_derived_tensor(ctx, GGML_TYPE_F32, (*t)->ne[0], (*t)->ne[1], (*t)->name);
+        if (!cur) {
+            fprintf(stderr, "%s: failed to allocate %s\n", __func__, (*t)->name);
+            return false;
+        }
+        const auto data = blip2_tensor_to_f32(*t);
+        memcpy(cur->data, data.data(), ggml_nbytes(cur));
+        *t = cur;
+    }
+
+    return true;
+}
+
+static bool blip2_qformer_init_prefix(blip2_ctx * ctx, int n_threads);
+
+struct blip2_model_params blip2_model_default_params() {
+    struct blip2_model_params result = {
+        /*.use_mmap = */ true,
+        /*.towers   = */ BLIP2_TOWER_ALL,
+        /*.n_threads = */ (int) std::min(8u, std::max(1u, std::thread::hardware_concurrency())),
+        /*.stream_vision_layers = */ false,
+        /*.flash_attn = */ true,
+        /*.vision_feature_layer = */ -1,
+        /*.tome_r = */ 0,
+        /*.fold_layer_norm = */ false,
+        /*.vision_image_size = */ 0,
+    };
+
+    return result;
+}
+
+struct blip2_ctx* blip2_model_load(const char* fname) {
+    return blip2_model_load(fname, blip2_model_default_params());
+}
+
+struct blip2_ctx* blip2_model_load(const char* fname, struct blip2_model_params model_params) {
+    const int64_t t_start_load_us = ggml_time_us();
+
+    struct ggml_context* meta = NULL;
+
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &meta,
+    };
+
+    struct gguf_context* ctx = gguf_init_from_file(fname, params);
+
+    if (!ctx) {
+        std::cerr << "Failed to initialize gguf_context" << std::endl;
+        return nullptr;
+        }
+
+    // Vision layers that run, the ones after the requested feature layer are skipped entirely
+    int n_vision_layer = INT_MAX;
+    if (model_params.towers & BLIP2_TOWER_VISION) {
+        const int idx = gguf_find_key(ctx, format(KEY_BLOCK_COUNT, "vision").c_str());
+        const int n_layer = idx == -1 ? 0 : (int) gguf_get_val_u32(ctx, idx);
+        const int feature_layer = model_params.vision_feature_layer < 0 ? n_layer + model_params.vision_feature_layer : model_params.vision_feature_layer;
+        if (feature_layer < 0 || feature_layer >= n_layer) {
+            fprintf(stderr, "%s: vision feature layer %d out of range for %d layers\n", __func__, model_params.vision_feature_layer, n_layer);
+            gguf_free(ctx);
+            ggml_free(meta);
+            return nullptr;
+        }
+        n_vision_layer = feature_layer + 1;
+        if (n_vision_layer < n_layer) {
+            printf("%s: using the features of vision layer %d, skipping %d layers\n", __func__, feature_layer, n_layer - n_vision_layer);
+        }
+    }
+
+    // Compute context size
+    // Only the tensors of the requested towers are counted, the others are never allocated nor read
+    size_t ctx_size = 0;
+    size_t stream_size = 0;
+    int n_tensors_loaded = 0;
+    size_t tower_ctx_size[BLIP2_N_TOWERS] = {};
+    int tower_type_count[BLIP2_N_TOWERS][GGML_TYPE_COUNT] = {};
+    const bool stream_vision = model_params.stream_vision_layers && (model_params.towers & BLIP2_TOWER_VISION);
+    {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+
+        for (int i = 0; i < n_tensors; ++i) {
+            const char * name = gguf_get_tensor_name(ctx, i);
+            if (!blip2_tensor_wanted(name, model_params.towers, n_vision_layer)) {
+                continue;
+            }
+
+            struct ggml_tensor * cur = ggml_get_tensor(meta, name);
+            size_t padded_size = ggml_nbytes_pad(cur);
+            ctx_size += sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE;
+            ctx_size += padded_size;
+            n_tensors_loaded++;
+
+            if (stream_vision && blip2_vision_layer_index(name) >= 0) {
+                stream_size += padded_size;
+            }
+
+            const int tower = blip2_tensor_tower(name);
+            for (int t = 0; t < BLIP2_N_TOWERS; ++t) {
+                if (tower == (1 << t)) {
+                    tower_ctx_size[t] += sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE;
+                    tower_ctx_size[t] += padded_size;
+                    tower_type_count[t][cur->type]++;
+                }
+            }
+        }
+
+        for (int t = 0; t < BLIP2_N_TOWERS; ++t) {
+            if (model_params.towers & (1 << t)) {
+                // Towers can be stored with different types, e.g. a q8_0 ViT next to a q4_K language model
+                std::string types;
+                for (int type = 0; type < GGML_TYPE_COUNT; ++type) {
+                    if (tower_type_count[t][type] > 0) {
+                        types += format(" %s: %d", ggml_type_name((enum ggml_type) type), tower_type_count[t][type]);
+                    }
+                }
+                printf("%s: %-8s tensors: %8.2f MB (%s )\n", __func__, blip2_tower_names[t], tower_ctx_size[t] / 1024.0 / 1024.0, types.c_str());
+            }
+        }
+    }
+
+
+    blip2_ctx* new_blip2 = new blip2_ctx;
+
+
+    // Model configuration
+    {
+        int idx = gguf_find_key(ctx, KEY_VISION_USE_GELU);
+        new_blip2->vision_gelu = gguf_get_val_bool(ctx, idx);
+
+        idx = gguf_find_key(ctx, KEY_QFORMER_USE_GELU);
+        new_blip2->qformer_gelu = gguf_get_val_bool(ctx, idx);
+
+        idx = gguf_find_key(ctx, NUM_QUERY_TOKENS);
+        new_blip2->num_query_tokens = gguf_get_val_u32(ctx, idx);
+
+        idx = gguf_find_key(ctx, CROSS_ATTENTION_FREQUENCY);
+        new_blip2->cross_attention_frequency = gguf_get_val_u32(ctx, idx);
+
+        idx = gguf_find_key(ctx, KEY_FILE_TYPE);
+        if (idx != -1) {
+            new_blip2->ftype = gguf_get_val_u32(ctx, idx);
+        }
+
+        new_blip2->towers = model_params.towers;
+        new_blip2->flash_attn = model_params.flash_attn;
+        new_blip2->tome_r = std::max(0, model_params.tome_r);
+    }
+
+    // Vocabulary, only the towers that take text need it
+    if (model_params.towers & (BLIP2_TOWER_QFORMER | BLIP2_TOWER_TEXT)) {
+        const int idx = gguf_find_key(ctx, KEY_TOKENS);
+        if (idx != -1) {
+            auto & vocab = new_blip2->vocab;
+            const int n_vocab = gguf_get_arr_n(ctx, idx);
+            for (int i = 0; i < n_vocab; ++i) {
+                const std::string token = gguf_get_arr_str(ctx, idx, i);
+                vocab.token_to_id[token] = i;
+                vocab.id_to_token[i] = token;
+            }
+        }
+    }
+
+
+    // Load tensors
+    // With mmap the context only holds tensor metadata and data points into the mapped file,
+    // otherwise every tensor is read into memory owned by the context
+    {
+        bool use_mmap = model_params.use_mmap;
+        if (use_mmap && !new_blip2->mapping.map(fname)) {
+            fprintf(stderr, "%s: falling back to reading '%s' into memory\n", __func__, fname);
+            use_mmap = false;
+        }
+
+        const int n_tensors = gguf_get_n_tensors(ctx);
+
+        // Streamed layers never live in the context, their data is swapped in and out of layer slots
+        struct ggml_init_params params = {
+            .mem_size = use_mmap ? n_tensors_loaded * ggml_tensor_overhead() : ctx_size - stream_size,
+            .mem_buffer = NULL,
+            .no_alloc = use_mmap,
+        };
+
+        new_blip2->ctx = ggml_init(params);
+        if (!new_blip2->ctx) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            blip2_free(new_blip2);
+            return nullptr;
+        }
+
+        // Without mmap, tensors are first all created and then read per tower by a pool of threads,
+        // big tensors being split so that the threads get comparable amounts of work
+        std::vector<blip2_read_chunk> chunks[BLIP2_N_TOWERS + 1];
+
+        auto & stream = new_blip2->vision_stream;
+        stream.enabled = stream_vision;
+
+        const size_t data_offset = gguf_get_data_offset(ctx);
+        for (int i = 0; i < n_tensors; ++i) {
+            const char * name = gguf_get_tensor_name(ctx, i);
+            if (!blip2_tensor_wanted(name, model_params.towers, n_vision_layer)) {
+                continue;
+            }
+
+            const int il = stream_vision ? blip2_vision_layer_index(name) : -1;
+
+            struct ggml_tensor * t = ggml_get_tensor(meta, name);
+            ggml_set_no_alloc(new_blip2->ctx, use_mmap || il >= 0);
+            struct ggml_tensor * cur = ggml_dup_tensor(new_blip2->ctx, t);
+            ggml_set_no_alloc(new_blip2->ctx, use_mmap);
+            ggml_set_name(cur, name);
+
+            const size_t offset = data_offset + gguf_get_tensor_offset(ctx, i);
+            const size_t n_bytes = ggml_nbytes(t);
+
+            if (il >= 0) {
+                if ((int) stream.layers.size() <= il) {
+                    stream.layers.resize(il + 1);
+                }
+                stream.layers[il].push_back({ cur, offset, 0 });
+            }
+
+            if (use_mmap) {
+                if (offset + n_bytes > new_blip2->mapping.size) {
+                    printf("%s: tensor %s is out of the bounds of the model file\n", __func__, name);
+                    blip2_free(new_blip2);
+                    return nullptr;
+                }
+                cur->data = (uint8_t *) new_blip2->mapping.addr + offset;
+                continue;
+            }
+
+            if (il >= 0) {
+                continue;
+            }
+
+            int bucket = BLIP2_N_TOWERS;
+            for (int k = 0; k < BLIP2_N_TOWERS; ++k) {
+                if (blip2_tensor_tower(name) == (1 << k)) {
+                    bucket = k;
+                }
+            }
+
+            for (size_t done = 0; done < n_bytes; done += BLIP2_READ_CHUNK_SIZE) {
+                const size_t size = std::min(BLIP2_READ_CHUNK_SIZE, n_bytes - done);
+                chunks[bucket].push_back({ (uint8_t *) cur->data + done, offset + done, size });
+            }
+        }
+
+        // Lay out each streamed layer in a slot, and open the file the slots are filled from
+        if (stream.enabled) {
+            size_t slot_size = 0;
+            for (auto & layer : stream.layers) {
+                size_t layer_size = 0;
+                for (auto & st : layer) {
+                    st.slot_offset = layer_size;
+                    layer_size += GGML_PAD(ggml_nbytes(st.tensor), GGML_MEM_ALIGN);
+                }
+                slot_size = std::max(slot_size, layer_size);
+            }
+
+            if (!use_mmap) {
+                if (!stream.file.open(fname, false)) {
+                    blip2_free(new_blip2);
+                    return nullptr;
+                }
+                stream.slots[0].resize(slot_size);
+                stream.slots[1].resize(slot_size);
+            }
+
+            printf("%s: streaming %zu vision layers, %.2f MB per layer\n", __func__,
+                stream.layers.size(), slot_size / 1024.0 / 1024.0);
+        }
+
+        auto & stats = new_blip2->load_stats;
+        stats.n_threads = std::max(1, model_params.n_threads);
+
+        for (int k = 0; k <= BLIP2_N_TOWERS; ++k) {
+            if (chunks[k].empty()) {
+                continue;
+            }
+
+            size_t n_bytes = 0;
+            for (const auto & chunk : chunks[k]) {
+                n_bytes += chunk.size;
+            }
+
+            const int64_t t_start_us = ggml_time_us();
+            if (!blip2_read_chunks(fname, chunks[k], stats.n_threads)) {
+                blip2_free(new_blip2);
+                return nullptr;
+            }
+            const int64_t t_tower_us = ggml_time_us() - t_start_us;
+
+            if (k < BLIP2_N_TOWERS) {
+                stats.t_tower_us[k] = t_tower_us;
+                stats.n_tower_bytes[k] = n_bytes;
+            }
+            stats.t_read_us += t_tower_us;
+            stats.n_bytes += n_bytes;
+
+            printf("%s: read %-8s tensors: %8.2f MB in %8.2f ms (%8.2f MB/s)\n", __func__,
+                k < BLIP2_N_TOWERS ? blip2_tower_names[k] : "other",
+                n_bytes / 1024.0 / 1024.0, t_tower_us / 1000.0,
+                n_bytes / 1024.0 / 1024.0 / std::max<double>(t_tower_us / 1e6, 1e-6));
+        }
+
+        if (stats.n_bytes > 0) {
+            printf("%s: read %.2f MB with %d threads in %.2f ms (%.2f MB/s)\n", __func__,
+                stats.n_bytes / 1024.0 / 1024.0, stats.n_threads, stats.t_read_us / 1000.0,
+                stats.n_bytes / 1024.0 / 1024.0 / std::max<double>(stats.t_read_us / 1e6, 1e-6));
+        }
+    }
+
+
+    // Load vision model
+    {
+        // Vision config and hparams
+        auto &vision_model = new_blip2->vision_model;
+        auto &hparams = vision_model.hparams;
+
+        hparams.image_size = get_u32(ctx, KEY_IMAGE_SIZE);
+        hparams.patch_size = get_u32(ctx, KEY_PATCH_SIZE);
+        
+        hparams.hidden_size = get_u32(ctx, format(KEY_EMBEDDING_LENGTH, "vision"));
+        hparams.n_layer = get_u32(ctx, format(KEY_BLOCK_COUNT, "vision"));
+        hparams.n_head = get_u32(ctx, format(KEY_ATTENTION_HEAD_COUNT, "vision"));
+        hparams.n_intermediate = get_u32(ctx, format(KEY_FEED_FORWARD_LENGTH, "vision"));
+        hparams.eps = get_f32(ctx, format(KEY_ATTENTION_LAYERNORM_EPS, "vision"));
+        new_blip2->vision_image_size = hparams.image_size;
+
+        int idx_mean = get_key_idx(ctx, KEY_IMAGE_MEAN);
+        int idx_std = get_key_idx(ctx, KEY_IMAGE_STD);
+        for (int i = 0; i < 3; ++i) {
+            new_blip2->image_mean[i] = ((const float *)gguf_get_arr_data(ctx, idx_mean))[i];
+            new_blip2->image_std[i] = ((const float *)gguf_get_arr_data(ctx, idx_std))[i];
+        }
+
+        // Files written with folded layernorms lack the layernorm tensors of the layers that were folded
+        const int idx_folded = gguf_find_key(ctx, KEY_VISION_LN_FOLDED);
+        const bool ln_folded = idx_folded != -1 && gguf_get_val_bool(ctx, idx_folded);
+        auto get_ln_tensor = [&](const std::string & name) {
+            return ln_folded ? ggml_get_tensor(new_blip2->ctx, name.c_str()) : get_tensor(new_blip2->ctx, name);
+        };
+
+        // Load vision weights, unless the vision tower was not requested
+        if (new_blip2->towers & BLIP2_TOWER_VISION) {
+            vision_model.patch_embeddings_w = get_tensor(new_blip2->ctx, format(V_PATCH_EMBD, "weight"));
+            vision_model.patch_embeddings_b = get_tensor(new_blip2->ctx, format(V_PATCH_EMBD, "bias"));
+            vision_model.class_embedding = get_tensor(new_blip2->ctx, V_CLASS_EMBD);
+            vision_model.position_embeddings = get_tensor(new_blip2->ctx, V_POS_EMBD);
+
+            vision_model.layers.resize(n_vision_layer);
+            for (int i = 0; i < n_vision_layer; ++i) {
+                auto & layer = vision_model.layers[i];
+                layer.qkv_w = get_tensor(new_blip2->ctx, format(V_QKV, i, "weight"));
+                layer.qkv_b = get_tensor(new_blip2->ctx, format(V_QKV, i, "bias"));
+            
+                layer.proj_w = get_tensor(new_blip2->ctx, format(V_MHA_PROJ, i, "weight"));
+                layer.proj_b = get_tensor(new_blip2->ctx, format(V_MHA_PROJ, i, "bias"));
+
+                layer.ln_1_w = get_ln_tensor(format(V_MHA_LN1, i, "weight"));
+                layer.ln_1_b = get_ln_tensor(format(V_MHA_LN1, i, "bias"));
+            
+                layer.ff_1_w = get_tensor(new_blip2->ctx, format(V_MHA_FF1, i, "weight"));
+                layer.ff_1_b = get_tensor(new_blip2->ctx, format(V_MHA_FF1, i, "bias"));
+                layer.ff_2_w = get_tensor(new_blip2->ctx, format(V_MHA_FF2, i, "weight"));
+                layer.ff_2_b = get_tensor(new_blip2->ctx, format(V_MHA_FF2, i, "bias"));
+            
+                layer.ln_2_w = get_ln_tensor(format(V_MHA_LN2, i, "weight"));
+                layer.ln_2_b = get_ln_tensor(format(V_MHA_LN2, i, "bias"));
+            }
+
+            vision_model.post_ln_w = get_tensor(new_blip2->ctx, format(V_LN_POST, "weight"));
+            vision_model.post_ln_b = get_tensor(new_blip2->ctx, format(V_LN_POST, "bias"));
+
+            if (!blip2_vision_init_pos_table(new_blip2)) {
+                blip2_free(new_blip2);
+                return nullptr;
+            }
+
+            if (model_params.fold_layer_norm) {
+                if (new_blip2->vision_stream.enabled) {
+                    printf("%s: streamed layers are read from the file as is, not folding layernorms\n", __func__);
+                } else if (!blip2_vision_fold_layer_norms(new_blip2, model_params.n_threads)) {
+                    blip2_free(new_blip2);
+                    return nullptr;
+                } else {
+                    new_blip2->fold_layer_norm = true;
+                }
+            }
+
+            if (model_params.vision_image_size > 0 && !blip2_vision_set_image_size(new_blip2, model_params.vision_image_size)) {
+                blip2_free(new_blip2);
+                return nullptr;
+            }
+        }
+    }
+
+    // Load Q-Former
+    {
+        auto & qformer_model = new_blip2->qformer_model;
+        auto & hparams = qformer_model.hparams;
+
+        hparams.hidden_size = get_u32(ctx, format(KEY_EMBEDDING_LENGTH, "q_former"));
+        hparams.n_layer = get_u32(ctx, format(KEY_BLOCK_COUNT, "q_former"));
+        hparams.n_head = get_u32(ctx, format(KEY_ATTENTION_HEAD_COUNT, "q_former"));
+        hparams.n_intermediate = get_u32(ctx, format(KEY_FEED_FORWARD_LENGTH, "q_former"));
+        hparams.encoder_hidden_size = get_u32(ctx, KEY_ENCODER_HIDDEN_SIZE);
+        hparams.eps = get_f32(ctx, format(KEY_ATTENTION_LAYERNORM_EPS, "q_former"));
+
+        // Load Q-Former weights, unless the Q-Former was not requested
+        if (new_blip2->towers & BLIP2_TOWER_QFORMER) {
+            auto get_attn = [&](const char * fmt_attn, const char * fmt_out, const char * fmt_ln, int il) {
+                blip2_qformer_attn attn;
+                attn.q_w = get_tensor(new_blip2->ctx, format(fmt_attn, il, "query", "weight"));
+                attn.q_b = get_tensor(new_blip2->ctx, format(fmt_attn, il, "query", "bias"));
+                attn.k_w = get_tensor(new_blip2->ctx, format(fmt_attn, il, "key", "weight"));
+                attn.k_b = get_tensor(new_blip2->ctx, format(fmt_attn, il, "key", "bias"));
+                attn.v_w = get_tensor(new_blip2->ctx, format(fmt_attn, il, "value", "weight"));
+                attn.v_b = get_tensor(new_blip2->ctx, format(fmt_attn, il, "value", "bias"));
+                attn.o_w = get_tensor(new_blip2->ctx, format(fmt_out, il, "weight"));
+                attn.o_b = get_tensor(new_blip2->ctx, format(fmt_out, il, "bias"));
+                attn.ln_w = get_tensor(new_blip2->ctx, format(fmt_ln, il, "weight"));
+                attn.ln_b = get_tensor(new_blip2->ctx, format(fmt_ln, il, "bias"));
+                return attn;
+            };
+
+            qformer_model.query_tokens = get_tensor(new_blip2->ctx, Q_QUERY_TOKENS);
+            qformer_model.ln_w = get_tensor(new_blip2->ctx, format(Q_LN, "weight"));
+            qformer_model.ln_b = get_tensor(new_blip2->ctx, format(Q_LN, "bias"));
+
+            const int freq = std::max(1u, new_blip2->cross_attention_frequency);
+            qformer_model.first_cross_layer = hparams.n_layer;
+            qformer_model.n_cross_layers = 0;
+
+            qformer_model.layers.resize(hparams.n_layer);
+            for (int i = 0; i < hparams.n_layer; ++i) {
+                auto & layer = qformer_model.layers[i];
+                layer.self_attn = get_attn(Q_SELF_ATTN, Q_SELF_OUT, Q_SELF_LN, i);
+
+                layer.has_cross_attn = i % freq == 0;
+                layer.cross_index = layer.has_cross_attn ? qformer_model.n_cross_layers++ : -1;
+                if (layer.has_cross_attn) {
+                    layer.cross_attn = get_attn(Q_CROSS_ATTN, Q_CROSS_OUT, Q_CROSS_LN, i);
+                    qformer_model.first_cross_layer = std::min(qformer_model.first_cross_layer, i);
+                }
+
+                layer.ff_1_w = get_tensor(new_blip2->ctx, format(Q_FF1, i, "weight"));
+                layer.ff_1_b = get_tensor(new_blip2->ctx, format(Q_FF1, i, "bias"));
+                layer.ff_2_w = get_tensor(new_blip2->ctx, format(Q_FF2, i, "weight"));
+                layer.ff_2_b = get_tensor(new_blip2->ctx, format(Q_FF2, i, "bias"));
+                layer.ln_w = get_tensor(new_blip2->ctx, format(Q_FF_LN, i, "weight"));
+                layer.ln_b = get_tensor(new_blip2->ctx, format(Q_FF_LN, i, "bias"));
+            }
+
+            // Text side of the retrieval models, the others only run the queries
+            qformer_model.has_text = gguf_find_tensor(ctx, format(Q_ITM_HEAD, "weight").c_str()) >= 0;
+            if (qformer_model.has_text) {
+                for (int i = 0; i < hparams.n_layer; ++i) {
+                    auto & layer = qformer_model.layers[i];
+                    layer.ff_text_1_w = get_tensor(new_blip2->ctx, format(Q_FF1_TEXT, i, "weight"));
+                    layer.ff_text_1_b = get_tensor(new_blip2->ctx, format(Q_FF1_TEXT, i, "bias"));
+                    layer.ff_text_2_w = get_tensor(new_blip2->ctx, format(Q_FF2_TEXT, i, "weight"));
+                    layer.ff_text_2_b = get_tensor(new_blip2->ctx, format(Q_FF2_TEXT, i, "bias"));
+                    layer.ln_text_w = get_tensor(new_blip2->ctx, format(Q_FF_LN_TEXT, i, "weight"));
+                    layer.ln_text_b = get_tensor(new_blip2->ctx, format(Q_FF_LN_TEXT, i, "bias"));
+                }
+
+                qformer_model.word_embd = get_tensor(new_blip2->ctx, Q_WORD_EMBD);
+                qformer_model.pos_embd = get_tensor(new_blip2->ctx, Q_POS_EMBD);
+                qformer_model.embd_ln_w = NULL;
+                qformer_model.embd_ln_b = NULL;
+                if (gguf_find_tensor(ctx, format(Q_EMBD_LN, "weight").c_str()) >= 0) {
+                    qformer_model.embd_ln_w = get_tensor(new_blip2->ctx, format(Q_EMBD_LN, "weight"));
+                    qformer_model.embd_ln_b = get_tensor(new_blip2->ctx, format(Q_EMBD_LN, "bias"));
+                }
+
+                qformer_model.vision_proj_w = get_tensor(new_blip2->ctx, format(Q_VISION_PROJ, "weight"));
+                qformer_model.vision_proj_b = get_tensor(new_blip2->ctx, format(Q_VISION_PROJ, "bias"));
+                qformer_model.text_proj_w = get_tensor(new_blip2->ctx, format(Q_TEXT_PROJ, "weight"));
+                qformer_model.text_proj_b = get_tensor(new_blip2->ctx, format(Q_TEXT_PROJ, "bias"));
+                qformer_model.itm_w = get_tensor(new_blip2->ctx, format(Q_ITM_HEAD, "weight"));
+                qformer_model.itm_b = get_tensor(new_blip2->ctx, format(Q_ITM_HEAD, "bias"));
+
+                if (!blip2_qformer_init_heads(new_blip2)) {
+                    blip2_free(new_blip2);
+                    return nullptr;
+                }
+            }
+
+            if (!blip2_qformer_init_cross_kv(new_blip2) || !blip2_qformer_init_prefix(new_blip2, model_params.n_threads)) {
+                blip2_free(new_blip2);
+                return nullptr;
+            }
+        }
+    }
+
+    // Load language model
+    {
+        auto & text_model = new_blip2->text_model;
+        auto & hparams = text_model.hparams;
+
+        hparams.n_ctx = get_u32(ctx, format(KEY_CONTEXT_LENGTH, "text"));
+        hparams.hidden_size = get_u32(ctx, format(KEY_EMBEDDING_LENGTH, "text"));
+        hparams.n_layer = get_u32(ctx, format(KEY_BLOCK_COUNT, "text"));
+        hparams.n_head = get_u32(ctx, format(KEY_ATTENTION_HEAD_COUNT, "text"));
+        // the default of OPTConfig, which the converter does not write
+        hparams.eps = 1e-5f;
+
+        // Load language model weights, unless the text tower was not requested or the model has none
+        // (the retrieval models stop at the Q-Former)
+        if ((new_blip2->towers & BLIP2_TOWER_TEXT) && gguf_find_tensor(ctx, format(T_LANGUAGE_PROJ, "weight").c_str()) >= 0) {
+            auto get_text_tensor = [&](const std::string & name) {
+                return get_tensor(new_blip2->ctx, name.substr(0, GGML_MAX_NAME - 1));
+            };
+
+            text_model.proj_w = get_text_tensor(format(T_LANGUAGE_PROJ, "weight"));
+            text_model.proj_b = get_text_tensor(format(T_LANGUAGE_PROJ, "bias"));
+            text_model.tok_embd = get_text_tensor(T_TOK_EMBD);
+            text_model.pos_embd = get_text_tensor(T_POS_EMBD);
+
+            text_model.layers.resize(hparams.n_layer);
+            for (int i = 0; i < hparams.n_layer; ++i) {
+                auto & layer = text_model.layers[i];
+                layer.ln_1_w = get_text_tensor(format(T_ATTN_LN, i, "weight"));
+                layer.ln_1_b = get_text_tensor(format(T_ATTN_LN, i, "bias"));
+
+                layer.q_w = get_text_tensor(format(T_ATTN, i, "q", "weight"));
+                layer.q_b = get_text_tensor(format(T_ATTN, i, "q", "bias"));
+                layer.k_w = get_text_tensor(format(T_ATTN, i, "k", "weight"));
+                layer.k_b = get_text_tensor(format(T_ATTN, i, "k", "bias"));
+                layer.v_w = get_text_tensor(format(T_ATTN, i, "v", "weight"));
+                layer.v_b = get_text_tensor(format(T_ATTN, i, "v", "bias"));
+                layer.o_w = get_text_tensor(format(T_ATTN, i, "out", "weight"));
+                layer.o_b = get_text_tensor(format(T_ATTN, i, "out", "bias"));
+
+                layer.ln_2_w = get_text_tensor(format(T_FF_LN, i, "weight"));
+                layer.ln_2_b = get_text_tensor(format(T_FF_LN, i, "bias"));
+
+                layer.ff_1_w = get_text_tensor(format(T_FF1, i, "weight"));
+                layer.ff_1_b = get_text_tensor(format(T_FF1, i, "bias"));
+                layer.ff_2_w = get_text_tensor(format(T_FF2, i, "weight"));
+                layer.ff_2_b = get_text_tensor(format(T_FF2, i, "bias"));
+            }
+
+            text_model.ln_f_w = get_text_tensor(format(T_LN_F, "weight"));
+            text_model.ln_f_b = get_text_tensor(format(T_LN_F, "bias"));
+
+            text_model.lm_head = ggml_get_tensor(new_blip2->ctx, T_LM_HEAD);
+            if (!text_model.lm_head) {
+                text_model.lm_head = text_model.tok_embd;
+            }
+
+            hparams.n_vocab = text_model.lm_head->ne[1];
+            hparams.n_intermediate = text_model.layers[0].ff_1_w->ne[1];
+            hparams.n_ctx = std::min<int32_t>(hparams.n_ctx, text_model.pos_embd->ne[1] - BLIP2_TEXT_POS_OFFSET);
+
+            // OPT variants with word_embed_proj_dim != hidden_size project their embeddings in and out
+            if (text_model.tok_embd->ne[0] != hparams.hidden_size || hparams.hidden_size % hparams.n_head != 0) {
+                fprintf(stderr, "%s: unsupported language model, embeddings of %d for a hidden size of %d\n",
+                        __func__, (int) text_model.tok_embd->ne[0], hparams.hidden_size);
+                blip2_free(new_blip2);
+                return nullptr;
+            }
+        }
+    }
+
+    ggml_free(meta);
+    new_blip2->ctx_gguf = ctx;
+
+    new_blip2->load_stats.t_load_us = ggml_time_us() - t_start_load_us;
+
+    return new_blip2;
+}
+
+bool blip2_model_save(const blip2_ctx * ctx, const char * fname) {
+    const auto & model = ctx->vision_model;
+    if (ctx->towers != BLIP2_TOWER_ALL || ctx->vision_stream.enabled || (int) model.layers.size() != model.hparams.n_layer) {
+        fprintf(stderr, "%s: only a model loaded whole and without streaming can be saved\n", __func__);
+        return false;
+    }
+
+    // Tensors replaced at load time are written under the name of the tensor they replace
+    std::map<std::string, const struct ggml_tensor *> replaced;
+    bool ln_folded = false;
+    for (int i = 0; i < (int) model.layers.size(); ++i) {
+        const auto & layer = model.layers[i];
+        replaced[format(V_QKV, i, "weight")] = layer.qkv_w;
+        replaced[format(V_QKV, i, "bias")] = layer.qkv_b;
+        replaced[format(V_MHA_FF1, i, "weight")] = layer.ff_1_w;
+        replaced[format(V_MHA_FF1, i, "bias")] = layer.ff_1_b;
+        ln_folded = ln_folded || !layer.ln_1_w || !layer.ln_2_w;
+    }
+    replaced[V_POS_EMBD] = model.pos_tables.at(model.hparams.image_size);
+
+    // Already part of the position table
+    const std::string zeroed[2] = { V_CLASS_EMBD, format(V_PATCH_EMBD, "bias") };
+
+    const int n_tensors = gguf_get_n_tensors(ctx->ctx_gguf);
+
+    struct ggml_init_params params = {
+        .mem_size = n_tensors * ggml_tensor_overhead(),
+        .mem_buffer = NULL,
+        .no_alloc = true,
+    };
+    struct ggml_context * meta = ggml_init(params);
+    if (!meta) {
+        fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+        return false;
+    }
+
+    struct gguf_context * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ctx->ctx_gguf);
+    gguf_set_val_bool(ctx_out, KEY_VISION_LN_FOLDED, ln_folded);
+
+    std::vector<const struct ggml_tensor *> srcs;
+    std::vector<bool> zero;
+    for (int i = 0; i < n_tensors; ++i) {
+        const char * name = gguf_get_tensor_name(ctx->ctx_gguf, i);
+
+        const int il = blip2_vision_layer_index(name);
+        if (il >= 0 && ((!model.layers[il].ln_1_w && starts_with(name, format(V_MHA_LN1, il, "").c_str())) ||
+                        (!model.layers[il].ln_2_w && starts_with(name, format(V_MHA_LN2, il, "").c_str())))) {
+            continue;
+        }
+
+        auto it = replaced.find(name);
+        const struct ggml_tensor * src = it != replaced.end() ? it->second : ggml_get_tensor(ctx->ctx, name);
+        if (!src) {
+            fprintf(stderr, "%s: tensor %s was not loaded\n", __func__, name);
+            gguf_free(ctx_out);
+            ggml_free(meta);
+            return false;
+        }
+
+        struct ggml_tensor * t = ggml_dup_tensor(meta, src);
+        ggml_set_name(t, name);
+        gguf_add_tensor(ctx_out, t);
+
+        srcs.push_back(src);
+        zero.push_back(name == zeroed[0] || name == zeroed[1]);
+    }
+
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+        gguf_free(ctx_out);
+        ggml_free(meta);
+        return false;
+    }
+
+    std::vector<uint8_t> header(gguf_get_meta_size(ctx_out));
+    gguf_get_meta_data(ctx_out, header.data());
+    fout.write((const char *) header.data(), header.size());
+
+    const size_t alignment = gguf_get_alignment(ctx_out);
+    std::vector<uint8_t> zeros;
+    for (size_t i = 0; i < srcs.size(); ++i) {
+        const size_t size = ggml_nbytes(srcs[i]);
+        const size_t pad = GGML_PAD(size, alignment) - size;
+        if (zeros.size() < std::max(pad, zero[i] ? size : 0)) {
+            zeros.resize(std::max(pad, zero[i] ? size : 0));
+        }
+
+        fout.write((const char *) (zero[i] ? zeros.data() : srcs[i]->data), size);
+        fout.write((const char *) zeros.data(), pad);
+    }
+
+    const bool ok = (bool) fout;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname);
+    }
+
+    gguf_free(ctx_out);
+    ggml_free(meta);
+
+    return ok;
+}
+
+// Read the weights of layer il into a slot. Runs on the prefetch thread too, so the slot state
+// is left to the caller, only ever updated from the thread calling acquire and release.
+static bool blip2_stream_read_layer(const blip2_layer_stream & stream, int il, int slot) {
+    for (const auto & st : stream.layers[il]) {
+        if (!stream.file.read(stream.slots[slot].data + st.slot_offset, ggml_nbytes(st.tensor), st.file_offset)) {
+            fprintf(stderr, "%s: failed to read tensor %s: %s\n", __func__, st.tensor->name, strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool blip2_vision_layer_acquire(blip2_ctx * ctx, int il) {
+    auto & stream = ctx->vision_stream;
+    if (!stream.enabled) {
+        return true;
+    }
+
+    const int n_layer = stream.layers.size();
+    if (il < 0 || il >= n_layer) {
+        fprintf(stderr, "%s: invalid layer %d\n", __func__, il);
+        return false;
+    }
+    const int next = (il + 1) % n_layer;
+
+    // With mmap, page the layer in (usually already done by the previous call) and ask for the next one
+    if (ctx->mapping.addr) {
+        for (const int l : { il, next }) {
+            for (const auto & st : stream.layers[l]) {
+                ctx->mapping.prefetch(st.file_offset, ggml_nbytes(st.tensor));
+            }
+        }
+        return true;
+    }
+
+    // The pending prefetch is most likely this very layer
+    if (stream.prefetch.joinable()) {
+        stream.prefetch.join();
+        if (stream.prefetch_ok) {
+            stream.slot_layer[stream.prefetch_slot] = stream.prefetch_layer;
+        } else {
+            fprintf(stderr, "%s: prefetch of layer %d failed, reading it again\n", __func__, stream.prefetch_layer);
+        }
+    }
+    stream.prefetch_layer = -1;
+    stream.prefetch_slot = -1;
+
+    int slot = -1;
+    for (int s = 0; s < 2; ++s) {
+        if (stream.slot_layer[s] == il) {
+            slot = s;
+        }
+    }
+
+    if (slot < 0) {
+        for (int s = 0; s < 2 && slot < 0; ++s) {
+            if (!stream.slot_busy[s]) {
+                slot = s;
+            }
+        }
+        if (slot < 0) {
+            fprintf(stderr, "%s: layers %d and %d are still in use\n", __func__, stream.slot_layer[0], stream.slot_layer[1]);
+            return false;
+        }
+
+        stream.slot_layer[slot] = -1;
+        if (!blip2_stream_read_layer(stream, il, slot)) {
+            return false;
+        }
+        stream.slot_layer[slot] = il;
+    }
+
+    stream.slot_busy[slot] = true;
+    for (const auto & st : stream.layers[il]) {
+        st.tensor->data = stream.slots[slot].data + st.slot_offset;
+    }
+
+    // Read the next layer into the other slot while this one is being computed
+    const int other = 1 - slot;
+    if (next != il && !stream.slot_busy[other] && stream.slot_layer[other] != next) {
+        stream.slot_layer[other] = -1;
+        stream.prefetch_layer = next;
+        stream.prefetch_slot = other;
+        stream.prefetch = std::thread([&stream, next, other]() {
+            stream.prefetch_ok = blip2_stream_read_layer(stream, next, other);
+        });
+    }
+
+    return true;
+}
+
+void blip2_vision_layer_release(blip2_ctx * ctx, int il) {
+    auto & stream = ctx->vision_stream;
+    if (!stream.enabled) {
+        return;
+    }
+
+    if (ctx->mapping.addr) {
+        for (const auto & st : stream.layers[il]) {
+            ctx->mapping.evict(st.file_offset, ggml_nbytes(st.tensor));
+        }
+        return;
+    }
+
+    for (int s = 0; s < 2; ++s) {
+        if (stream.slot_layer[s] == il) {
+            stream.slot_busy[s] = false;
+        }
+    }
+    for (const auto & st : stream.layers[il]) {
+        st.tensor->data = NULL;
+    }
+}
+
+// Vision encoder
+
+// Alignment of the tensors placed in the compute buffer
+static const size_t BLIP2_TENSOR_ALIGNMENT = 32;
+
+// Maximum number of nodes of a compute graph
+#define BLIP2_MAX_NODES 4096
+
+// Accumulate the squared activations entering a weight matrix, used as a pass-through op on its input
+static void blip2_imatrix_collect(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata) {
+    GGML_UNUSED(dst);
+    GGML_UNUSED(nth);
+    GGML_ASSERT(a->type == GGML_TYPE_F32);
+    if (ith != 0) {
+        return;
+    }
+
+    auto * entry = (blip2_imatrix_entry *) userdata;
+    const int64_t n = a->ne[0];
+    if (entry->values.empty()) {
+        entry->values.resize(n, 0.0f);
+    }
+    GGML_ASSERT((int64_t) entry->values.size() == n);
+
+    for (int64_t i3 = 0; i3 < a->ne[3]; ++i3) {
+        for (int64_t i2 = 0; i2 < a->ne[2]; ++i2) {
+            for (int64_t i1 = 0; i1 < a->ne[1]; ++i1) {
+                const float * x = (const float *) ((const char *) a->data + i1*a->nb[1] + i2*a->nb[2] + i3*a->nb[3]);
+                for (int64_t j = 0; j < n; ++j) {
+                    entry->values[j] += x[j]*x[j];
+                }
+            }
+        }
+    }
+    entry->ncall++;
+}
+
+// w*x, recording the statistics of x for w when an importance matrix is being gathered
+static struct ggml_tensor * blip2_mul_mat(struct ggml_context * ctx0, struct ggml_tensor * w, struct ggml_tensor * x, blip2_imatrix * imatrix) {
+    if (imatrix) {
+        x = ggml_map_custom1_inplace(ctx0, x, blip2_imatrix_collect, 1, &imatrix->entries[w->name]);
+    }
+
+    return ggml_mul_mat(ctx0, w, x);
+}
+
+// Attention tiles: the K and V rows of a tile stay in cache while every query row of a tile goes over them
+#define BLIP2_ATTN_TILE_Q 16
+#define BLIP2_ATTN_TILE_KV 64
+#define BLIP2_ATTN_MAX_D_HEAD 256
+
+// Flash attention over q, k, v of shape [d_head, n_head, n_tokens, n_batch] with contiguous rows
+// Each task is a tile of query rows of one head, whose softmax is computed online over the K/V tiles
+// so that only a BLIP2_ATTN_TILE_Q x BLIP2_ATTN_TILE_KV block of scores exists at any time
+// userdata optionally holds the sizes of the keys, see blip2_attention
+static void blip2_flash_attn_f32(struct ggml_tensor * dst, const struct ggml_tensor * q, const struct ggml_tensor * k, const struct ggml_tensor * v, int ith, int nth, void * userdata) {
+    const float * kv_sizes = (const float *) userdata;
+
+    const int d_head = q->ne[0];
+    const int n_head = q->ne[1];
+    const int n_q = q->ne[2];
+    const int n_kv = k->ne[2];
+    const int n_batch = q->ne[3];
+
+    GGML_ASSERT(q->type == GGML_TYPE_F32 && k->type == GGML_TYPE_F32 && v->type == GGML_TYPE_F32);
+    GGML_ASSERT(q->nb[0] == sizeof(float) && k->nb[0] == sizeof(float) && v->nb[0] == sizeof(float));
+    GGML_ASSERT(d_head <= BLIP2_ATTN_MAX_D_HEAD);
+
+    const float scale = 1.0f / sqrtf((float) d_head);
+
+    const int n_tiles = (n_q + BLIP2_ATTN_TILE_Q - 1) / BLIP2_ATTN_TILE_Q;
+    const int n_tasks = n_batch * n_head * n_tiles;
+
+    float S[BLIP2_ATTN_TILE_Q][BLIP2_ATTN_TILE_KV];
+    float O[BLIP2_ATTN_TILE_Q][BLIP2_ATTN_MAX_D_HEAD];
+    float M[BLIP2_ATTN_TILE_Q];
+    float L[BLIP2_ATTN_TILE_Q];
+    float B[BLIP2_ATTN_TILE_KV] = {};
+
+    for (int task = ith; task < n_tasks; task += nth) {
+        const int tile = task % n_tiles;
+        const int h = (task / n_tiles) % n_head;
+        const int b = task / (n_tiles * n_head);
+
+        const int i0 = tile * BLIP2_ATTN_TILE_Q;
+        const int nq = std::min(BLIP2_ATTN_TILE_Q, n_q - i0);
+
+        const char * q_data = (const char *) q->data + h*q->nb[1] + b*q->nb[3];
+        const char * k_data = (const char *) k->data + h*k->nb[1] + (b % k->ne[3])*k->nb[3];
+        const char * v_data = (const char *) v->data + h*v->nb[1] + (b % v->ne[3])*v->nb[3];
+
+        for (int i = 0; i < nq; i++) {
+            M[i] = -INFINITY;
+            L[i] = 0.0f;
+            memset(O[i], 0, d_head*sizeof(float));
+        }
+
+        for (int j0 = 0; j0 < n_kv; j0 += BLIP2_ATTN_TILE_KV) {
+            const int nkv = std::min(BLIP2_ATTN_TILE_KV, n_kv - j0);
+
+            if (kv_sizes) {
+                for (int j = 0; j < nkv; j++) {
+                    B[j] = logf(kv_sizes[b*n_kv + j0 + j]);
+                }
+            }
+
+            for (int i = 0; i < nq; i++) {
+                const float * qi = (const float *) (q_data + (i0 + i)*q->nb[2]);
+
+                float m = M[i];
+                for (int j = 0; j < nkv; j++) {
+                    const float * kj = (const float *) (k_data + (j0 + j)*k->nb[2]);
+                    S[i][j] = blip2_vec_dot_f32(qi, kj, d_head) * scale + B[j];
+                    m = std::max(m, S[i][j]);
+                }
+
+                // Rescale what was accumulated with the previous maximum
+                const float corr = expf(M[i] - m);
+                float sum = 0.0f;
+                for (int j = 0; j < nkv; j++) {
+                    S[i][j] = expf(S[i][j] - m);
+                    sum += S[i][j];
+                }
+                L[i] = L[i]*corr + sum;
+                M[i] = m;
+
+                if (corr != 1.0f) {
+                    for (int d = 0; d < d_head; d++) {
+                        O[i][d] *= corr;
+                    }
+                }
+                for (int j = 0; j < nkv; j++) {
+                    const float * vj = (const float *) (v_data + (j0 + j)*v->nb[2]);
+                    blip2_vec_mad_f32(O[i], vj, S[i][j], d_head);
+                }
+            }
+        }
+
+        for (int i = 0; i < nq; i++) {
+            float * out = (float *) ((char *) dst->data + h*dst->nb[1] + (i0 + i)*dst->nb[2] + b*dst->nb[3]);
+            const float inv = 1.0f / L[i];
+            for (int d = 0; d < d_head; d++) {
+                out[d] = O[i][d] * inv;
+            }
+        }
+    }
+}
+
+// Scores of shape [n_kv, n_q, n_head, n_batch] plus the log of the sizes of the keys, in place
+// The sizes are only known once the graph runs, so they cannot be a mask tensor of ggml_soft_max_ext
+static void blip2_attn_log_sizes_f32(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata) {
+    const float * kv_sizes = (const float *) userdata;
+
+    const int n_kv = a->ne[0];
+    const int n_rows = ggml_nrows(a);
+    const int n_rows_batch = a->ne[1]*a->ne[2];
+
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && ggml_is_contiguous(a) && dst->data == a->data);
+
+    for (int r = ith; r < n_rows; r += nth) {
+        float * row = (float *) dst->data + (size_t) r*n_kv;
+        const float * sizes = kv_sizes + (size_t) (r / n_rows_batch)*n_kv;
+        for (int j = 0; j < n_kv; j++) {
+            row[j] += logf(sizes[j]);
+        }
+    }
+}
+
+struct ggml_tensor * blip2_attention(struct ggml_context * ctx0, struct ggml_tensor * q, struct ggml_tensor * k, struct ggml_tensor * v, bool flash, const float * kv_sizes) {
+    if (flash) {
+        // The result of a custom op is a new contiguous tensor with the shape of q
+        return ggml_map_custom3(ctx0, q, k, v, blip2_flash_attn_f32, GGML_N_TASKS_MAX, (void *) kv_sizes);
+    }
+
+    const int d_head = q->ne[0];
+
+    q = ggml_cont(ctx0, ggml_permute(ctx0, q, 0, 2, 1, 3));
+    k = ggml_cont(ctx0, ggml_permute(ctx0, k, 0, 2, 1, 3));
+    v = ggml_cont(ctx0, ggml_permute(ctx0, v, 1, 2, 0, 3));
+
+    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, k, q);
+    if (kv_sizes) {
+        // The same bias as the flash kernel's
+        KQ = ggml_scale_inplace(ctx0, KQ, 1.0f / sqrtf((float) d_head));
+        KQ = ggml_map_custom1_inplace(ctx0, KQ, blip2_attn_log_sizes_f32, GGML_N_TASKS_MAX, (void *) kv_sizes);
+        KQ = ggml_soft_max(ctx0, KQ);
+    } else {
+        KQ = ggml_soft_max_ext(ctx0, KQ, NULL, 1.0f / sqrtf((float) d_head));
+    }
+
+    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, v, KQ);
+
+    return ggml_cont(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3));
+}
+
+// Without w and b the layernorm was folded into the layer after it
+static struct ggml_tensor * blip2_layer_norm(struct ggml_context * ctx0, struct ggml_tensor * cur, struct ggml_tensor * w, struct ggml_tensor * b, float eps) {
+    cur = ggml_norm(ctx0, cur, eps);
+    if (!w) {
+        return cur;
+    }
+
+    return ggml_add(ctx0, ggml_mul(ctx0, cur, w), b);
+}
+
+// Tokens a layer with n_tokens tokens can merge away: at most one per token of the first half of
+// the bipartite split, the class token excepted
+static int blip2_tome_layer_r(int r, int n_tokens) {
+    return std::max(0, std::min(r, (n_tokens + 1)/2 - 1));
+}
+
+// Bipartite soft matching of ToMe over x of shape [hidden_size, n_tokens, n_images] and the keys k of the
+// same tokens, [d_head, n_head, n_tokens, n_images]. Tokens alternate between the sets A and B, and the
+// r tokens of A whose closest token of B (cosine similarity of the keys averaged over heads) is the
+// closest of all are merged into it, the class token excepted. Merged tokens are size weighted averages.
+// The images are packed one after the other in the first n_images*(n_tokens - r) rows of dst,
+// the tokens of A left unmerged in their order first, then those of B.
+static void blip2_tome_merge_f32(struct ggml_tensor * dst, const struct ggml_tensor * x, const struct ggml_tensor * k, int ith, int nth, void * userdata) {
+    blip2_tome_layer * layer = (blip2_tome_layer *) userdata;
+
+    const int hidden_size = x->ne[0];
+    const int n_tokens = x->ne[1];
+    const int n_images = x->ne[2];
+    const int d_head = k->ne[0];
+    const int n_head = k->ne[1];
+    const int r = layer->r;
+    const int n_out = n_tokens - r;
+    const int n_a = (n_tokens + 1)/2;
+    const int n_b = n_tokens/2;
+
+    GGML_ASSERT(x->type == GGML_TYPE_F32 && k->type == GGML_TYPE_F32);
+    GGML_ASSERT(x->nb[0] == sizeof(float) && k->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_is_contiguous(dst));
+
+    std::vector<float> metric((size_t) n_tokens*d_head);
+    std::vector<float> best(n_a);
+    std::vector<int> best_idx(n_a);
+    std::vector<int> order(n_a);
+    std::vector<bool> merged(n_a);
+
+    for (int b = ith; b < n_images; b += nth) {
+        const float * sizes_in = layer->sizes_in ? layer->sizes_in + (size_t) b*n_tokens : NULL;
+        float * sizes_out = layer->sizes_out.data() + (size_t) b*n_out;
+        auto size = [&](int i) { return sizes_in ? sizes_in[i] : 1.0f; };
+        auto row = [&](int i) { return (const float *) ((const char *) x->data + i*x->nb[1] + b*x->nb[2]); };
+
+        // Keys averaged over heads, normalized
+        for (int i = 0; i < n_tokens; i++) {
+            float * m = metric.data() + (size_t) i*d_head;
+            memset(m, 0, d_head*sizeof(float));
+            for (int h = 0; h < n_head; h++) {
+                blip2_vec_mad_f32(m, (const float *) ((const char *) k->data + h*k->nb[1] + i*k->nb[2] + b*k->nb[3]), 1.0f, d_head);
+            }
+            const float norm = sqrtf(blip2_vec_dot_f32(m, m, d_head));
+            const float inv = norm > 0.0f ? 1.0f/norm : 0.0f;
+            for (int d = 0; d < d_head; d++) {
+                m[d] *= inv;
+            }
+        }
+
+        best[0] = -INFINITY;
+        best_idx[0] = 0;
+        for (int a = 1; a < n_a; a++) {
+            const float * ma = metric.data() + (size_t) (2*a)*d_head;
+            best[a] = -INFINITY;
+            best_idx[a] = 0;
+            for (int j = 0; j < n_b; j++) {
+                const float score = blip2_vec_dot_f32(ma, metric.data() + (size_t) (2*j + 1)*d_head, d_head);
+                if (score > best[a]) {
+                    best[a] = score;
+                    best_idx[a] = j;
+                }
+            }
+        }
+
+        for (int a = 0; a < n_a; a++) {
+            order[a] = a;
+            merged[a] = false;
+        }
+        std::partial_sort(order.begin(), order.begin() + r, order.end(), [&](int i, int j) { return best[i] > best[j]; });
+        for (int i = 0; i < r; i++) {
+            merged[order[i]] = true;
+        }
+
+        float * out = (float *) dst->data + (size_t) b*n_out*hidden_size;
+
+        int n_kept = 0;
+        for (int a = 0; a < n_a; a++) {
+            if (!merged[a]) {
+                memcpy(out + (size_t) n_kept*hidden_size, row(2*a), hidden_size*sizeof(float));
+                sizes_out[n_kept] = size(2*a);
+                n_kept++;
+            }
+        }
+
+        // Tokens of B accumulate their own sum and the sums of the tokens merged into them
+        float * out_b = out + (size_t) n_kept*hidden_size;
+        for (int j = 0; j < n_b; j++) {
+            float * o = out_b + (size_t) j*hidden_size;
+            memset(o, 0, hidden_size*sizeof(float));
+            blip2_vec_mad_f32(o, row(2*j + 1), size(2*j + 1), hidden_size);
+            sizes_out[n_kept + j] = size(2*j + 1);
+        }
+        for (int i = 0; i < r; i++) {
+            const int a = order[i];
+            const int j = best_idx[a];
+            blip2_vec_mad_f32(out_b + (size_t) j*hidden_size, row(2*a), size(2*a), hidden_size);
+            sizes_out[n_kept + j] += size(2*a);
+        }
+        for (int j = 0; j < n_b; j++) {
+            float * o = out_b + (size_t) j*hidden_size;
+            const float inv = 1.0f/sizes_out[n_kept + j];
+            for (int d = 0; d < hidden_size; d++) {
+                o[d] *= inv;
+            }
+        }
+    }
+}
+
+// Preprocess the images of a batch into the slots of the input tensor, n_threads images at a time
+static void blip2_vision_preprocess_batch(const blip2_ctx * ctx, const image_u8 * imgs, int n_images, struct ggml_tensor * inp, int n_threads) {
+    std::atomic<int> next(0);
+
+    auto worker = [&]() {
+        while (true) {
+            const int i = next++;
+            if (i >= n_images) {
+                break;
+            }
+            blip2_image_preprocess_to_patches(ctx, &imgs[i], inp, i);
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, n_images));
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+// Vision encoder over a batch of images
+// Activations are kept as [hidden_size, num_positions*n_images] so that every weight matrix is applied
+// to the whole batch in one matrix multiplication, attention being the only per-image part
+// With token merging every layer drops up to tome_r tokens after its attention, tome holding the sizes
+// of the merged tokens for the layers after it
+// The graph runs the layers il_begin .. il_end, from the patches when il_begin is 0 and from the hidden states
+// inp_hidden otherwise, and ends with the post layernorm when il_end is the last layer. tome has an entry per
+// layer, the entries of the layers before il_begin are those of the graphs that ran them.
+static struct ggml_cgraph * blip2_vision_build_graph(blip2_ctx * ctx, struct ggml_context * ctx0, ggml_allocr * allocr, int n_images, int il_begin, int il_end,
+                                                     blip2_imatrix * imatrix, std::vector<blip2_tome_layer> & tome) {
+    const auto & model = ctx->vision_model;
+    const auto & hparams = model.hparams;
+
+    const int patch_size = hparams.patch_size;
+    const int num_positions = blip2_vision_n_positions(ctx);
+    const int hidden_size = hparams.hidden_size;
+    const int n_head = hparams.n_head;
+    const int d_head = hidden_size / n_head;
+    const float eps = hparams.eps;
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, BLIP2_MAX_NODES, false);
+
+    // The graph points into tome, which is sized once and for all here
+    tome.resize(model.layers.size());
+    for (int il = il_begin; il < il_end; ++il) {
+        tome[il] = blip2_tome_layer();
+    }
+
+    // Tokens and sizes of the merged tokens entering il_begin
+    const float * sizes = NULL;
+    int n_tokens = num_positions;
+    for (int il = 0; il < il_begin; ++il) {
+        n_tokens -= tome[il].r;
+        if (tome[il].r > 0) {
+            sizes = tome[il].sizes_out.data();
+        }
+    }
+
+    struct ggml_tensor * cur = NULL;
+    if (il_begin == 0) {
+        // Input images cut into patches, one column of patch_size*patch_size*3 values per position,
+        // the column of the class token being left at zero. Filled in before each run.
+        const int patch_len = patch_size*patch_size*3;
+        struct ggml_tensor * inp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, patch_len, num_positions, n_images);
+        ggml_set_name(inp, "inp_patches");
+        ggml_allocr_alloc(allocr, inp);
+
+        // Patches do not overlap, so the patch convolution is a single matrix multiplication
+        struct ggml_tensor * embeddings = ggml_mul_mat(ctx0,
+            ggml_reshape_2d(ctx0, model.patch_embeddings_w, patch_len, hidden_size),
+            ggml_reshape_2d(ctx0, inp, patch_len, num_positions*n_images));
+
+        // Patch bias, class embedding and position embeddings come in one table, see blip2_vision_init_pos_table
+        embeddings = ggml_add(ctx0, ggml_reshape_3d(ctx0, embeddings, hidden_size, num_positions, n_images), model.pos_table);
+
+        cur = ggml_reshape_2d(ctx0, embeddings, hidden_size, num_positions*n_images);
+    } else {
+        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, hidden_size, n_tokens*n_images);
+        ggml_set_name(cur, "inp_hidden");
+        ggml_allocr_alloc(allocr, cur);
+    }
+
+    for (int il = il_begin; il < il_end; ++il) {
+        const auto & layer = model.layers[il];
+        struct ggml_tensor * residual = cur;
+
+        cur = blip2_layer_norm(ctx0, cur, layer.ln_1_w, layer.ln_1_b, eps);
+
+        // Self-attention, q, k and v come out of the fused projection one after the other
+        struct ggml_tensor * qkv = ggml_add(ctx0, blip2_mul_mat(ctx0, layer.qkv_w, cur, imatrix), layer.qkv_b);
+        const size_t es = ggml_element_size(qkv);
+        const size_t nb_pos = qkv->nb[1];
+        const size_t nb_img = nb_pos*n_tokens;
+
+        struct ggml_tensor * Q = ggml_view_4d(ctx0, qkv, d_head, n_head, n_tokens, n_images, d_head*es, nb_pos, nb_img, 0);
+        struct ggml_tensor * K = ggml_view_4d(ctx0, qkv, d_head, n_head, n_tokens, n_images, d_head*es, nb_pos, nb_img, hidden_size*es);
+        struct ggml_tensor * V = ggml_view_4d(ctx0, qkv, d_head, n_head, n_tokens, n_images, d_head*es, nb_pos, nb_img, 2*hidden_size*es);
+
+        struct ggml_tensor * KQV = blip2_attention(ctx0, Q, K, V, ctx->flash_attn, sizes);
+        cur = ggml_reshape_2d(ctx0, KQV, hidden_size, n_tokens*n_images);
+
+        cur = ggml_add(ctx0, blip2_mul_mat(ctx0, layer.proj_w, cur, imatrix), layer.proj_b);
+        cur = ggml_add(ctx0, cur, residual);
+
+        // Token merging, between the attention and the feed-forward as in ToMe
+        const int r = blip2_tome_layer_r(ctx->tome_r, n_tokens);
+        if (r > 0) {
+            auto & state = tome[il];
+            state.r = r;
+            state.sizes_in = sizes;
+            state.sizes_out.resize((size_t) (n_tokens - r)*n_images);
+
+            struct ggml_tensor * merged = ggml_map_custom2(ctx0, ggml_reshape_3d(ctx0, cur, hidden_size, n_tokens, n_images), K,
+                blip2_tome_merge_f32, GGML_N_TASKS_MAX, &state);
+
+            n_tokens -= r;
+            sizes = state.sizes_out.data();
+            cur = ggml_view_2d(ctx0, merged, hidden_size, n_tokens*n_images, merged->nb[1], 0);
+        }
+
+        // Feed-forward
+        residual = cur;
+
+        cur = blip2_layer_norm(ctx0, cur, layer.ln_2_w, layer.ln_2_b, eps);
+
+        cur = ggml_add(ctx0, blip2_mul_mat(ctx0, layer.ff_1_w, cur, imatrix), layer.ff_1_b);
+        cur = ctx->vision_gelu ? ggml_gelu_inplace(ctx0, cur) : ggml_gelu_quick_inplace(ctx0, cur);
+        cur = ggml_add(ctx0, blip2_mul_mat(ctx0, layer.ff_2_w, cur, imatrix), layer.ff_2_b);
+
+        cur = ggml_add(ctx0, cur, residual);
+    }
+
+    if (il_end == (int) model.layers.size()) {
+        cur = blip2_layer_norm(ctx0, cur, model.post_ln_w, model.post_ln_b, eps);
+    }
+
+    ggml_build_forward_expand(gf, cur);
+
+    return gf;
+}
+
+void blip2_graph_cache::clear() {
+    if (ctx0) {
+        ggml_free(ctx0);
+    }
+    ctx0 = NULL;
+    gf = NULL;
+    n_batch = -1;
+    layers.clear();
+}
+
+#define BLIP2_GRAPH_CACHE_SHAPES 8
+
+blip2_graph_cache & blip2_graph_cache_set::get(const std::vector<int> & shape) {
+    for (auto it = caches.begin(); it != caches.end(); ++it) {
+        if (it->first == shape) {
+            caches.splice(caches.begin(), caches, it);
+            return caches.front().second;
+        }
+    }
+
+    if (caches.size() >= BLIP2_GRAPH_CACHE_SHAPES) {
+        caches.pop_back();
+    }
+    caches.emplace_front();
+    caches.front().first = shape;
+
+    return caches.front().second;
+}
+
+typedef std::function<struct ggml_cgraph * (struct ggml_context * ctx0, ggml_allocr * allocr)> blip2_graph_builder;
+
+// Size of the compute buffer the graph of build needs, from a measure pass of the allocator
+static size_t blip2_graph_measure(blip2_graph_cache & cache, const blip2_graph_builder & build) {
+    cache.buf_graph.resize(ggml_tensor_overhead()*BLIP2_MAX_NODES + ggml_graph_overhead_custom(BLIP2_MAX_NODES, false));
+
+    struct ggml_init_params params = {
+        .mem_size = cache.buf_graph.size(),
+        .mem_buffer = cache.buf_graph.data(),
+        .no_alloc = true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+    ggml_allocr * allocr = ggml_allocr_new_measure(BLIP2_TENSOR_ALIGNMENT);
+    struct ggml_cgraph * gf = build(ctx0, allocr);
+    const size_t compute_size = ggml_allocr_alloc_graph(allocr, gf) + BLIP2_TENSOR_ALIGNMENT;
+    ggml_allocr_free(allocr);
+    ggml_free(ctx0);
+
+    return compute_size;
+}
+
+// Build the graph of build into the cache, with its tensors in buf, measured large enough for it
+static bool blip2_graph_build(blip2_graph_cache & cache, const blip2_buffer & buf, const blip2_graph_builder & build) {
+    struct ggml_init_params params = {
+        .mem_size = cache.buf_graph.size(),
+        .mem_buffer = cache.buf_graph.data(),
+        .no_alloc = true,
+    };
+
+    cache.ctx0 = ggml_init(params);
+    if (!cache.ctx0) {
+        fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+        return false;
+    }
+    ggml_allocr * allocr = ggml_allocr_new(buf.data, buf.size, BLIP2_TENSOR_ALIGNMENT);
+    cache.gf = build(cache.ctx0, allocr);
+    ggml_allocr_alloc_graph(allocr, cache.gf);
+    ggml_allocr_free(allocr);
+
+    return true;
+}
+
+// Make sure the cache holds the graph of build for n_batch and a plan for n_threads
+// A new shape builds the graph twice, once to measure the compute buffer it needs and once for real
+static bool blip2_graph_cache_prepare(blip2_graph_cache & cache, int n_batch, int n_threads, const blip2_graph_builder & build) {
+    if (cache.gf && cache.n_batch == n_batch && cache.n_threads == n_threads) {
+        return true;
+    }
+
+    if (!cache.gf || cache.n_batch != n_batch) {
+        cache.clear();
+
+        const size_t compute_size = blip2_graph_measure(cache, build);
+        if (cache.buf_compute.size < compute_size) {
+            cache.buf_compute.resize(compute_size);
+        }
+        if (!blip2_graph_build(cache, cache.buf_compute, build)) {
+            return false;
+        }
+
+        cache.n_batch = n_batch;
+    }
+
+    cache.plan = ggml_graph_plan(cache.gf, n_threads);
+    if (cache.plan.work_size > cache.buf_work.size()) {
+        cache.buf_work.resize(cache.plan.work_size);
+    }
+    cache.plan.work_data = cache.buf_work.data();
+    cache.n_threads = n_threads;
+
+    return true;
+}
+
+// With streamed layers the encoder runs as one graph per layer, each one between the acquire and the release
+// The graphs of all the layers are built once per batch size. They run one after the other, so they share
+// the compute and work buffers of the cache, sized for the largest one.
+static struct ggml_tensor * blip2_vision_compute_streamed(blip2_ctx * ctx, blip2_graph_cache & cache, const image_u8 * imgs, int n_images, int n_threads, blip2_imatrix * imatrix) {
+    auto & stream = ctx->vision_stream;
+    const int n_layer = ctx->vision_model.layers.size();
+
+    auto build_layer = [&](int il) -> blip2_graph_builder {
+        return [&, il](struct ggml_context * ctx0, ggml_allocr * allocr) {
+            return blip2_vision_build_graph(ctx, ctx0, allocr, n_images, il, il + 1, imatrix, cache.tome);
+        };
+    };
+
+    if ((int) cache.layers.size() != n_layer || cache.n_batch != n_images) {
+        cache.clear();
+
+        // Weights that are not resident have no data, which the allocator would take for tensors to place in
+        // the compute buffer. They point to a slot while the graphs are built, acquire sets the actual one.
+        auto set_placeholders = [&](bool set) {
+            for (const auto & layer : stream.layers) {
+                for (const auto & st : layer) {
+                    if (set && st.tensor->data == NULL) {
+                        st.tensor->data = stream.slots[0].data + st.slot_offset;
+                    } else if (!set && st.tensor->data == stream.slots[0].data + st.slot_offset) {
+                        st.tensor->data = NULL;
+                    }
+                }
+            }
+        };
+        if (!ctx->mapping.addr) {
+            set_placeholders(true);
+        }
+
+        // All measured before any is built, as the buffer they share must not move once a graph is in it.
+        // The builds then go in order: a layer graph points to the token merging state of the previous one.
+        size_t compute_size = 0;
+        for (int il = 0; il < n_layer; ++il) {
+            cache.layers.emplace_back(new blip2_graph_cache);
+            compute_size = std::max(compute_size, blip2_graph_measure(*cache.layers[il], build_layer(il)));
+        }
+        if (cache.buf_compute.size < compute_size) {
+            cache.buf_compute.resize(compute_size);
+        }
+
+        bool ok = true;
+        for (int il = 0; il < n_layer && ok; ++il) {
+            ok = blip2_graph_build(*cache.layers[il], cache.buf_compute, build_layer(il));
+            cache.layers[il]->n_batch = n_images;
+        }
+
+        if (!ctx->mapping.addr) {
+            set_placeholders(false);
+        }
+        if (!ok) {
+            cache.clear();
+            return nullptr;
+        }
+        cache.n_batch = n_images;
+        cache.n_threads = 0;
+    }
+
+    if (cache.n_threads != n_threads) {
+        for (auto & layer : cache.layers) {
+            layer->plan = ggml_graph_plan(layer->gf, n_threads);
+            if (layer->plan.work_size > cache.buf_work.size()) {
+                cache.buf_work.resize(layer->plan.work_size);
+            }
+            layer->n_threads = n_threads;
+        }
+        for (auto & layer : cache.layers) {
+            layer->plan.work_data = cache.buf_work.data();
+        }
+        cache.n_threads = n_threads;
+    }
+
+    std::vector<float> hidden;
+    struct ggml_tensor * out = nullptr;
+    for (int il = 0; il < n_layer; ++il) {
+        struct ggml_cgraph * gf = cache.layers[il]->gf;
+
+        // Every graph has its input in the shared compute buffer, the hidden state in between is kept aside
+        if (il == 0) {
+            blip2_vision_preprocess_batch(ctx, imgs, n_images, ggml_graph_get_tensor(gf, "inp_patches"), n_threads);
+        } else {
+            struct ggml_tensor * inp = ggml_graph_get_tensor(gf, "inp_hidden");
+            memcpy(inp->data, hidden.data(), ggml_nbytes(inp));
+        }
+
+        if (!blip2_vision_layer_acquire(ctx, il)) {
+            return nullptr;
+        }
+        ggml_graph_compute(gf, &cache.layers[il]->plan);
+        blip2_vision_layer_release(ctx, il);
+
+        out = gf->nodes[gf->n_nodes - 1];
+        if (il + 1 < n_layer) {
+            hidden.resize(ggml_nelements(out));
+            memcpy(hidden.data(), out->data, ggml_nbytes(out));
+        }
+    }
+
+    return out;
+}
+
+// Run the vision graph of the cache on a batch of images, the graph is only built when the batch size changes
+// The output tensor lives in the cache and is valid until its next use
+static struct ggml_tensor * blip2_vision_compute(blip2_ctx * ctx, blip2_graph_cache & cache, const image_u8 * imgs, int n_images, int n_threads, blip2_imatrix * imatrix) {
+    if (!(ctx->towers & BLIP2_TOWER_VISION)) {
+        fprintf(stderr, "%s: the vision tower was not loaded\n", __func__);
+        return nullptr;
+    }
+    if (ctx->vision_stream.enabled) {
+        return blip2_vision_compute_streamed(ctx, cache, imgs, n_images, n_threads, imatrix);
+    }
+
+    const int n_layer = ctx->vision_model.layers.size();
+    auto build = [&](struct ggml_context * ctx0, ggml_allocr * allocr) {
+        return blip2_vision_build_graph(ctx, ctx0, allocr, n_images, 0, n_layer, imatrix, cache.tome);
+    };
+    if (!blip2_graph_cache_prepare(cache, n_images, n_threads, build)) {
+        return nullptr;
+    }
+
+    blip2_vision_preprocess_batch(ctx, imgs, n_images, ggml_graph_get_tensor(cache.gf, "inp_patches"), n_threads);
+
+    ggml_graph_compute(cache.gf, &cache.plan);
+
+    return cache.gf->nodes[cache.gf->n_nodes - 1];
+}
+
+int blip2_vision_n_positions(const blip2_ctx * ctx) {
+    const int n_side = ctx->vision_image_size / ctx->vision_model.hparams.patch_size;
+
+    return n_side*n_side + 1;
+}
+
+int blip2_vision_n_output_tokens(const blip2_ctx * ctx) {
+    int n_tokens = blip2_vision_n_positions(ctx);
+    for (size_t il = 0; il < ctx->vision_model.layers.size(); ++il) {
+        n_tokens -= blip2_tome_layer_r(ctx->tome_r, n_tokens);
+    }
+
+    return n_tokens;
+}
+
+bool blip2_vision_encode_batch(blip2_ctx * ctx, const image_u8 * imgs, int n_images, int n_threads, float * embd) {
+    if (n_images <= 0) {
+        fprintf(stderr, "%s: invalid number of images %d\n", __func__, n_images);
+        return false;
+    }
+
+    struct ggml_tensor * out = blip2_vision_compute(ctx, ctx->vision_graph.get({n_images}), imgs, n_images, n_threads, nullptr);
+    if (!out) {
+        return false;
+    }
+
+    memcpy(embd, out->data, ggml_nbytes(out));
+
+    return true;
+}
+
+// w*x + b for x of shape [hidden_size, n_tokens, n_batch], split into heads [d_head, n_head, n_tokens, n_batch]
+static struct ggml_tensor * blip2_qformer_heads(const blip2_ctx * ctx, struct ggml_context * ctx0, struct ggml_tensor * w, struct ggml_tensor * b, struct ggml_tensor * x) {
+    const int n_head = ctx->qformer_model.hparams.n_head;
+    struct ggml_tensor * cur = ggml_add(ctx0, ggml_mul_mat(ctx0, w, x), b);
+
+    return ggml_reshape_4d(ctx0, cur, cur->ne[0] / n_head, n_head, x->ne[1], x->ne[2]);
+}
+
+// Output projection and residual layernorm of an attention block, KQV being the attention of the rows of x
+static struct ggml_tensor * blip2_qformer_attn_out(const blip2_ctx * ctx, struct ggml_context * ctx0, const blip2_qformer_attn & attn, struct ggml_tensor * KQV, struct ggml_tensor * x) {
+    struct ggml_tensor * cur = ggml_reshape_3d(ctx0, KQV, x->ne[0], x->ne[1], x->ne[2]);
+    cur = ggml_add(ctx0, ggml_mul_mat(ctx0, attn.o_w, cur), attn.o_b);
+
+    return blip2_layer_norm(ctx0, ggml_add(ctx0, cur, x), attn.ln_w, attn.ln_b, ctx->qformer_model.hparams.eps);
+}
+
+// Attention block of a Q-Former layer, queries x of shape [hidden_size, n_q, n_batch] attending to
+// the keys K and values V already projected, [d_head, n_head, n_kv, n_batch] or shared by the batch
+static struct ggml_tensor * blip2_qformer_attn_kv_block(const blip2_ctx * ctx, struct ggml_context * ctx0, const blip2_qformer_attn & attn, struct ggml_tensor * x, struct ggml_tensor * K, struct ggml_tensor * V) {
+    struct ggml_tensor * Q = blip2_qformer_heads(ctx, ctx0, attn.q_w, attn.q_b, x);
+
+    return blip2_qformer_attn_out(ctx, ctx0, attn, blip2_attention(ctx0, Q, K, V, ctx->flash_attn), x);
+}
+
+// Same with the keys and values projected from kv [n_embd_kv, n_kv, n_batch], x itself for self-attention
+static struct ggml_tensor * blip2_qformer_attn_block(const blip2_ctx * ctx, struct ggml_context * ctx0, const blip2_qformer_attn & attn, struct ggml_tensor * x, struct ggml_tensor * kv) {
+    struct ggml_tensor * K = blip2_qformer_heads(ctx, ctx0, attn.k_w, attn.k_b, kv);
+    struct ggml_tensor * V = blip2_qformer_heads(ctx, ctx0, attn.v_w, attn.v_b, kv);
+
+    return blip2_qformer_attn_kv_block(ctx, ctx0, attn, x, K, V);
+}
+
+// Self-attention over the query tokens q and the text tokens t together, kept apart since
+// everything else treats them differently
+static void blip2_qformer_joint_attn_block(const blip2_ctx * ctx, struct ggml_context * ctx0, const blip2_qformer_attn & attn, struct ggml_tensor *& q, struct ggml_tensor *& t) {
+    struct ggml_tensor * K = ggml_concat(ctx0,
+        blip2_qformer_heads(ctx, ctx0, attn.k_w, attn.k_b, q), blip2_qformer_heads(ctx, ctx0, attn.k_w, attn.k_b, t));
+    struct ggml_tensor * V = ggml_concat(ctx0,
+        blip2_qformer_heads(ctx, ctx0, attn.v_w, attn.v_b, q), blip2_qformer_heads(ctx, ctx0, attn.v_w, attn.v_b, t));
+
+    struct ggml_tensor * q_out = blip2_qformer_attn_kv_block(ctx, ctx0, attn, q, K, V);
+    t = blip2_qformer_attn_kv_block(ctx, ctx0, attn, t, K, V);
+    q = q_out;
+}
+
+static struct ggml_tensor * blip2_qformer_ff(const blip2_ctx * ctx, struct ggml_context * ctx0, struct ggml_tensor * x,
+                                             struct ggml_tensor * w_1, struct ggml_tensor * b_1, struct ggml_tensor * w_2, struct ggml_tensor * b_2,
+                                             struct ggml_tensor * ln_w, struct ggml_tensor * ln_b) {
+    struct ggml_tensor * cur = ggml_add(ctx0, ggml_mul_mat(ctx0, w_1, x), b_1);
+    cur = ctx->qformer_gelu ? ggml_gelu_inplace(ctx0, cur) : ggml_gelu_quick_inplace(ctx0, cur);
+    cur = ggml_add(ctx0, ggml_mul_mat(ctx0, w_2, cur), b_2);
+
+    return blip2_layer_norm(ctx0, ggml_add(ctx0, cur, x), ln_w, ln_b, ctx->qformer_model.hparams.eps);
+}
+
+static struct ggml_tensor * blip2_qformer_ff_block(const blip2_ctx * ctx, struct ggml_context * ctx0, const blip2_qformer_layer & layer, struct ggml_tensor * x) {
+    return blip2_qformer_ff(ctx, ctx0, x, layer.ff_1_w, layer.ff_1_b, layer.ff_2_w, layer.ff_2_b, layer.ln_w, layer.ln_b);
+}
+
+static struct ggml_tensor * blip2_qformer_ff_text_block(const blip2_ctx * ctx, struct ggml_context * ctx0, const blip2_qformer_layer & layer, struct ggml_tensor * x) {
+    return blip2_qformer_ff(ctx, ctx0, x, layer.ff_text_1_w, layer.ff_text_1_b, layer.ff_text_2_w, layer.ff_text_2_b, layer.ln_text_w, layer.ln_text_b);
+}
+
+// Layernorms of the embeddings entering the Q-Former, the retrieval models have one more of their own
+static struct ggml_tensor * blip2_qformer_embd_norm(const blip2_ctx * ctx, struct ggml_context * ctx0, struct ggml_tensor * cur) {
+    const auto & model = ctx->qformer_model;
+    if (model.has_text && model.embd_ln_w) {
+        cur = blip2_layer_norm(ctx0, cur, model.embd_ln_w, model.embd_ln_b, model.hparams.eps);
+    }
+
+    return blip2_layer_norm(ctx0, cur, model.ln_w, model.ln_b, model.hparams.eps);
+}
+
+// The query tokens up to the first cross-attention: the embedding layernorms, the layers without
+// cross-attention before it and the self-attention of its own layer. Weights only, run once at load.
+static struct ggml_cgraph * blip2_qformer_build_prefix_graph(const blip2_ctx * ctx, struct ggml_context * ctx0) {
+    const auto & model = ctx->qformer_model;
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, BLIP2_MAX_NODES, false);
+
+    struct ggml_tensor * cur = ggml_reshape_3d(ctx0, model.query_tokens, model.hparams.hidden_size, ctx->num_query_tokens, 1);
+    cur = blip2_qformer_embd_norm(ctx, ctx0, cur);
+
+    for (int il = 0; il < model.first_cross_layer; ++il) {
+        cur = blip2_qformer_attn_block(ctx, ctx0, model.layers[il].self_attn, cur, cur);
+        cur = blip2_qformer_ff_block(ctx, ctx0, model.layers[il], cur);
+    }
+    if (model.first_cross_layer < (int) model.layers.size()) {
+        cur = blip2_qformer_attn_block(ctx, ctx0, model.layers[model.first_cross_layer].self_attn, cur, cur);
+    }
+
+    ggml_build_forward_expand(gf, cur);
+
+    return gf;
+}
+
+static bool blip2_qformer_init_prefix(blip2_ctx * ctx, int n_threads) {
+    auto & model = ctx->qformer_model;
+    const int hidden_size = model.hparams.hidden_size;
+
+    if (ggml_nelements(model.query_tokens) != (int64_t) hidden_size * ctx->num_query_tokens) {
+        fprintf(stderr, "%s: unexpected shape of the query tokens\n", __func__);
+        return false;
+    }
+
+    // The graphs normalize the query tokens, which ggml_norm only does in F32. Earlier versions
+    // of blip2-quantize converted them to the type of the Q-Former.
+    if (model.query_tokens->type != GGML_TYPE_F32) {
+        const std::vector<float> query_tokens = blip2_tensor_to_f32(model.query_tokens);
+        model.query_tokens = blip2_new_derived_tensor(ctx, GGML_TYPE_F32, hidden_size, ctx->num_query_tokens, Q_QUERY_TOKENS);
+        if (!model.query_tokens) {
+            fprintf(stderr, "%s: failed to allocate the query tokens\n", __func__);
+            return false;
+        }
+        memcpy(model.query_tokens->data, query_tokens.data(), ggml_nbytes(model.query_tokens));
+    }
+
+    model.query_prefix = blip2_new_derived_tensor(ctx, GGML_TYPE_F32, hidden_size, ctx->num_query_tokens, "qformer.query_prefix");
+    if (!model.query_prefix) {
+        fprintf(stderr, "%s: failed to allocate the query prefix\n", __func__);
+        return false;
+    }
+
+    blip2_graph_cache cache;
+    auto build = [&](struct ggml_context * ctx0, ggml_allocr * allocr) {
+        GGML_UNUSED(allocr);
+        return blip2_qformer_build_prefix_graph(ctx, ctx0);
+    };
+    if (!blip2_graph_cache_prepare(cache, 1, std::max(1, n_threads), build)) {
+        return false;
+    }
+    ggml_graph_compute(cache.gf, &cache.plan);
+
+    const struct ggml_tensor * out = cache.gf->nodes[cache.gf->n_nodes - 1];
+    memcpy(model.query_prefix->data, out->data, ggml_nbytes(model.query_prefix));
+
+    return true;
+}
+
+// Cross-attention keys and values of a batch of images for all the layers at once
+static struct ggml_cgraph * blip2_qformer_build_kv_graph(blip2_ctx * ctx, struct ggml_context * ctx0, ggml_allocr * allocr, int n_images, int n_image_tokens) {
+    const auto & model = ctx->qformer_model;
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, BLIP2_MAX_NODES, false);
+
+    struct ggml_tensor * inp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, model.hparams.encoder_hidden_size, n_image_tokens, n_images);
+    ggml_set_name(inp, "inp_image_embd");
+    ggml_allocr_alloc(allocr, inp);
+
+    struct ggml_tensor * cur = ggml_add(ctx0, ggml_mul_mat(ctx0, model.cross_kv_w, inp), model.cross_kv_b);
+
+    ggml_build_forward_expand(gf, cur);
+
+    return gf;
+}
+
+// Keys and values of a cross-attention layer in the stacked projections inp of blip2_qformer_kv
+static void blip2_qformer_cross_kv(const blip2_ctx * ctx, struct ggml_context * ctx0, struct ggml_tensor * inp, int cross_index,
+                                   struct ggml_tensor *& K, struct ggml_tensor *& V) {
+    const int hidden_size = ctx->qformer_model.hparams.hidden_size;
+    const int n_head = ctx->qformer_model.hparams.n_head;
+    const int d_head = hidden_size / n_head;
+    const size_t offset = (size_t) cross_index * 2 * hidden_size * sizeof(float);
+
+    K = ggml_view_4d(ctx0, inp, d_head, n_head, inp->ne[1], inp->ne[2], d_head * sizeof(float), inp->nb[1], inp->nb[2], offset);
+    V = ggml_view_4d(ctx0, inp, d_head, n_head, inp->ne[1], inp->ne[2], d_head * sizeof(float), inp->nb[1], inp->nb[2], offset + hidden_size * sizeof(float));
+}
+
+// Q-Former over the keys and values of a batch of images, starting from the query prefix
+static struct ggml_cgraph * blip2_qformer_build_graph(blip2_ctx * ctx, struct ggml_context * ctx0, ggml_allocr * allocr, int n_images, int n_image_tokens) {
+    const auto & model = ctx->qformer_model;
+    const int hidden_size = model.hparams.hidden_size;
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, BLIP2_MAX_NODES, false);
+
+    struct ggml_tensor * inp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, model.n_cross_layers * 2 * hidden_size, n_image_tokens, n_images);
+    ggml_set_name(inp, "inp_cross_kv");
+    ggml_allocr_alloc(allocr, inp);
+
+    // The same queries enter the first cross-attention for every image
+    struct ggml_tensor * cur = ggml_repeat(ctx0,
+        ggml_reshape_3d(ctx0, model.query_prefix, hidden_size, ctx->num_query_tokens, 1),
+        ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, ctx->num_query_tokens, n_images));
+
+    for (int il = model.first_cross_layer; il < (int) model.layers.size(); ++il) {
+        const auto & layer = model.layers[il];
+
+        if (il != model.first_cross_layer) {
+            cur = blip2_qformer_attn_block(ctx, ctx0, layer.self_attn, cur, cur);
+        }
+        if (layer.has_cross_attn) {
+            struct ggml_tensor * K;
+            struct ggml_tensor * V;
+            blip2_qformer_cross_kv(ctx, ctx0, inp, layer.cross_index, K, V);
+            cur = blip2_qformer_attn_kv_block(ctx, ctx0, layer.cross_attn, cur, K, V);
+        }
+        cur = blip2_qformer_ff_block(ctx, ctx0, layer, cur);
+    }
+
+    ggml_build_forward_expand(gf, cur);
+
+    return gf;
+}
+
+// The graphs are built for one number of image tokens, which changes with the vision settings
+static void blip2_qformer_check_graph(blip2_graph_cache & cache, const char * inp_name, int n_image_tokens) {
+    if (cache.gf && ggml_graph_get_tensor(cache.gf, inp_name)->ne[1] != n_image_tokens) {
+        cache.clear();
+    }
+}
+
+bool blip2_qformer_project_kv(blip2_ctx * ctx, const float * image_embd, int n_images, int n_image_tokens, int n_threads, blip2_qformer_kv * kv) {
+    if (!(ctx->towers & BLIP2_TOWER_QFORMER) || !ctx->qformer_model.cross_kv_w) {
+        fprintf(stderr, "%s: the Q-Former was not loaded\n", __func__);
+        return false;
+    }
+    if (n_images <= 0 || n_image_tokens <= 0) {
+        fprintf(stderr, "%s: invalid number of images %d or image tokens %d\n", __func__, n_images, n_image_tokens);
+        return false;
+    }
+
+    auto & cache = ctx->qformer_kv_graph;
+    blip2_qformer_check_graph(cache, "inp_image_embd", n_image_tokens);
+
+    auto build = [&](struct ggml_context * ctx0, ggml_allocr * allocr) {
+        return blip2_qformer_build_kv_graph(ctx, ctx0, allocr, n_images, n_image_tokens);
+    };
+    if (!blip2_graph_cache_prepare(cache, n_images, n_threads, build)) {
+        return false;
+    }
+
+    struct ggml_tensor * inp = ggml_graph_get_tensor(cache.gf, "inp_image_embd");
+    memcpy(inp->data, image_embd, ggml_nbytes(inp));
+
+    ggml_graph_compute(cache.gf, &cache.plan);
+
+    struct ggml_tensor * res = cache.gf->nodes[cache.gf->n_nodes - 1];
+    kv->n_images = n_images;
+    kv->n_image_tokens = n_image_tokens;
+    kv->data.resize(ggml_nelements(res));
+    memcpy(kv->data.data(), res->data, ggml_nbytes(res));
+
+    return true;
+}
+
+static bool blip2_qformer_check_kv(const blip2_ctx * ctx, const blip2_qformer_kv * kv, const char * func) {
+    const auto & model = ctx->qformer_model;
+    if (!(ctx->towers & BLIP2_TOWER_QFORMER)) {
+        fprintf(stderr, "%s: the Q-Former was not loaded\n", func);
+        return false;
+    }
+    if (kv->n_images <= 0 || kv->n_image_tokens <= 0 ||
+        kv->data.size() != (size_t) kv->n_images * kv->n_image_tokens * model.n_cross_layers * 2 * model.hparams.hidden_size) {
+        fprintf(stderr, "%s: the keys and values do not match the model\n", func);
+        return false;
+    }
+
+    return true;
+}
+
+bool blip2_qformer_encode_batch_kv(blip2_ctx * ctx, const blip2_qformer_kv * kv, int n_threads, float * out) {
+    if (!blip2_qformer_check_kv(ctx, kv, __func__)) {
+        return false;
+    }
+
+    auto & cache = ctx->qformer_graph;
+    blip2_qformer_check_graph(cache, "inp_cross_kv", kv->n_image_tokens);
+
+    auto build = [&](struct ggml_context * ctx0, ggml_allocr * allocr) {
+        return blip2_qformer_build_graph(ctx, ctx0, allocr, kv->n_images, kv->n_image_tokens);
+    };
+    if (!blip2_graph_cache_prepare(cache, kv->n_images, n_threads, build)) {
+        return false;
+    }
+
+    struct ggml_tensor * inp = ggml_graph_get_tensor(cache.gf, "inp_cross_kv");
+    memcpy(inp->data, kv->data.data(), ggml_nbytes(inp));
+
+    ggml_graph_compute(cache.gf, &cache.plan);
+
+    struct ggml_tensor * res = cache.gf->nodes[cache.gf->n_nodes - 1];
+    memcpy(out, res->data, ggml_nbytes(res));
+
+    return true;
+}
+
+bool blip2_qformer_encode_batch(blip2_ctx * ctx, const float * image_embd, int n_images, int n_image_tokens, int n_threads, float * out) {
+    return blip2_qformer_project_kv(ctx, image_embd, n_images, n_image_tokens, n_threads, &ctx->qformer_kv) &&
+           blip2_qformer_encode_batch_kv(ctx, &ctx->qformer_kv, n_threads, out);
+}
+
+// Word and position embeddings of n_batch texts of n_text tokens, [hidden_size, n_text, n_batch]
+static struct ggml_tensor * blip2_qformer_text_embd(blip2_ctx * ctx, struct ggml_context * ctx0, ggml_allocr * allocr, int n_text, int n_batch) {
+    const auto & model = ctx->qformer_model;
+
+    struct ggml_tensor * ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_text * n_batch);
+    ggml_set_name(ids, "inp_text_ids");
+    ggml_allocr_alloc(allocr, ids);
+
+    struct ggml_tensor * pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_text);
+    ggml_set_name(pos, "inp_text_pos");
+    ggml_allocr_alloc(allocr, pos);
+
+    struct ggml_tensor * cur = ggml_get_rows(ctx0, model.word_embd, ids);
+    cur = ggml_reshape_3d(ctx0, cur, model.hparams.hidden_size, n_text, n_batch);
+    cur = ggml_add(ctx0, cur, ggml_get_rows(ctx0, model.pos_embd, pos));
+
+    return blip2_qformer_embd_norm(ctx, ctx0, cur);
+}
+
+// Text alone through the Q-Former, the [CLS] token of every text comes out, [hidden_size, n_batch]
+static struct ggml_cgraph * blip2_qformer_build_text_graph(blip2_ctx * ctx, struct ggml_context * ctx0, ggml_allocr * allocr, int n_text, int n_batch) {
+    const auto & model = ctx->qformer_model;
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, BLIP2_MAX_NODES, false);
+
+    struct ggml_tensor * cur = blip2_qformer_text_embd(ctx, ctx0, allocr, n_text, n_batch);
+    for (const auto & layer : model.layers) {
+        cur = blip2_qformer_attn_block(ctx, ctx0, layer.self_attn, cur, cur);
+        cur = blip2_qformer_ff_text_block(ctx, ctx0, layer, cur);
+    }
+
+    cur = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, model.hparams.hidden_size, n_batch, cur->nb[2], 0));
+
+    ggml_build_forward_expand(gf, cur);
+
+    return gf;
+}
+
+// The queries and n_batch texts of n_text tokens through the Q-Former together, the queries attending to
+// the images of inp_cross_kv, a single one for all the texts or one per text. The queries come out.
+static struct ggml_cgraph * blip2_qformer_build_itm_graph(blip2_ctx * ctx, struct ggml_context * ctx0, ggml_allocr * allocr,
+                                                         int n_text, int n_batch, int n_image_tokens, int n_kv_batch) {
+    const auto & model = ctx->qformer_model;
+    const int hidden_size = model.hparams.hidden_size;
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, BLIP2_MAX_NODES, false);
+
+    struct ggml_tensor * inp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, model.n_cross_layers * 2 * hidden_size, n_image_tokens, n_kv_batch);
+    ggml_set_name(inp, "inp_cross_kv");
+    ggml_allocr_alloc(allocr, inp);
+
+    struct ggml_tensor * t = blip2_qformer_text_embd(ctx, ctx0, allocr, n_text, n_batch);
+
+    // The queries see the text from the first layer on, there is no prefix to start from
+    struct ggml_tensor * q = ggml_repeat(ctx0,
+        ggml_reshape_3d(ctx0, model.query_tokens, hidden_size, ctx->num_query_tokens, 1),
+        ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, ctx->num_query_tokens, n_batch));
+    q = blip2_qformer_embd_norm(ctx, ctx0, q);
+
+    for (const auto & layer : model.layers) {
+        blip2_qformer_joint_attn_block(ctx, ctx0, layer.self_attn, q, t);
+        if (layer.has_cross_attn) {
+            struct ggml_tensor * K;
+            struct ggml_tensor * V;
+            blip2_qformer_cross_kv(ctx, ctx0, inp, layer.cross_index, K, V);
+            q = blip2_qformer_attn_kv_block(ctx, ctx0, layer.cross_attn, q, K, V);
+        }
+        q = blip2_qformer_ff_block(ctx, ctx0, layer, q);
+        t = blip2_qformer_ff_text_block(ctx, ctx0, layer, t);
+    }
+
+    // Only what the queries depend on is computed, the text of the last layer is not
+    ggml_build_forward_expand(gf, q);
+
+    return gf;
+}
+
+#define BLIP2_TEXT_MAX_BATCH 64
+
+static bool blip2_qformer_check_texts(const blip2_ctx * ctx, const std::vector<blip2_vocab_id> * texts, int n_texts, const char * func) {
+    const auto & model = ctx->qformer_model;
+    if (!(ctx->towers & BLIP2_TOWER_QFORMER) || !model.has_text) {
+        fprintf(stderr, "%s: the model has no Q-Former text side, convert a Blip2ForImageTextRetrieval checkpoint\n", func);
+        return false;
+    }
+
+    for (int i = 0; i < n_texts; ++i) {
+        if (texts[i].empty() || (int64_t) texts[i].size() > model.pos_embd->ne[1]) {
+            fprintf(stderr, "%s: text %d has %zu tokens, expected 1 to %d\n", func, i, texts[i].size(), (int) model.pos_embd->ne[1]);
+            return false;
+        }
+        for (blip2_vocab_id id : texts[i]) {
+            if (id < 0 || id >= model.word_embd->ne[1]) {
+                fprintf(stderr, "%s: text %d has the invalid token id %d\n", func, i, id);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Indices of the texts in batches of texts of the same length, so that none is padded
+static std::vector<std::vector<int>> blip2_text_batches(const std::vector<blip2_vocab_id> * texts, int n_texts, int max_batch) {
+    std::vector<int> order(n_texts);
+    for (int i = 0; i < n_texts; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int i, int j) { return texts[i].size() < texts[j].size(); });
+
+    std::vector<std::vector<int>> batches;
+    for (int i : order) {
+        if (batches.empty() || (int) batches.back().size() == max_batch || texts[batches.back()[0]].size() != texts[i].size()) {
+            batches.emplace_back();
+        }
+        batches.back().push_back(i);
+    }
+
+    return batches;
+}
+
+// Token ids and positions of the texts idx[0..n_batch) for a graph of blip2_qformer_text_embd
+static void blip2_qformer_set_texts(struct ggml_cgraph * gf, const std::vector<blip2_vocab_id> * texts, const int * idx, int n_batch) {
+    struct ggml_tensor * ids = ggml_graph_get_tensor(gf, "inp_text_ids");
+    struct ggml_tensor * pos = ggml_graph_get_tensor(gf, "inp_text_pos");
+    const int n_text = pos->ne[0];
+
+    for (int b = 0; b < n_batch; ++b) {
+        memcpy((int32_t *) ids->data + b * n_text, texts[idx[b]].data(), n_text * sizeof(int32_t));
+    }
+    for (int i = 0; i < n_text; ++i) {
+        ((int32_t *) pos->data)[i] = i;
+    }
+}
+
+// y = w*x + b with the F32 head w of shape [n_in, n_out], L2 normalized if normalize
+static void blip2_qformer_head(const struct ggml_tensor * w, const struct ggml_tensor * b, const float * x, float * y, bool normalize) {
+    const int n_in = w->ne[0];
+    const int n_out = w->ne[1];
+
+    float sum = 0.0f;
+    for (int i = 0; i < n_out; ++i) {
+        y[i] = blip2_vec_dot_f32((const float *) w->data + (size_t) i * n_in, x, n_in) + ((const float *) b->data)[i];
+        sum += y[i] * y[i];
+    }
+    if (normalize) {
+        const float scale = 1.0f / std::max(sqrtf(sum), 1e-12f);
+        for (int i = 0; i < n_out; ++i) {
+            y[i] *= scale;
+        }
+    }
+}
+
+bool blip2_itc_image_features(blip2_ctx * ctx, const blip2_qformer_kv * kv, int n_threads, float * feats) {
+    const auto & model = ctx->qformer_model;
+    if (!blip2_qformer_check_texts(ctx, NULL, 0, __func__) || !blip2_qformer_check_kv(ctx, kv, __func__)) {
+        return false;
+    }
+
+    const int n_rows = kv->n_images * ctx->num_query_tokens;
+    std::vector<float> out((size_t) n_rows * model.hparams.hidden_size);
+    if (!blip2_qformer_encode_batch_kv(ctx, kv, n_threads, out.data())) {
+        return false;
+    }
+
+    for (int r = 0; r < n_rows; ++r) {
+        blip2_qformer_head(model.vision_proj_w, model.vision_proj_b, out.data() + (size_t) r * model.hparams.hidden_size, feats + (size_t) r * model.proj_dim, true);
+    }
+
+    return true;
+}
+
+bool blip2_itc_text_features(blip2_ctx * ctx, const std::vector<blip2_vocab_id> * texts, int n_texts, int n_threads, float * feats) {
+    const auto & model = ctx->qformer_model;
+    if (!blip2_qformer_check_texts(ctx, texts, n_texts, __func__)) {
+        return false;
+    }
+
+    for (const auto & batch : blip2_text_batches(texts, n_texts, BLIP2_TEXT_MAX_BATCH)) {
+        const int n_text = texts[batch[0]].size();
+        const int n_batch = batch.size();
+
+        // One graph per text length and batch size, so that calls with texts of a few lengths do not rebuild them
+        auto & cache = ctx->qformer_text_graph.get({n_text, n_batch});
+        auto build = [&](struct ggml_context * ctx0, ggml_allocr * allocr) {
+            return blip2_qformer_build_text_graph(ctx, ctx0, allocr, n_text, n_batch);
+        };
+        if (!blip2_graph_cache_prepare(cache, n_batch, n_threads, build)) {
+            return false;
+        }
+
+        blip2_qformer_set_texts(cache.gf, texts, batch.data(), n_batch);
+        ggml_graph_compute(cache.gf, &cache.plan);
+
+        const float * cls = (const float *) cache.gf->nodes[cache.gf->n_nodes - 1]->data;
+        for (int b = 0; b < n_batch; ++b) {
+            blip2_qformer_head(model.text_proj_w, model.text_proj_b, cls + (size_t) b * model.hparams.hidden_size, feats + (size_t) batch[b] * model.proj_dim, true);
+        }
+    }
+
+    return true;
+}
+
+void blip2_itc_scores(const blip2_ctx * ctx, const float * image_feats, int n_images, const float * text_feats, int n_texts, float * scores) {
+    const int n_query = ctx->num_query_tokens;
+    const int proj_dim = ctx->qformer_model.proj_dim;
+
+    for (int i = 0; i < n_images; ++i) {
+        for (int t = 0; t < n_texts; ++t) {
+            float best = -INFINITY;
+            for (int q = 0; q < n_query; ++q) {
+                best = std::max(best, blip2_vec_dot_f32(image_feats + ((size_t) i * n_query + q) * proj_dim, text_feats + (size_t) t * proj_dim, proj_dim));
+            }
+            scores[(size_t) i * n_texts + t] = best;
+        }
+    }
+}
+
+// Matching probabilities of the texts idx[0..n_batch), all of the same length, with the images of kv_data,
+// a single one for all the texts (n_kv_batch = 1) or one per text (n_kv_batch = n_batch)
+static bool blip2_itm_run(blip2_ctx * ctx, const std::vector<blip2_vocab_id> * texts, const int * idx, int n_batch,
+                          const float * kv_data, int n_image_tokens, int n_kv_batch, int n_threads, float * probs) {
+    const auto & model = ctx->qformer_model;
+    const int hidden_size = model.hparams.hidden_size;
+    const int n_text = texts[idx[0]].size();
+
+    // A graph is built for one text length, batch size and number of images, the cache holds a few of them
+    auto & cache = ctx->qformer_itm_graph.get({n_text, n_batch, n_image_tokens, n_kv_batch});
+    auto build = [&](struct ggml_context * ctx0, ggml_allocr * allocr) {
+        return blip2_qformer_build_itm_graph(ctx, ctx0, allocr, n_text, n_batch, n_image_tokens, n_kv_batch);
+    };
+    if (!blip2_graph_cache_prepare(cache, n_batch, n_threads, build)) {
+        return false;
+    }
+
+    struct ggml_tensor * inp = ggml_graph_get_tensor(cache.gf, "inp_cross_kv");
+    memcpy(inp->data, kv_data, ggml_nbytes(inp));
+    blip2_qformer_set_texts(cache.gf, texts, idx, n_batch);
+
+    ggml_graph_compute(cache.gf, &cache.plan);
+
+    // The head is linear, so its mean over the queries is the head of their mean
+    const int n_query = ctx->num_query_tokens;
+    const float * q = (const float *) cache.gf->nodes[cache.gf->n_nodes - 1]->data;
+    std::vector<float> mean(hidden_size);
+    for (int b = 0; b < n_batch; ++b) {
+        std::fill(mean.begin(), mean.end(), 0.0f);
+        for (int i = 0; i < n_query; ++i) {
+            blip2_vec_mad_f32(mean.data(), q + ((size_t) b * n_query + i) * hidden_size, 1.0f / n_query, hidden_size);
+        }
+
+        float logits[2];
+        blip2_qformer_head(model.itm_w, model.itm_b, mean.data(), logits, false);
+        probs[b] = 1.0f / (1.0f + expf(logits[0] - logits[1]));
+    }
+
+    return true;
+}
+
+bool blip2_itm_scores(blip2_ctx * ctx, const blip2_qformer_kv * kv, const std::vector<blip2_vocab_id> * texts, int n_texts, int n_threads, float * scores) {
+    if (!blip2_qformer_check_texts(ctx, texts, n_texts, __func__) || !blip2_qformer_check_kv(ctx, kv, __func__)) {
+        return false;
+    }
+
+    const size_t kv_size = kv->data.size() / kv->n_images;
+    std::vector<float> probs(BLIP2_TEXT_MAX_BATCH);
+
+    if (n_texts >= kv->n_images) {
+        // Texts batched by length against one image at a time, whose keys and values all the texts share
+        // Every image goes through the graph of a batch before the next one, which has another shape
+        const auto batches = blip2_text_batches(texts, n_texts, BLIP2_TEXT_MAX_BATCH);
+        for (const auto & batch : batches) {
+            for (int i = 0; i < kv->n_images; ++i) {
+                if (!blip2_itm_run(ctx, texts, batch.data(), batch.size(), kv->data.data() + i * kv_size, kv->n_image_tokens, 1, n_threads, probs.data())) {
+                    return false;
+                }
+                for (size_t b = 0; b < batch.size(); ++b) {
+                    scores[(size_t) i * n_texts + batch[b]] = probs[b];
+                }
+            }
+        }
+    } else {
+        // Images batched against one text at a time
+        for (int t = 0; t < n_texts; ++t) {
+            const std::vector<int> idx(BLIP2_TEXT_MAX_BATCH, t);
+            for (int i0 = 0; i0 < kv->n_images; i0 += BLIP2_TEXT_MAX_BATCH) {
+                const int n_batch = std::min(BLIP2_TEXT_MAX_BATCH, kv->n_images - i0);
+                if (!blip2_itm_run(ctx, texts, idx.data(), n_batch, kv->data.data() + i0 * kv_size, kv->n_image_tokens, n_batch, n_threads, probs.data())) {
+                    return false;
+                }
+                for (int b = 0; b < n_batch; ++b) {
+                    scores[(size_t) (i0 + b) * n_texts + t] = probs[b];
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+bool blip2_tokenize_wordpiece(const blip2_vocab & vocab, const std::string & text, std::vector<blip2_vocab_id> & ids) {
+    auto find = [&](const std::string & token) {
+        const auto it = vocab.token_to_id.find(token);
+        return it == vocab.token_to_id.end() ? -1 : it->second;
+    };
+
+    const blip2_vocab_id cls = find("[CLS]");
+    const blip2_vocab_id sep = find("[SEP]");
+    const blip2_vocab_id unk = find("[UNK]");
+    if (cls < 0 || sep < 0 || unk < 0) {
+        fprintf(stderr, "%s: the vocabulary is not a WordPiece one\n", __func__);
+        return false;
+    }
+
+    // Words are runs of anything but whitespace and punctuation, each punctuation character is a word of its own
+    std::vector<std::string> words;
+    std::string word;
+    for (unsigned char c : text) {
+        if (isspace(c) || ispunct(c)) {
+            if (!word.empty()) {
+                words.push_back(word);
+                word.clear();
+            }
+            if (ispunct(c)) {
+                words.push_back(std::string(1, c));
+            }
+        } else {
+            word += (c >= 'A' && c <= 'Z') ? (char) (c - 'A' + 'a') : (char) c;
+        }
+    }
+    if (!word.empty()) {
+        words.push_back(word);
+    }
+
+    ids.clear();
+    ids.push_back(cls);
+
+    // Longest pieces first, a word any part of which is not in the vocabulary is unknown as a whole
+    std::vector<blip2_vocab_id> pieces;
+    for (const auto & w : words) {
+        pieces.clear();
+        size_t start = 0;
+        while (w.size() <= 100 && start < w.size()) {
+            blip2_vocab_id id = -1;
+            size_t end = w.size();
+            for (; end > start; --end) {
+                id = find((start > 0 ? "##" : "") + w.substr(start, end - start));
+                if (id >= 0) {
+                    break;
+                }
+            }
+            if (id < 0) {
+                break;
+            }
+            pieces.push_back(id);
+            start = end;
+        }
+
+        if (start == w.size()) {
+            ids.insert(ids.end(), pieces.begin(), pieces.end());
+        } else {
+            ids.push_back(unk);
+        }
+    }
+
+    ids.push_back(sep);
+
+    return true;
+}
+
+// Language model
+
+// Offset of the row of position pos of layer il in the keys or the values of the cache
+static size_t blip2_kv_row_offset(const blip2_kv_cache & kv, int il, int pos) {
+    return ((size_t) il * kv.n_ctx + pos) * kv.row_size;
+}
+
+// Blocks of the q8_0 and q4_0 types of ggml: 32 values and their scale. In q4_0 the low nibble of byte k
+// holds value k and the high nibble value k + 16, stored with an offset of 8.
+#define BLIP2_KV_QK 32
+
+struct blip2_kv_block_q8_0 {
+    ggml_fp16_t d;
+    int8_t qs[BLIP2_KV_QK];
+};
+
+struct blip2_kv_block_q4_0 {
+    ggml_fp16_t d;
+    uint8_t qs[BLIP2_KV_QK / 2];
+};
+
+static_assert(sizeof(blip2_kv_block_q8_0) == sizeof(ggml_fp16_t) + BLIP2_KV_QK, "unexpected q8_0 block size");
+static_assert(sizeof(blip2_kv_block_q4_0) == sizeof(ggml_fp16_t) + BLIP2_KV_QK / 2, "unexpected q4_0 block size");
+
+// Values k0 .. k1 of a quantized block into out, without the scale of the block, which is returned
+static inline float blip2_kv_unpack(enum ggml_type type, const uint8_t * block, int k0, int k1, float * out) {
+    if (type == GGML_TYPE_Q8_0) {
+        const blip2_kv_block_q8_0 * b = (const blip2_kv_block_q8_0 *) block;
+        for (int k = k0; k < k1; ++k) {
+            out[k - k0] = b->qs[k];
+        }
+        return ggml_fp16_to_fp32(b->d);
+    }
+
+    const blip2_kv_block_q4_0 * b = (const blip2_kv_block_q4_0 *) block;
+    const int half = BLIP2_KV_QK / 2;
+    int k = k0;
+    for (; k < std::min(k1, half); ++k) {
+        out[k - k0] = (b->qs[k] & 0x0f) - 8;
+    }
+    for (; k < k1; ++k) {
+        out[k - k0] = (b->qs[k - half] >> 4) - 8;
+    }
+    return ggml_fp16_to_fp32(b->d);
+}
+
+// Dot product of x with the values i0 .. i0 + n of a quantized row, a block at a time, so that a head
+// need not start or end on a block boundary
+static float blip2_kv_dot_q(enum ggml_type type, const uint8_t * row, const float * x, int i0, int n) {
+    const size_t block_size = ggml_type_size(type);
+    float tmp[BLIP2_KV_QK];
+    float sum = 0.0f;
+    for (int i = i0; i < i0 + n; ) {
+        const int k0 = i % BLIP2_KV_QK;
+        const int k1 = std::min(BLIP2_KV_QK, k0 + i0 + n - i);
+        const float d = blip2_kv_unpack(type, row + (i / BLIP2_KV_QK)*block_size, k0, k1, tmp);
+        sum += d * blip2_vec_dot_f32(tmp, x + i - i0, k1 - k0);
+        i += k1 - k0;
+    }
+
+    return sum;
+}
+
+// y += a*x for the values i0 .. i0 + n of a quantized row x
+static void blip2_kv_mad_q(enum ggml_type type, float * y, const uint8_t * row, float a, int i0, int n) {
+    const size_t block_size = ggml_type_size(type);
+    float tmp[BLIP2_KV_QK];
+    for (int i = i0; i < i0 + n; ) {
+        const int k0 = i % BLIP2_KV_QK;
+        const int k1 = std::min(BLIP2_KV_QK, k0 + i0 + n - i);
+        const float d = blip2_kv_unpack(type, row + (i / BLIP2_KV_QK)*block_size, k0, k1, tmp);
+        blip2_vec_mad_f32(y + i - i0, tmp, a*d, k1 - k0);
+        i += k1 - k0;
+    }
+}
+
+// Write the keys and values of the new tokens, [d_head, n_head, n_tokens], to the cache from position n_past
+// dst is only there to order the op before the attention reading the cache
+static void blip2_kv_store(struct ggml_tensor * dst, const struct ggml_tensor * k, const struct ggml_tensor * v, int ith, int nth, void * userdata) {
+    const blip2_kv_layer * layer = (const blip2_kv_layer *) userdata;
+    blip2_kv_cache & kv = *layer->kv;
+
+    const int n_embd = k->ne[0] * k->ne[1];
+    const int n_tokens = k->ne[2];
+
+    GGML_ASSERT(k->type == GGML_TYPE_F32 && v->type == GGML_TYPE_F32 && k->ne[0] == kv.d_head);
+    GGML_ASSERT(ggml_is_contiguous(k) && ggml_is_contiguous(v));
+    GGML_ASSERT(kv.n_past + n_tokens <= kv.n_ctx);
+
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(kv.type);
+
+    // A row is quantized as a whole, one task per token and tensor
+    for (int task = ith; task < 2 * n_tokens; task += nth) {
+        const int i = task / 2;
+        const struct ggml_tensor * src = task % 2 == 0 ? k : v;
+        const float * row = (const float *) ((const char *) src->data + i*src->nb[2]);
+        uint8_t * cache = (task % 2 == 0 ? kv.k : kv.v).data() + blip2_kv_row_offset(kv, layer->il, kv.n_past + i);
+
+        if (kv.type == GGML_TYPE_F32) {
+            memcpy(cache, row, kv.row_size);
+        } else {
+            traits.from_float(row, cache, n_embd);
+        }
+    }
+
+    (void) dst;
+}
+
+// Causal attention of the new tokens q, [d_head, n_head, n_tokens], over the cache of one layer: token i
+// is at position n_past + i and sees the positions up to its own. The keys and values are read as they
+// are stored, quantized rows are dequantized inside the dot products and the weighted sums of values.
+static void blip2_kv_attn(struct ggml_tensor * dst, const struct ggml_tensor * q, const struct ggml_tensor * dep, int ith, int nth, void * userdata) {
+    const blip2_kv_layer * layer = (const blip2_kv_layer *) userdata;
+    const blip2_kv_cache & kv = *layer->kv;
+
+    const int d_head = q->ne[0];
+    const int n_head = q->ne[1];
+    const int n_tokens = q->ne[2];
+
+    GGML_ASSERT(q->type == GGML_TYPE_F32 && q->nb[0] == sizeof(float) && d_head == kv.d_head);
+    GGML_ASSERT(d_head <= BLIP2_ATTN_MAX_D_HEAD);
+
+    const float scale = 1.0f / sqrtf((float) d_head);
+    const size_t es = kv.type == GGML_TYPE_F32 ? sizeof(float) : sizeof(ggml_fp16_t);
+
+    std::vector<float> S(kv.n_past + n_tokens);
+    ggml_fp16_t q_f16[BLIP2_ATTN_MAX_D_HEAD];
+    float O[BLIP2_ATTN_MAX_D_HEAD];
+    float V[BLIP2_ATTN_MAX_D_HEAD];
+
+    for (int task = ith; task < n_head * n_tokens; task += nth) {
+        const int h = task % n_head;
+        const int i = task / n_head;
+        const int n_kv = kv.n_past + i + 1;
+        const int i0 = h * d_head;
+
+        const float * qi = (const float *) ((const char *) q->data + h*q->nb[1] + i*q->nb[2]);
+        const uint8_t * k_rows = kv.k.data() + blip2_kv_row_offset(kv, layer->il, 0);
+        const uint8_t * v_rows = kv.v.data() + blip2_kv_row_offset(kv, layer->il, 0);
+
+        if (kv.type == GGML_TYPE_F16) {
+            ggml_fp32_to_fp16_row(qi, q_f16, d_head);
+        }
+
+        float m = -INFINITY;
+        for (int j = 0; j < n_kv; j++) {
+            const uint8_t * kj = k_rows + j*kv.row_size;
+            switch (kv.type) {
+                case GGML_TYPE_F32:
+                    S[j] = blip2_vec_dot_f32(qi, (const float *) kj + i0, d_head);
+                    break;
+                case GGML_TYPE_F16:
+                    ggml_internal_get_type_traits(GGML_TYPE_F16).vec_dot(d_head, &S[j], kj + i0*es, q_f16);
+                    break;
+                default:
+                    S[j] = blip2_kv_dot_q(kv.type, kj, qi, i0, d_head);
+                    break;
+            }
+            S[j] *= scale;
+            m = std::max(m, S[j]);
+        }
+
+        float sum = 0.0f;
+        for (int j = 0; j < n_kv; j++) {
+            S[j] = expf(S[j] - m);
+            sum += S[j];
+        }
+
+        memset(O, 0, d_head*sizeof(float));
+        for (int j = 0; j < n_kv; j++) {
+            const uint8_t * vj = v_rows + j*kv.row_size;
+            switch (kv.type) {
+                case GGML_TYPE_F32:
+                    blip2_vec_mad_f32(O, (const float *) vj + i0, S[j], d_head);
+                    break;
+                case GGML_TYPE_F16:
+                    ggml_fp16_to_fp32_row((const ggml_fp16_t *) (vj + i0*es), V, d_head);
+                    blip2_vec_mad_f32(O, V, S[j], d_head);
+                    break;
+                default:
+                    blip2_kv_mad_q(kv.type, O, vj, S[j], i0, d_head);
+                    break;
+            }
+        }
+
+        float * out = (float *) ((char *) dst->data + h*dst->nb[1] + i*dst->nb[2]);
+        const float inv = 1.0f / sum;
+        for (int d = 0; d < d_head; d++) {
+            out[d] = O[d] * inv;
+        }
+    }
+
+    (void) dep;
+}
+
+// The decoder over n_query rows of Q-Former output followed by n_tokens tokens, from position kv.n_past
+// of the session. Positions only enter through inp_pos and the cache ops, so the graph of one shape
+// serves every position. The logits of the last token come out.
+static struct ggml_cgraph * blip2_text_build_graph(const blip2_ctx * ctx, blip2_text_session * session, struct ggml_context * ctx0, ggml_allocr * allocr, int n_query, int n_tokens) {
+    const auto & model = ctx->text_model;
+    const auto & hparams = model.hparams;
+    const int hidden_size = hparams.hidden_size;
+    const int n_head = hparams.n_head;
+    const int d_head = hidden_size / n_head;
+    const int n_total = n_query + n_tokens;
+
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, BLIP2_MAX_NODES, false);
+
+    struct ggml_tensor * ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(ids, "inp_tokens");
+    ggml_allocr_alloc(allocr, ids);
+
+    struct ggml_tensor * pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_total);
+    ggml_set_name(pos, "inp_pos");
+    ggml_allocr_alloc(allocr, pos);
+
+    struct ggml_tensor * cur = ggml_get_rows(ctx0, model.tok_embd, ids);
+    if (n_query > 0) {
+        struct ggml_tensor * query = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, model.proj_w->ne[0], n_query);
+        ggml_set_name(query, "inp_query_embd");
+        ggml_allocr_alloc(allocr, query);
+
+        // The projected queries go before the prompt, ggml_concat joins along the third dimension
+        query = ggml_add(ctx0, ggml_mul_mat(ctx0, model.proj_w, query), model.proj_b);
+        cur = ggml_concat(ctx0, ggml_reshape_3d(ctx0, query, hidden_size, 1, n_query), ggml_reshape_3d(ctx0, cur, hidden_size, 1, n_tokens));
+        cur = ggml_reshape_2d(ctx0, cur, hidden_size, n_total);
+    }
+    cur = ggml_add(ctx0, cur, ggml_get_rows(ctx0, model.pos_embd, pos));
+
+    for (int il = 0; il < hparams.n_layer; ++il) {
+        const auto & layer = model.layers[il];
+        void * userdata = &session->layers[il];
+
+        struct ggml_tensor * residual = cur;
+        cur = blip2_layer_norm(ctx0, cur, layer.ln_1_w, layer.ln_1_b, hparams.eps);
+
+        struct ggml_tensor * Q = ggml_add(ctx0, ggml_mul_mat(ctx0, layer.q_w, cur), layer.q_b);
+        struct ggml_tensor * K = ggml_add(ctx0, ggml_mul_mat(ctx0, layer.k_w, cur), layer.k_b);
+        struct ggml_tensor * V = ggml_add(ctx0, ggml_mul_mat(ctx0, layer.v_w, cur), layer.v_b);
+        Q = ggml_reshape_3d(ctx0, Q, d_head, n_head, n_total);
+        K = ggml_reshape_3d(ctx0, K, d_head, n_head, n_total);
+        V = ggml_reshape_3d(ctx0, V, d_head, n_head, n_total);
+
+        struct ggml_tensor * stored = ggml_map_custom2(ctx0, K, V, blip2_kv_store, GGML_N_TASKS_MAX, userdata);
+        cur = ggml_map_custom2(ctx0, Q, stored, blip2_kv_attn, GGML_N_TASKS_MAX, userdata);
+        cur = ggml_reshape_2d(ctx0, cur, hidden_size, n_total);
+
+        cur = ggml_add(ctx0, ggml_mul_mat(ctx0, layer.o_w, cur), layer.o_b);
+        cur = ggml_add(ctx0, cur, residual);
+
+        residual = cur;
+        cur = blip2_layer_norm(ctx0, cur, layer.ln_2_w, layer.ln_2_b, hparams.eps);
+        cur = ggml_add(ctx0, ggml_mul_mat(ctx0, layer.ff_1_w, cur), layer.ff_1_b);
+        cur = ggml_relu_inplace(ctx0, cur);
+        cur = ggml_add(ctx0, ggml_mul_mat(ctx0, layer.ff_2_w, cur), layer.ff_2_b);
+        cur = ggml_add(ctx0, cur, residual);
+    }
+
+    // Only the last token is sampled from
+    cur = ggml_view_2d(ctx0, cur, hidden_size, 1, cur->nb[1], (n_total - 1)*cur->nb[1]);
+    cur = blip2_layer_norm(ctx0, cur, model.ln_f_w, model.ln_f_b, hparams.eps);
+    cur = ggml_mul_mat(ctx0, model.lm_head, cur);
+
+    ggml_build_forward_expand(gf, cur);
+
+    return gf;
+}
+
+bool blip2_text_session_init(const blip2_ctx * ctx, blip2_text_session * session, int n_ctx, enum ggml_type kv_type) {
+    const auto & hparams = ctx->text_model.hparams;
+    if (ctx->text_model.layers.empty()) {
+        fprintf(stderr, "%s: the language model was not loaded\n", __func__);
+        return false;
+    }
+    if (kv_type != GGML_TYPE_F32 && kv_type != GGML_TYPE_F16 && kv_type != GGML_TYPE_Q8_0 && kv_type != GGML_TYPE_Q4_0) {
+        fprintf(stderr, "%s: unsupported KV cache type %s\n", __func__, ggml_type_name(kv_type));
+        return false;
+    }
+    if (hparams.hidden_size % ggml_blck_size(kv_type) != 0) {
+        fprintf(stderr, "%s: a hidden size of %d is not a multiple of the %s block size\n", __func__, hparams.hidden_size, ggml_type_name(kv_type));
+        return false;
+    }
+    if (n_ctx <= 0 || n_ctx > hparams.n_ctx) {
+        n_ctx = hparams.n_ctx;
+    }
+
+    auto & kv = session->kv;
+    kv.type = kv_type;
+    kv.n_ctx = n_ctx;
+    kv.n_layer = hparams.n_layer;
+    kv.n_head = hparams.n_head;
+    kv.d_head = hparams.hidden_size / hparams.n_head;
+    kv.row_size = ggml_row_size(kv_type, hparams.hidden_size);
+    kv.k.resize(kv.row_size * kv.n_layer * kv.n_ctx);
+    kv.v.resize(kv.row_size * kv.n_layer * kv.n_ctx);
+    kv.n_past = 0;
+
+    session->layers.resize(hparams.n_layer);
+    for (int il = 0; il < hparams.n_layer; ++il) {
+        session->layers[il] = { &session->kv, il };
+    }
+
+    // The graphs of a previous cache point to its layout
+    session->prefill_graph.clear();
+    session->decode_graph.clear();
+    session->logits.assign(hparams.n_vocab, 0.0f);
+
+    return true;
+}
+
+// Evaluate n_query rows of Q-Former output and n_tokens tokens after the cache content with the graph of cache
+static bool blip2_text_eval(const blip2_ctx * ctx, blip2_text_session * session, blip2_graph_cache & cache, const float * query_embd, int n_query,
+                            const blip2_vocab_id * tokens, int n_tokens, int n_threads, const char * func) {
+    auto & kv = session->kv;
+    if (kv.n_ctx == 0 || session->layers.size() != ctx->text_model.layers.size() || kv.n_layer != ctx->text_model.hparams.n_layer) {
+        fprintf(stderr, "%s: the session was not initialized for this model\n", func);
+        return false;
+    }
+    if (n_query < 0 || n_tokens <= 0) {
+        fprintf(stderr, "%s: invalid number of queries %d or tokens %d\n", func, n_query, n_tokens);
+        return false;
+    }
+    if (kv.n_past + n_query + n_tokens > kv.n_ctx) {
+        fprintf(stderr, "%s: %d more positions do not fit in the context, %d of %d used\n", func, n_query + n_tokens, kv.n_past, kv.n_ctx);
+        return false;
+    }
+    for (int i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= ctx->text_model.hparams.n_vocab) {
+            fprintf(stderr, "%s: invalid token id %d\n", func, tokens[i]);
+            return false;
+        }
+    }
+
+    // The graph is kept for one split between queries and tokens
+    if (cache.gf && ggml_graph_get_tensor(cache.gf, "inp_tokens")->ne[0] != n_tokens) {
+        cache.clear();
+    }
+
+    auto build = [&](struct ggml_context * ctx0, ggml_allocr * allocr) {
+        return blip2_text_build_graph(ctx, session, ctx0, allocr, n_query, n_tokens);
+    };
+    if (!blip2_graph_cache_prepare(cache, n_query + n_tokens, n_threads, build)) {
+        return false;
+    }
+
+    struct ggml_tensor * ids = ggml_graph_get_tensor(cache.gf, "inp_tokens");
+    memcpy(ids->data, tokens, n_tokens * sizeof(int32_t));
+
+    struct ggml_tensor * pos = ggml_graph_get_tensor(cache.gf, "inp_pos");
+    for (int i = 0; i < n_query + n_tokens; ++i) {
+        ((int32_t *) pos->data)[i] = kv.n_past + i + BLIP2_TEXT_POS_OFFSET;
+    }
+
+    if (n_query > 0) {
+        struct ggml_tensor * query = ggml_graph_get_tensor(cache.gf, "inp_query_embd");
+        memcpy(query->data, query_embd, ggml_nbytes(query));
+    }
+
+    ggml_graph_compute(cache.gf, &cache.plan);
+
+    struct ggml_tensor * res = cache.gf->nodes[cache.gf->n_nodes - 1];
+    session->logits.resize(ggml_nelements(res));
+    memcpy(session->logits.data(), res->data, ggml_nbytes(res));
+
+    kv.n_past += n_query + n_tokens;
+
+    return true;
+}
+
+bool blip2_text_prefill(const blip2_ctx * ctx, blip2_text_session * session, const float * query_embd, int n_query,
+                        const blip2_vocab_id * prompt, int n_prompt, int n_threads) {
+    return blip2_text_eval(ctx, session, session->prefill_graph, query_embd, n_query, prompt, n_prompt, n_threads, __func__);
+}
+
+bool blip2_text_decode(const blip2_ctx * ctx, blip2_text_session * session, blip2_vocab_id token, int n_threads) {
+    return blip2_text_eval(ctx, session, session->decode_graph, NULL, 0, &token, 1, n_threads, __func__);
+}
+
+bool blip2_text_generate(const blip2_ctx * ctx, blip2_text_session * session, int max_tokens, blip2_vocab_id eos, int n_threads,
+                         std::vector<blip2_vocab_id> & tokens) {
+    for (int n = 0; n < max_tokens; ++n) {
+        const auto & logits = session->logits;
+        const blip2_vocab_id id = std::max_element(logits.begin(), logits.end()) - logits.begin();
+        if (id == eos) {
+            break;
+        }
+        tokens.push_back(id);
+
+        if (n + 1 == max_tokens || session->kv.n_past == session->kv.n_ctx) {
+            break;
+        }
+        if (!blip2_text_decode(ctx, session, id, n_threads)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::string blip2_detokenize_bpe(const blip2_vocab & vocab, const blip2_vocab_id * tokens, int n_tokens) {
+    // Inverse of the byte to character map of GPT-2: printable bytes stand for themselves,
+    // the others for the characters from U+0100 on, in order
+    int byte_of[256 + 68];
+    std::fill(byte_of, byte_of + 256 + 68, -1);
+    int n_shifted = 0;
+    for (int b = 0; b < 256; ++b) {
+        const bool printable = (b >= 33 && b <= 126) || (b >= 161 && b <= 172) || b >= 174;
+        byte_of[printable ? b : 256 + n_shifted++] = b;
+    }
+
+    std::string text;
+    for (int t = 0; t < n_tokens; ++t) {
+        const auto it = vocab.id_to_token.find(tokens[t]);
+        if (it == vocab.id_to_token.end()) {
+            continue;
+        }
+
+        const std::string & token = it->second;
+        for (size_t i = 0; i < token.size(); ) {
+            const uint8_t c = token[i];
+            const int len = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+            int cp = len == 1 ? c : c & (0x3f >> (len - 1));
+            for (int j = 1; j < len && i + j < token.size(); ++j) {
+                cp = (cp << 6) | (token[i + j] & 0x3f);
+            }
+
+            if (cp < 256 + 68 && byte_of[cp] >= 0) {
+                text += (char) byte_of[cp];
+            } else {
+                text.append(token, i, len);
+            }
+            i += len;
+        }
+    }
+
+    return text;
+}
+
+static inline uint64_t blip2_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// xxHash64
+uint64_t blip2_hash64(const void * data, size_t len, uint64_t seed) {
+    const uint64_t P1 = 11400714785074694791ULL;
+    const uint64_t P2 = 14029467366897019727ULL;
+    const uint64_t P3 = 1609587929392839161ULL;
+    const uint64_t P4 = 9650029242287828579ULL;
+    const uint64_t P5 = 2870177450012600261ULL;
+
+    auto read64 = [](const uint8_t * p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; };
+    auto read32 = [](const uint8_t * p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; };
+    auto round = [&](uint64_t acc, uint64_t v) { return blip2_rotl64(acc + v*P2, 31)*P1; };
+    auto merge = [&](uint64_t acc, uint64_t v) { return (acc ^ round(0, v))*P1 + P4; };
+
+    const uint8_t * p = (const uint8_t *) data;
+    const uint8_t * end = p + len;
+
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2;
+        uint64_t v2 = seed + P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = blip2_rotl64(v1, 1) + blip2_rotl64(v2, 7) + blip2_rotl64(v3, 12) + blip2_rotl64(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h = blip2_rotl64(h ^ round(0, read64(p)), 27)*P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h = blip2_rotl64(h ^ (read32(p)*P1), 23)*P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h = blip2_rotl64(h ^ (*p*P5), 11)*P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint64_t blip2_image_key(const blip2_ctx * ctx, const image_u8 * img) {
+    const auto & model = ctx->vision_model;
+
+    // Everything the output depends on besides the pixels and the weights
+    const int32_t config[] = {
+        img->nx, img->ny, ctx->vision_image_size, (int32_t) model.layers.size(), ctx->tome_r, ctx->ftype, model.hparams.hidden_size,
+        ctx->fold_layer_norm, ctx->flash_attn,
+        (int32_t) gguf_get_n_tensors(ctx->ctx_gguf), (int32_t) gguf_get_data_offset(ctx->ctx_gguf),
+    };
+    uint64_t seed = blip2_hash64(config, sizeof(config), 0);
+    seed = blip2_hash64(ctx->image_mean, sizeof(ctx->image_mean), seed);
+    seed = blip2_hash64(ctx->image_std, sizeof(ctx->image_std), seed);
+
+    // A couple of small tensors stand for the weights, the first and the last ones that run. Both stay
+    // resident, unlike the layers when they are streamed.
+    if (model.pos_table) {
+        seed = blip2_hash64(model.pos_table->data, model.pos_table->nb[1], seed);
+    }
+    if (model.post_ln_b) {
+        seed = blip2_hash64(model.post_ln_b->data, ggml_nbytes(model.post_ln_b), seed);
+    }
+
+    return blip2_hash64(img->data, (size_t) 3*img->nx*img->ny, seed);
+}
+
+#define BLIP2_EMBD_CACHE_MAGIC 0x43453242u // "B2EC"
+#define BLIP2_EMBD_CACHE_VERSION 1
+#define BLIP2_EMBD_CACHE_ALIGN 64
+
+// The file header and every record header take a whole alignment unit, so that the data of each
+// record is aligned in the file and in its mapping
+struct blip2_embd_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t reserved[BLIP2_EMBD_CACHE_ALIGN - 8];
+};
+
+struct blip2_embd_record_header {
+    uint64_t key;
+    uint64_t n_floats;
+    uint32_t magic;
+    uint8_t reserved[BLIP2_EMBD_CACHE_ALIGN - 20];
+};
+
+static_assert(sizeof(blip2_embd_file_header) == BLIP2_EMBD_CACHE_ALIGN, "unexpected cache file header size");
+static_assert(sizeof(blip2_embd_record_header) == BLIP2_EMBD_CACHE_ALIGN, "unexpected cache record header size");
+
+static size_t blip2_embd_record_size(size_t n_floats) {
+    return sizeof(blip2_embd_record_header) + GGML_PAD(n_floats*sizeof(float), BLIP2_EMBD_CACHE_ALIGN);
+}
+
+bool blip2_embd_cache_open(blip2_embd_cache * cache, const char * fname, size_t max_mem_entries) {
+    cache->max_mem_entries = max_mem_entries;
+    if (!fname) {
+        return true;
+    }
+
+    if (!cache->file.open(fname, true)) {
+        return false;
+    }
+
+    size_t file_size = 0;
+    if (!cache->file.size(file_size)) {
+        fprintf(stderr, "%s: failed to stat '%s': %s\n", __func__, fname, strerror(errno));
+        return false;
+    }
+
+    if (file_size == 0) {
+        blip2_embd_file_header header = {};
+        header.magic = BLIP2_EMBD_CACHE_MAGIC;
+        header.version = BLIP2_EMBD_CACHE_VERSION;
+        if (!cache->file.write(&header, sizeof(header), 0)) {
+            fprintf(stderr, "%s: failed to write '%s': %s\n", __func__, fname, strerror(errno));
+            return false;
+        }
+        cache->file_size = sizeof(header);
+        return true;
+    }
+
+    // The records present now are read through a mapping of the file where files can be mapped
+#ifdef _POSIX_MAPPED_FILES
+    if (!cache->mapping.map(fname)) {
+        return false;
+    }
+#endif
+    auto read_at = [&](void * dst, size_t n_bytes, size_t offset) {
+        if (cache->mapping.addr) {
+            memcpy(dst, (const uint8_t *) cache->mapping.addr + offset, n_bytes);
+            return true;
+        }
+        return cache->file.read(dst, n_bytes, offset);
+    };
+    const size_t size = file_size;
+
+    blip2_embd_file_header header = {};
+    if (size < sizeof(header) || !read_at(&header, sizeof(header), 0) ||
+        header.magic != BLIP2_EMBD_CACHE_MAGIC || header.version != BLIP2_EMBD_CACHE_VERSION) {
+        fprintf(stderr, "%s: '%s' is not an embedding cache of version %d\n", __func__, fname, BLIP2_EMBD_CACHE_VERSION);
+        return false;
+    }
+
+    size_t offset = sizeof(header);
+    while (offset + sizeof(blip2_embd_record_header) <= size) {
+        blip2_embd_record_header rec;
+        if (!read_at(&rec, sizeof(rec), offset) || rec.magic != BLIP2_EMBD_CACHE_MAGIC ||
+            rec.n_floats > (size - offset) / sizeof(float) || offset + blip2_embd_record_size(rec.n_floats) > size) {
+            break;
+        }
+        cache->index[rec.key] = { offset + sizeof(rec), (size_t) rec.n_floats };
+        offset += blip2_embd_record_size(rec.n_floats);
+    }
+
+    // What follows the last complete record is the start of one that was never finished
+    if (offset < size) {
+        fprintf(stderr, "%s: dropping %zu bytes of an incomplete record at the end of '%s'\n", __func__, size - offset, fname);
+        if (!cache->file.truncate(offset)) {
+            fprintf(stderr, "%s: failed to truncate '%s': %s\n", __func__, fname, strerror(errno));
+            return false;
+        }
+    }
+    cache->file_size = offset;
+
+    return true;
+}
+
+// Keep an entry in memory as the most recently used one, evicting the least recently used ones
+static void blip2_embd_cache_remember(blip2_embd_cache * cache, uint64_t key, const float * src, size_t n_floats) {
+    if (cache->max_mem_entries == 0) {
+        return;
+    }
+
+    auto it = cache->mem.find(key);
+    if (it != cache->mem.end()) {
+        it->second.first.assign(src, src + n_floats);
+        cache->lru.splice(cache->lru.begin(), cache->lru, it->second.second);
+        return;
+    }
+
+    while (cache->mem.size() >= cache->max_mem_entries) {
+        cache->mem.erase(cache->lru.back());
+        cache->lru.pop_back();
+    }
+    cache->lru.push_front(key);
+    cache->mem.emplace(key, std::make_pair(std::vector<float>(src, src + n_floats), cache->lru.begin()));
+}
+
+bool blip2_embd_cache_get(blip2_embd_cache * cache, uint64_t key, float * dst, size_t n_floats) {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+
+    auto it = cache->mem.find(key);
+    if (it != cache->mem.end() && it->second.first.size() == n_floats) {
+        memcpy(dst, it->second.first.data(), n_floats*sizeof(float));
+        cache->lru.splice(cache->lru.begin(), cache->lru, it->second.second);
+        cache->n_hits_mem++;
+        return true;
+    }
+
+    auto jt = cache->index.find(key);
+    if (jt == cache->index.end() || jt->second.n_floats != n_floats) {
+        cache->n_misses++;
+        return false;
+    }
+
+    // Records appended since the file was opened are past the end of the mapping
+    const blip2_embd_record & rec = jt->second;
+    const size_t n_bytes = n_floats*sizeof(float);
+    if (rec.offset + n_bytes <= cache->mapping.size) {
+        memcpy(dst, (const uint8_t *) cache->mapping.addr + rec.offset, n_bytes);
+    } else if (!cache->file.read(dst, n_bytes, rec.offset)) {
+        fprintf(stderr, "%s: failed to read a record: %s\n", __func__, strerror(errno));
+        cache->n_misses++;
+        return false;
+    }
+
+    blip2_embd_cache_remember(cache, key, dst, n_floats);
+    cache->n_hits_file++;
+
+    return true;
+}
+
+bool blip2_embd_cache_put(blip2_embd_cache * cache, uint64_t key, const float * src, size_t n_floats) {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+
+    blip2_embd_cache_remember(cache, key, src, n_floats);
+
+    if (!cache->file.is_open()) {
+        return true;
+    }
+    auto it = cache->index.find(key);
+    if (it != cache->index.end() && it->second.n_floats == n_floats) {
+        return true;
+    }
+
+    // Written in one go, header first, so that a crash leaves at worst one incomplete record at the end
+    const size_t n_bytes = n_floats*sizeof(float);
+    std::vector<uint8_t> buf(blip2_embd_record_size(n_floats), 0);
+    blip2_embd_record_header rec = {};
+    rec.key = key;
+    rec.n_floats = n_floats;
+    rec.magic = BLIP2_EMBD_CACHE_MAGIC;
+    memcpy(buf.data(), &rec, sizeof(rec));
+    memcpy(buf.data() + sizeof(rec), src, n_bytes);
+
+    if (!cache->file.write(buf.data(), buf.size(), cache->file_size)) {
+        fprintf(stderr, "%s: failed to append a record: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    cache->index[key] = { cache->file_size + sizeof(rec), n_floats };
+    cache->file_size += buf.size();
+
+    return true;
+}
+
+bool blip2_vision_encode_batch_cached(blip2_ctx * ctx, blip2_embd_cache * cache, const image_u8 * imgs, int n_images, int n_threads, float * embd) {
+    if (n_images <= 0) {
+        fprintf(stderr, "%s: invalid number of images %d\n", __func__, n_images);
+        return false;
+    }
+
+    const size_t n_embd = (size_t) blip2_vision_n_output_tokens(ctx) * ctx->vision_model.hparams.hidden_size;
+
+    // Images missed by the cache, each one once however many times it appears in the batch
+    std::vector<uint64_t> keys(n_images);
+    std::map<uint64_t, int> missed;
+    std::vector<image_u8> batch;
+    for (int i = 0; i < n_images; ++i) {
+        keys[i] = blip2_image_key(ctx, &imgs[i]);
+        if (missed.count(keys[i]) || blip2_embd_cache_get(cache, keys[i], embd + i*n_embd, n_embd)) {
+            continue;
+        }
+        missed[keys[i]] = batch.size();
+        batch.push_back(imgs[i]);
+    }
+    if (batch.empty()) {
+        return true;
+    }
+
+    std::vector<float> out(batch.size()*n_embd);
+    if (!blip2_vision_encode_batch(ctx, batch.data(), batch.size(), n_threads, out.data())) {
+        return false;
+    }
+
+    for (int i = 0; i < n_images; ++i) {
+        auto it = missed.find(keys[i]);
+        if (it != missed.end()) {
+            memcpy(embd + i*n_embd, out.data() + it->second*n_embd, n_embd*sizeof(float));
+        }
+    }
+    for (const auto & it : missed) {
+        blip2_embd_cache_put(cache, it.first, out.data() + it.second*n_embd, n_embd);
+    }
+
+    return true;
+}
+
+#define BLIP2_LABEL_BANK_MAGIC 0x424c3242u // "B2LB"
+#define BLIP2_LABEL_BANK_VERSION 1
+
+// The features follow the header, aligned as the records of the embedding cache, then the labels, each NUL terminated
+struct blip2_label_bank_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_labels;
+    uint32_t dim;
+    uint64_t model_key;
+    uint64_t labels_size;
+    uint8_t reserved[BLIP2_EMBD_CACHE_ALIGN - 32];
+};
+
+static_assert(sizeof(blip2_label_bank_header) == BLIP2_EMBD_CACHE_ALIGN, "unexpected label bank header size");
+
+// Stands for the text weights the features come from, as blip2_image_key does for the vision encoder
+static uint64_t blip2_label_bank_model_key(const blip2_ctx * ctx) {
+    const auto & model = ctx->qformer_model;
+
+    const int32_t config[] = {
+        model.hparams.hidden_size, model.hparams.n_layer, model.proj_dim, ctx->ftype, (int32_t) model.word_embd->ne[1],
+    };
+    uint64_t seed = blip2_hash64(config, sizeof(config), 0);
+    seed = blip2_hash64(model.word_embd->data, model.word_embd->nb[1], seed);
+    seed = blip2_hash64(model.layers.back().ln_text_b->data, ggml_nbytes(model.layers.back().ln_text_b), seed);
+
+    return blip2_hash64(model.text_proj_b->data, ggml_nbytes(model.text_proj_b), seed);
+}
+
+bool blip2_label_bank_build(blip2_ctx * ctx, const std::vector<std::string> & labels, const std::string & prompt, int n_threads, const char * fname) {
+    if (!blip2_qformer_check_texts(ctx, NULL, 0, __func__)) {
+        return false;
+    }
+    if (labels.empty()) {
+        fprintf(stderr, "%s: no labels\n", __func__);
+        return false;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    // The label goes in place of "{}", or after the prompt when it has none
+    const size_t pos = prompt.find("{}");
+    std::vector<std::vector<blip2_vocab_id>> texts(labels.size());
+    size_t labels_size = 0;
+    for (size_t i = 0; i < labels.size(); ++i) {
+        if (labels[i].find('\0') != std::string::npos) {
+            fprintf(stderr, "%s: label %zu has a NUL character\n", __func__, i);
+            return false;
+        }
+        const std::string text = pos == std::string::npos ? prompt + labels[i] : prompt.substr(0, pos) + labels[i] + prompt.substr(pos + 2);
+        if (!blip2_tokenize_wordpiece(ctx->vocab, text, texts[i])) {
+            return false;
+        }
+        labels_size += labels[i].size() + 1;
+    }
+
+    const int dim = ctx->qformer_model.proj_dim;
+    std::vector<float> feats(labels.size() * dim);
+    if (!blip2_itc_text_features(ctx, texts.data(), texts.size(), n_threads, feats.data())) {
+        return false;
+    }
+
+    blip2_label_bank_header header = {};
+    header.magic = BLIP2_LABEL_BANK_MAGIC;
+    header.version = BLIP2_LABEL_BANK_VERSION;
+    header.n_labels = labels.size();
+    header.dim = dim;
+    header.model_key = blip2_label_bank_model_key(ctx);
+    header.labels_size = labels_size;
+
+    // Written aside and renamed, so that a bank being rebuilt is never seen half written
+    const std::string fname_tmp = std::string(fname) + ".tmp";
+    FILE * fout = fopen(fname_tmp.c_str(), "wb");
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s': %s\n", __func__, fname_tmp.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fout) == 1;
+    ok = ok && fwrite(feats.data(), sizeof(float), feats.size(), fout) == feats.size();
+    for (size_t i = 0; i < labels.size() && ok; ++i) {
+        ok = fwrite(labels[i].c_str(), 1, labels[i].size() + 1, fout) == labels[i].size() + 1;
+    }
+    ok = fclose(fout) == 0 && ok;
+    if (!ok || rename(fname_tmp.c_str(), fname) != 0) {
+        fprintf(stderr, "%s: failed to write '%s': %s\n", __func__, fname, strerror(errno));
+        remove(fname_tmp.c_str());
+        return false;
+    }
+
+    printf("%s: %zu labels embedded in %.2f s\n", __func__, labels.size(), (ggml_time_us() - t_start_us) / 1e6);
+
+    return true;
+}
+
+bool blip2_label_bank_load(const blip2_ctx * ctx, blip2_label_bank * bank, const char * fname) {
+    if (!blip2_qformer_check_texts(ctx, NULL, 0, __func__) || !bank->mapping.map(fname)) {
+        return false;
+    }
+
+    const uint8_t * base = (const uint8_t *) bank->mapping.addr;
+    const size_t size = bank->mapping.size;
+
+    blip2_label_bank_header header = {};
+    memcpy(&header, base, std::min(size, sizeof(header)));
+    if (size < sizeof(header) || header.magic != BLIP2_LABEL_BANK_MAGIC || header.version != BLIP2_LABEL_BANK_VERSION) {
+        fprintf(stderr, "%s: '%s' is not a label bank of version %d\n", __func__, fname, BLIP2_LABEL_BANK_VERSION);
+        return false;
+    }
+    const size_t feats_size = (size_t) header.n_labels * header.dim * sizeof(float);
+    if (size != sizeof(header) + feats_size + header.labels_size) {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, fname);
+        return false;
+    }
+    if (header.model_key != blip2_label_bank_model_key(ctx) || (int) header.dim != ctx->qformer_model.proj_dim) {
+        fprintf(stderr, "%s: '%s' was built with other text weights\n", __func__, fname);
+        return false;
+    }
+
+    const char * labels = (const char *) base + sizeof(header) + feats_size;
+    bank->labels.clear();
+    for (size_t offset = 0; offset < header.labels_size; ) {
+        const char * label = labels + offset;
+        const size_t len = strnlen(label, header.labels_size - offset);
+        if (offset + len == header.labels_size) {
+            break;
+        }
+        bank->labels.emplace_back(label, len);
+        offset += len + 1;
+    }
+    if (bank->labels.size() != header.n_labels) {
+        fprintf(stderr, "%s: '%s' has %zu labels for %u features\n", __func__, fname, bank->labels.size(), header.n_labels);
+        return false;
+    }
+
+    bank->n_labels = header.n_labels;
+    bank->dim = header.dim;
+    bank->feats = (const float *) (base + sizeof(header));
+
+    // Every classification goes over all the features
+    bank->mapping.prefetch(sizeof(header), feats_size);
+
+    return true;
+}
+
+void blip2_label_bank_classify(const blip2_ctx * ctx, const blip2_label_bank * bank, const float * image_feats, int n_images, int k, int n_threads,
+                               int * top_ids, float * top_scores) {
+    const int n_query = ctx->num_query_tokens;
+    const int dim = bank->dim;
+    const int n_chunk = 256;
+    const int n_chunks = (bank->n_labels + n_chunk - 1) / n_chunk;
+
+    n_threads = std::max(1, std::min(n_threads, n_chunks));
+
+    // Each thread keeps the k best labels of every image it has seen in a min-heap, the bank is read once
+    // for all the images: its rows go through memory, the features of the images stay in cache
+    typedef std::pair<float, int> entry;
+    std::vector<std::vector<std::vector<entry>>> heaps(n_threads, std::vector<std::vector<entry>>(n_images));
+    auto cmp = [](const entry & a, const entry & b) { return a.first > b.first; };
+
+    std::atomic<int> next(0);
+    auto worker = [&](int ith) {
+        while (true) {
+            const int c = next++;
+            if (c >= n_chunks) {
+                break;
+            }
+            for (int l = c * n_chunk; l < std::min(bank->n_labels, (c + 1) * n_chunk); ++l) {
+                const float * row = bank->feats + (size_t) l * dim;
+                for (int i = 0; i < n_images; ++i) {
+                    float score = -INFINITY;
+                    for (int q = 0; q < n_query; ++q) {
+                        score = std::max(score, blip2_vec_dot_f32(image_feats + ((size_t) i * n_query + q) * dim, row, dim));
+                    }
+
+                    auto & heap = heaps[ith][i];
+                    if ((int) heap.size() < k) {
+                        heap.emplace_back(score, l);
+                        std::push_heap(heap.begin(), heap.end(), cmp);
+                    } else if (k > 0 && score > heap.front().first) {
+                        std::pop_heap(heap.begin(), heap.end(), cmp);
+                        heap.back() = entry(score, l);
+                        std::push_heap(heap.begin(), heap.end(), cmp);
+                    }
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    // Best first, the labels of equal scores in their order; the slots beyond the number of labels are left empty
+    std::vector<entry> best;
+    for (int i = 0; i < n_images; ++i) {
+        best.clear();
+        for (int t = 0; t < n_threads; ++t) {
+            best.insert(best.end(), heaps[t][i].begin(), heaps[t][i].end());
+        }
+        std::sort(best.begin(), best.end(), [](const entry & a, const entry & b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+        for (int j = 0; j < k; ++j) {
+            top_ids[(size_t) i * k + j] = j < (int) best.size() ? best[j].second : -1;
+            top_scores[(size_t) i * k + j] = j < (int) best.size() ? best[j].first : -INFINITY;
+        }
+    }
+}
+
+bool blip2_vision_accumulate_imatrix(blip2_ctx * ctx, const image_u8 * img, int n_threads, blip2_imatrix * imatrix) {
+    // The graph records into this very imatrix, so it is not kept with the graphs of the context
+    blip2_graph_cache cache;
+    struct ggml_tensor * out = blip2_vision_compute(ctx, cache, img, 1, n_threads, imatrix);
+
+    return out != nullptr;
+}
+
+bool blip2_imatrix_save(const blip2_imatrix * imatrix, const char * fname) {
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname);
+        return false;
+    }
+
+    // Same layout as the importance matrices of llama.cpp
+    const int n_entries = imatrix->entries.size();
+    fout.write((const char *) &n_entries, sizeof(n_entries));
+    for (const auto & it : imatrix->entries) {
+        const int len = it.first.size();
+        fout.write((const char *) &len, sizeof(len));
+        fout.write(it.first.c_str(), len);
+        fout.write((const char *) &it.second.ncall, sizeof(it.second.ncall));
+        const int n_values = it.second.values.size();
+        fout.write((const char *) &n_values, sizeof(n_values));
+        fout.write((const char *) it.second.values.data(), n_values*sizeof(float));
+    }
+
+    return (bool) fout;
+}
+
+bool blip2_imatrix_load(blip2_imatrix * imatrix, const char * fname) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname);
+        return false;
+    }
+
+    int n_entries = 0;
+    fin.read((char *) &n_entries, sizeof(n_entries));
+    for (int i = 0; fin && i < n_entries; ++i) {
+        int len = 0;
+        fin.read((char *) &len, sizeof(len));
+        std::string name(std::max(len, 0), '\0');
+        fin.read(&name[0], len);
+
+        auto & entry = imatrix->entries[name];
+        fin.read((char *) &entry.ncall, sizeof(entry.ncall));
+        int n_values = 0;
+        fin.read((char *) &n_values, sizeof(n_values));
+        entry.values.resize(std::max(n_values, 0));
+        fin.read((char *) entry.values.data(), entry.values.size()*sizeof(float));
+    }
+
+    if (!fin) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname);
+        return false;
+    }
+
+    return true;
 }
@@ -1,15 +1,36 @@
 #pragma once
 
+#include <cstdio>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include "ggml/ggml.h"
 
 
 // Image structures
+// Who releases the pixels of an image_u8
+enum blip2_image_owner {
+    // borrowed, e.g. from a caller arena, never freed by blip2_image_u8_free
+    BLIP2_IMAGE_OWNER_NONE,
+    // allocated with new[]
+    BLIP2_IMAGE_OWNER_NEW,
+    // the buffer stb_image decoded into, adopted as is
+    BLIP2_IMAGE_OWNER_STB,
+};
+
 // RGB uint8 image
 struct image_u8 {
-    int nx;
-    int ny;
-    uint8_t* data;
-    size_t size;
+    int nx = 0;
+    int ny = 0;
+    uint8_t* data = NULL;
+    size_t size = 0;
+    enum blip2_image_owner owner = BLIP2_IMAGE_OWNER_NONE;
 };
 
 // RGB float32 image (NHWC)
@@ -30,7 +51,7 @@ struct blip2_vision_layer {
     struct ggml_tensor* proj_w;
     struct ggml_tensor* proj_b;
 
-    // layernorm 1
+    // layernorm 1, NULL when folded into qkv
     struct ggml_tensor* ln_1_w;
     struct ggml_tensor* ln_1_b;
 
@@ -41,7 +62,7 @@ struct blip2_vision_layer {
     struct ggml_tensor* ff_2_w;
     struct ggml_tensor* ff_2_b;
 
-    // layernorm 2
+    // layernorm 2, NULL when folded into ff_1
     struct ggml_tensor* ln_2_w;
     struct ggml_tensor* ln_2_b;
 };
@@ -67,6 +88,12 @@ struct blip2_vison_model {
     struct ggml_tensor* class_embedding;
     struct ggml_tensor* position_embeddings;
 
+    // Computed at load time: position embeddings plus the class embedding on the first row
+    // and the patch bias on the others, everything added to the output of the patch embedding
+    // The table of the image size in use, the others are kept by size once interpolated.
+    struct ggml_tensor* pos_table;
+    std::map<int, struct ggml_tensor*> pos_tables;
+
     std::vector<blip2_vision_layer> layers;
 
     struct ggml_tensor* post_ln_w;
@@ -76,11 +103,105 @@ struct blip2_vison_model {
 // Q-Former structs
 struct blip2_qformer_hparams
 {
-    /* data */
+    int32_t hidden_size;
+    int32_t n_layer;
+    int32_t n_head;
+    int32_t n_intermediate;
+    // size of the image features the cross-attention reads
+    int32_t encoder_hidden_size;
+    float eps;
+};
+
+// Attention block of a BERT layer: attention, output projection and layernorm of the residual
+struct blip2_qformer_attn {
+    struct ggml_tensor* q_w;
+    struct ggml_tensor* q_b;
+    struct ggml_tensor* k_w;
+    struct ggml_tensor* k_b;
+    struct ggml_tensor* v_w;
+    struct ggml_tensor* v_b;
+
+    struct ggml_tensor* o_w;
+    struct ggml_tensor* o_b;
+
+    struct ggml_tensor* ln_w;
+    struct ggml_tensor* ln_b;
+};
+
+struct blip2_qformer_layer {
+    struct blip2_qformer_attn self_attn;
+
+    // every cross_attention_frequency layers, starting with the first one
+    bool has_cross_attn;
+    struct blip2_qformer_attn cross_attn;
+    // index of its keys and values in blip2_qformer_kv, -1 without cross-attention
+    int cross_index;
+
+    // feed-forward of the query tokens
+    struct ggml_tensor* ff_1_w;
+    struct ggml_tensor* ff_1_b;
+    struct ggml_tensor* ff_2_w;
+    struct ggml_tensor* ff_2_b;
+
+    struct ggml_tensor* ln_w;
+    struct ggml_tensor* ln_b;
+
+    // feed-forward of the text tokens, retrieval models only
+    struct ggml_tensor* ff_text_1_w;
+    struct ggml_tensor* ff_text_1_b;
+    struct ggml_tensor* ff_text_2_w;
+    struct ggml_tensor* ff_text_2_b;
+
+    struct ggml_tensor* ln_text_w;
+    struct ggml_tensor* ln_text_b;
 };
 
 struct blip2_qformer_model {
+    struct blip2_qformer_hparams hparams;
+
+    struct ggml_tensor* query_tokens;
+
+    struct ggml_tensor* ln_w;
+    struct ggml_tensor* ln_b;
+
+    std::vector<blip2_qformer_layer> layers;
+
+    // Computed at load time: the query tokens never depend on the image before the first cross-attention,
+    // this is their state there, after the self-attention of its layer
+    int first_cross_layer;
+    struct ggml_tensor* query_prefix;
+
+    // Computed at load time: the key and value projections of all the cross-attention layers stacked,
+    // [encoder_hidden_size, n_cross_layers*2*hidden_size], so that the image side is a single matrix product
+    int n_cross_layers;
+    struct ggml_tensor* cross_kv_w;
+    struct ggml_tensor* cross_kv_b;
+
+    // Text embeddings and image-text heads of the models converted from Blip2ForImageTextRetrieval,
+    // has_text is false for the others. The heads are kept in F32, they run outside of the graphs.
+    bool has_text;
+    struct ggml_tensor* word_embd;
+    struct ggml_tensor* pos_embd;
+    // NULL when the embeddings have no layernorm of their own
+    struct ggml_tensor* embd_ln_w;
+    struct ggml_tensor* embd_ln_b;
+
+    int proj_dim;
+    struct ggml_tensor* vision_proj_w;
+    struct ggml_tensor* vision_proj_b;
+    struct ggml_tensor* text_proj_w;
+    struct ggml_tensor* text_proj_b;
+    struct ggml_tensor* itm_w;
+    struct ggml_tensor* itm_b;
+};
 
+// Cross-attention keys and values of the image tokens for every cross-attention layer of the Q-Former.
+// They depend on the image only, so they are computed once and reused for every text the image goes with.
+struct blip2_qformer_kv {
+    int n_images = 0;
+    int n_image_tokens = 0;
+    // [n_images][n_image_tokens][n_cross_layers][key, value][hidden_size]
+    std::vector<float> data;
 };
 
 // Text structs
@@ -102,13 +223,65 @@ struct blip2_vocab {
     //    void add_special_token(const std::string & token);
 };
 
+// OPT decoder layer, pre-layernorm
+struct blip2_text_layer {
+    // self_attn_layer_norm
+    struct ggml_tensor* ln_1_w;
+    struct ggml_tensor* ln_1_b;
+
+    // attention
+    struct ggml_tensor* q_w;
+    struct ggml_tensor* q_b;
+    struct ggml_tensor* k_w;
+    struct ggml_tensor* k_b;
+    struct ggml_tensor* v_w;
+    struct ggml_tensor* v_b;
+
+    struct ggml_tensor* o_w;
+    struct ggml_tensor* o_b;
+
+    // final_layer_norm of the layer
+    struct ggml_tensor* ln_2_w;
+    struct ggml_tensor* ln_2_b;
+
+    // ff, relu
+    struct ggml_tensor* ff_1_w;
+    struct ggml_tensor* ff_1_b;
+
+    struct ggml_tensor* ff_2_w;
+    struct ggml_tensor* ff_2_b;
+};
+
 struct blip2_text_hparams
 {
-    /* data */
+    int32_t n_vocab;
+    // positions the model was trained on, the KV cache of a session holds at most this many
+    int32_t n_ctx;
+    int32_t hidden_size;
+    int32_t n_layer;
+    int32_t n_head;
+    int32_t n_intermediate;
+    float eps;
 };
 
 struct blip2_text_model {
+    struct blip2_text_hparams hparams;
+
+    // Q-Former output to the input embeddings of the decoder
+    struct ggml_tensor* proj_w;
+    struct ggml_tensor* proj_b;
+
+    struct ggml_tensor* tok_embd;
+    // learned positions, offset by 2 as in OPT
+    struct ggml_tensor* pos_embd;
 
+    std::vector<blip2_text_layer> layers;
+
+    struct ggml_tensor* ln_f_w;
+    struct ggml_tensor* ln_f_b;
+
+    // tok_embd when the output embeddings are tied to the input ones
+    struct ggml_tensor* lm_head;
 };
 
 // BLIP2 structs
@@ -125,21 +298,273 @@ struct blip2_buffer {
     ~blip2_buffer() { delete[] data; }
 };
 
+// Read-only memory mapping of a model file
+// Tensors loaded with use_mmap point straight into it, so they must never be written to
+struct blip2_mmap {
+    void * addr = NULL;
+    size_t size = 0;
+
+    bool map(const char * fname);
+    void unmap();
+
+    // Hint the kernel to start reading a range in the background / drop it from the resident set
+    void prefetch(size_t offset, size_t len) const;
+    void evict(size_t offset, size_t len) const;
+
+    ~blip2_mmap() { unmap(); }
+};
+
+// A file read and written at given offsets, from any number of threads
+// Uses pread / pwrite where files can be mapped, a buffered stream behind a mutex otherwise
+struct blip2_file {
+    int fd = -1;
+    FILE * fp = NULL;
+    mutable std::mutex mutex;
+
+    // Read-only, or read-write and created if it does not exist
+    bool open(const char * fname, bool write);
+    void close();
+    bool is_open() const { return fd != -1 || fp != NULL; }
+
+    // Failures leave errno set, to EIO when the file ends before the range
+    bool size(size_t & n_bytes) const;
+    bool read(void * dst, size_t n_bytes, size_t offset) const;
+    bool write(const void * src, size_t n_bytes, size_t offset);
+    // Without pread / pwrite the file is left as is, the bytes past n_bytes are only overwritten by later writes
+    bool truncate(size_t n_bytes);
+
+    ~blip2_file() { close(); }
+};
+
+// A streamed tensor and where its data lives in the model file and in a layer slot
+struct blip2_stream_tensor {
+    struct ggml_tensor * tensor;
+    size_t file_offset;
+    size_t slot_offset;
+};
+
+// Residency of the vision layer weights in streaming mode
+// At most two layers are resident: the one being computed and the next one, fetched in the background.
+// With mmap the slots are not used and residency is managed with madvise on the mapping instead.
+struct blip2_layer_stream {
+    bool enabled = false;
+    blip2_file file;
+    std::vector<std::vector<blip2_stream_tensor>> layers;
+
+    blip2_buffer slots[2];
+    int slot_layer[2] = { -1, -1 };
+    bool slot_busy[2] = { false, false };
+
+    // The prefetch thread only fills slots[prefetch_slot], the slot state is updated once it is joined
+    std::thread prefetch;
+    int prefetch_layer = -1;
+    int prefetch_slot = -1;
+    bool prefetch_ok = false;
+};
+
+// Token merging of one vision layer, read by its custom ops while the graph runs
+struct blip2_tome_layer {
+    // tokens merged away by the layer
+    int r = 0;
+    // sizes of the tokens entering the layer, NULL while every token is a single patch
+    const float * sizes_in = NULL;
+    // sizes of the tokens leaving it, image after image
+    std::vector<float> sizes_out;
+};
+
+// A compute graph kept across calls along with its buffers, built for one batch size
+// The compute buffer is sized by a measure pass of the allocator and only ever grows,
+// so repeated calls with the same shape neither rebuild the graph nor allocate memory
+struct blip2_graph_cache {
+    int n_batch = -1;
+    int n_threads = 0;
+
+    std::vector<uint8_t> buf_graph;
+    blip2_buffer buf_compute;
+    std::vector<uint8_t> buf_work;
+
+    struct ggml_context * ctx0 = NULL;
+    struct ggml_cgraph * gf = NULL;
+    struct ggml_cplan plan = {};
+
+    // Token merging state of a vision graph, one entry per layer, see blip2_model_params::tome_r
+    std::vector<blip2_tome_layer> tome;
+
+    // Graphs of the streamed vision layers, one per layer, in the compute and work buffers of this cache
+    std::vector<std::unique_ptr<blip2_graph_cache>> layers;
+
+    // Drop the graph, the buffers are kept for the next one
+    void clear();
+
+    ~blip2_graph_cache() { clear(); }
+};
+
+// Graphs of a few shapes kept side by side, for callers that alternate between them
+// such as text batches of several lengths. The least recently used one is dropped first.
+struct blip2_graph_cache_set {
+    // shape of the graph, most recently used first
+    std::list<std::pair<std::vector<int>, blip2_graph_cache>> caches;
+
+    blip2_graph_cache & get(const std::vector<int> & shape);
+    void clear() { caches.clear(); }
+};
+
+// Keys and values of the language model for n_ctx positions, allocated once per session
+// One row of n_head*d_head values per layer and position, [n_layer][n_ctx] for k and for v. Rows are whole
+// quantization blocks with q8_0 and q4_0, the heads of a row need not be: the attention dequantizes ranges.
+struct blip2_kv_cache {
+    // GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0 or GGML_TYPE_Q4_0
+    enum ggml_type type = GGML_TYPE_F16;
+    int n_ctx = 0;
+    int n_layer = 0;
+    int n_head = 0;
+    int d_head = 0;
+    // bytes of a row
+    size_t row_size = 0;
+
+    std::vector<uint8_t> k;
+    std::vector<uint8_t> v;
+
+    // positions already in the cache, read by the graph ops when they run
+    int n_past = 0;
+};
+
+// Userdata of the cache ops of one layer
+struct blip2_kv_layer {
+    struct blip2_kv_cache * kv;
+    int il;
+};
+
+// A generation with the language model, independent of the other sessions of the same model
+// The graph of a decode step does not depend on the position, it is built on the first step and
+// reused by all the others. The session must stay where it was initialized, its graphs point into it.
+struct blip2_text_session {
+    struct blip2_kv_cache kv;
+    std::vector<blip2_kv_layer> layers;
+
+    struct blip2_graph_cache prefill_graph;
+    struct blip2_graph_cache decode_graph;
+
+    // logits of the last token evaluated
+    std::vector<float> logits;
+};
+
+// Towers of the model, combined as a bitmask to select the weights that get loaded
+enum blip2_tower {
+    BLIP2_TOWER_VISION  = 1 << 0,
+    BLIP2_TOWER_QFORMER = 1 << 1,
+    BLIP2_TOWER_TEXT    = 1 << 2,
+    BLIP2_TOWER_ALL     = BLIP2_TOWER_VISION | BLIP2_TOWER_QFORMER | BLIP2_TOWER_TEXT,
+};
+
+#define BLIP2_N_TOWERS 3
+
+struct blip2_model_params {
+    // map the GGUF file and point tensor data into it instead of reading it into memory
+    bool use_mmap;
+    // bitmask of blip2_tower, tensors of the other towers are neither allocated nor read
+    uint32_t towers;
+    // number of threads reading tensors when not using mmap
+    int n_threads;
+    // keep at most two vision layers resident, reading or paging in each one right before it runs
+    bool stream_vision_layers;
+    // compute attention with a tiled kernel instead of materializing the score matrices
+    bool flash_attn;
+    // vision layer whose output, after the post layernorm, are the image features, negative values count
+    // from the last layer (-1). The weights of the layers after it are neither loaded nor mapped in.
+    int32_t vision_feature_layer;
+    // merge this many similar tokens away in every vision layer (ToMe), trading accuracy for throughput,
+    // 0 keeps all of them
+    int32_t tome_r;
+    // fold the scale and shift of the vision layernorms into the qkv and first feed-forward matrices
+    // that follow them, which must be f32 or f16. See blip2_model_save to keep the result.
+    bool fold_layer_norm;
+    // encode images at this size instead of the one the model was trained at, 0 for the latter,
+    // see blip2_vision_set_image_size
+    int32_t vision_image_size;
+};
+
+// Timings of the last blip2_model_load, per tower when tensors were read
+struct blip2_load_stats {
+    int n_threads = 0;
+    int64_t t_load_us = 0;
+    int64_t t_read_us = 0;
+    size_t n_bytes = 0;
+    int64_t t_tower_us[BLIP2_N_TOWERS] = {};
+    size_t n_tower_bytes[BLIP2_N_TOWERS] = {};
+};
+
 struct blip2_ctx {
     bool vision_gelu = false;
     bool qformer_gelu = false;
+    bool flash_attn = true;
+    // the vision layernorms were folded into the matrices that follow them
+    bool fold_layer_norm = false;
+    int tome_r = 0;
+    // size images are encoded at, a multiple of the patch size
+    int vision_image_size = 0;
     uint32_t num_query_tokens;
     uint32_t cross_attention_frequency;
+    uint32_t towers = BLIP2_TOWER_ALL;
     struct blip2_vison_model vision_model;
     struct blip2_qformer_model qformer_model;
     struct blip2_text_model text_model;
     struct blip2_vocab vocab;
     float image_mean[3];
     float image_std[3];
+    // general.file_type: the type of most of the weights, tensors keep their own type
     int32_t ftype = 1;
-    struct ggml_context* ctx;
-    struct gguf_context* ctx_gguf;
-    struct blip2_buffer buf_compute;
+    struct ggml_context* ctx = NULL;
+    struct gguf_context* ctx_gguf = NULL;
+    // Tensors computed from the weights at load time, one context each
+    std::vector<struct ggml_context*> ctx_derived;
+    // vision graphs by batch size, blip2_vision_encode_batch_cached encodes batches of any size up to the one asked for
+    struct blip2_graph_cache_set vision_graph;
+    struct blip2_graph_cache qformer_graph;
+    struct blip2_graph_cache qformer_kv_graph;
+    struct blip2_graph_cache_set qformer_text_graph;
+    struct blip2_graph_cache_set qformer_itm_graph;
+    // keys and values of the last blip2_qformer_encode_batch
+    struct blip2_qformer_kv qformer_kv;
+    struct blip2_mmap mapping;
+    struct blip2_load_stats load_stats;
+    struct blip2_layer_stream vision_stream;
+};
+
+// Content-addressed store of encoder outputs, keyed by blip2_image_key
+// Entries are appended to a file as 64-byte aligned records, the ones present when it was opened being
+// read through a mapping of it. The most recently used entries are also kept in memory.
+struct blip2_embd_record {
+    size_t offset;
+    size_t n_floats;
+};
+
+struct blip2_embd_cache {
+    blip2_file file;
+    size_t file_size = 0;
+    struct blip2_mmap mapping;
+    std::unordered_map<uint64_t, blip2_embd_record> index;
+
+    size_t max_mem_entries = 0;
+    std::list<uint64_t> lru;
+    std::unordered_map<uint64_t, std::pair<std::vector<float>, std::list<uint64_t>::iterator>> mem;
+
+    std::mutex mutex;
+
+    size_t n_hits_mem = 0;
+    size_t n_hits_file = 0;
+    size_t n_misses = 0;
+};
+
+// Importance matrix: for each weight matrix, the sum over the calibration data
+// of the squared activations entering each of its input columns
+struct blip2_imatrix_entry {
+    std::vector<float> values;
+    int ncall = 0;
+};
+
+struct blip2_imatrix {
+    std::map<std::string, blip2_imatrix_entry> entries;
 };
 
 
@@ -150,7 +575,141 @@ struct ggml_tensor* get_tensor(struct ggml_context * ctx, std::string name);
 void printShape(struct ggml_tensor *tensor);
 void printTensorInfo(struct ggml_tensor* tensor);
 bool load_image_from_file(const char* fname, image_u8* img);
+// Decode sequential JPEGs at the smallest 1/2, 1/4 or 1/8 scale keeping max(nx, ny) >= min_size,
+// anything else is decoded at full size
+bool load_image_from_file_scaled(const char* fname, image_u8* img, int min_size);
+// Decode an encoded image held in memory, min_size as above with 0 for a full size decode
+// With an arena, reduced-resolution JPEGs are decoded into it and stay valid until its next use,
+// other images are adopted from stb_image
+bool load_image_from_memory(const uint8_t* buf, size_t len, image_u8* img, int min_size = 0, blip2_buffer* arena = NULL);
+void blip2_image_u8_free(image_u8* img);
 bool blip2_image_preprocess(const blip2_ctx* ctx, const image_u8* img, image_f32* res);
+// Preprocess into slot batch_idx of an allocated f32 tensor of shape [image_size, image_size, 3, n],
+// the planar layout the patch embedding convolution reads
+bool blip2_image_preprocess_to_tensor(const blip2_ctx* ctx, const image_u8* img, struct ggml_tensor* dst, int batch_idx);
+// Preprocess into slot batch_idx of an allocated f32 tensor of shape [patch_size*patch_size*3, 1 + n_patches, n],
+// the input of the vision graph: one column per patch, after a zero column for the class token
+bool blip2_image_preprocess_to_patches(const blip2_ctx* ctx, const image_u8* img, struct ggml_tensor* dst, int batch_idx);
+void blip2_image_f32_free(image_f32* img);
 void blip2_free(blip2_ctx* ctx);
 
-struct blip2_ctx* blip2_model_load(const char * fname);
\ No newline at end of file
+struct blip2_model_params blip2_model_default_params();
+struct blip2_ctx* blip2_model_load(const char * fname, struct blip2_model_params params);
+struct blip2_ctx* blip2_model_load(const char * fname);
+// Write the model as loaded, folded layernorms included, with the class embedding and the patch bias
+// added into the position embeddings. All towers and layers must be loaded, without streaming.
+bool blip2_model_save(const blip2_ctx * ctx, const char * fname);
+
+// Vision layer residency when loaded with stream_vision_layers, no-ops otherwise
+// The encoder then runs one layer at a time and brackets each one with these calls.
+// Layers are expected to be acquired in order, each one released before the next-but-one is acquired
+bool blip2_vision_layer_acquire(blip2_ctx * ctx, int il);
+void blip2_vision_layer_release(blip2_ctx * ctx, int il);
+
+// Encode images at image_size instead of the size the model was trained at, a multiple of the patch size
+// The position embeddings are interpolated bicubically the first time a size is used and kept for later.
+// Fewer patches cost quadratically less attention, at some loss of accuracy. Not to be called while encoding.
+bool blip2_vision_set_image_size(blip2_ctx * ctx, int image_size);
+
+// Number of input positions of the vision encoder per image, the class token followed by the patches
+int blip2_vision_n_positions(const blip2_ctx * ctx);
+// Number of output tokens of the vision encoder per image, fewer than its positions when tokens are merged,
+// the class token always comes first
+int blip2_vision_n_output_tokens(const blip2_ctx * ctx);
+
+// Attention of q over k and v, each of shape [d_head, n_head, n_tokens, n_batch] and possibly a strided view
+// With flash, a tiled kernel with an online softmax never writes the [n_kv, n_q] score matrices out,
+// otherwise they are computed with ggml_mul_mat and ggml_soft_max_ext. The result is a contiguous
+// tensor of shape [d_head, n_head, n_q, n_batch].
+// kv_sizes, n_kv floats per batch entry, is the number of patches behind each key of merged tokens:
+// their logits get log(size) added (proportional attention). Both paths read it when the graph runs.
+// k and v may also have a single batch entry, shared by all those of q.
+struct ggml_tensor * blip2_attention(struct ggml_context * ctx0, struct ggml_tensor * q, struct ggml_tensor * k, struct ggml_tensor * v, bool flash, const float * kv_sizes = NULL);
+
+// Run the vision encoder on n_images images in a single graph
+// embd receives n_images*blip2_vision_n_output_tokens(ctx)*hidden_size floats, image after image
+bool blip2_vision_encode_batch(blip2_ctx * ctx, const image_u8 * imgs, int n_images, int n_threads, float * embd);
+
+// 64-bit hash of a buffer, fast enough to key whole images by their pixels
+uint64_t blip2_hash64(const void * data, size_t len, uint64_t seed);
+// Key of the vision encoder output of an image: its pixels, the weights and every setting the output depends on
+uint64_t blip2_image_key(const blip2_ctx * ctx, const image_u8 * img);
+
+// Open or create the cache file fname, NULL for a cache held in memory only, of which at most
+// max_mem_entries entries stay in memory. A record cut short by a crash is dropped.
+bool blip2_embd_cache_open(blip2_embd_cache * cache, const char * fname, size_t max_mem_entries);
+// Copy the entry of key, n_floats floats, to dst. False when it is missing or has another size.
+bool blip2_embd_cache_get(blip2_embd_cache * cache, uint64_t key, float * dst, size_t n_floats);
+bool blip2_embd_cache_put(blip2_embd_cache * cache, uint64_t key, const float * src, size_t n_floats);
+
+// blip2_vision_encode_batch going through the cache, only the images it misses are encoded, in one batch
+bool blip2_vision_encode_batch_cached(blip2_ctx * ctx, blip2_embd_cache * cache, const image_u8 * imgs, int n_images, int n_threads, float * embd);
+
+// Run the Q-Former on the vision encoder outputs of n_images images, n_image_tokens tokens of
+// encoder_hidden_size floats each. out receives n_images*num_query_tokens*hidden_size floats, image after image
+bool blip2_qformer_encode_batch(blip2_ctx * ctx, const float * image_embd, int n_images, int n_image_tokens, int n_threads, float * out);
+// The two halves of blip2_qformer_encode_batch: the cross-attention keys and values of the images,
+// in one matrix product, then the query tokens attending to them
+bool blip2_qformer_project_kv(blip2_ctx * ctx, const float * image_embd, int n_images, int n_image_tokens, int n_threads, blip2_qformer_kv * kv);
+bool blip2_qformer_encode_batch_kv(blip2_ctx * ctx, const blip2_qformer_kv * kv, int n_threads, float * out);
+
+// Image-text contrastive (ITC) and matching (ITM) scores, for models converted from Blip2ForImageTextRetrieval.
+// Texts are token ids of the BERT tokenizer of the Q-Former, [CLS] first. They are run in batches of texts
+// of the same length, so that none is padded, and the images come as the keys and values of blip2_qformer_project_kv.
+
+// Normalized contrastive features, num_query_tokens rows of proj_dim floats per image, one row per text
+bool blip2_itc_image_features(blip2_ctx * ctx, const blip2_qformer_kv * kv, int n_threads, float * feats);
+bool blip2_itc_text_features(blip2_ctx * ctx, const std::vector<blip2_vocab_id> * texts, int n_texts, int n_threads, float * feats);
+// Contrastive similarity of every image with every text, the best over the query rows, scores[i*n_texts + t]
+void blip2_itc_scores(const blip2_ctx * ctx, const float * image_feats, int n_images, const float * text_feats, int n_texts, float * scores);
+// Probability that every image of kv matches every text, scores[i*n_texts + t]
+bool blip2_itm_scores(blip2_ctx * ctx, const blip2_qformer_kv * kv, const std::vector<blip2_vocab_id> * texts, int n_texts, int n_threads, float * scores);
+
+// WordPiece tokenization of the Q-Former (BERT uncased) with the vocabulary of a retrieval model:
+// ASCII lowercased, split at whitespace and punctuation, then each word into the longest pieces of the
+// vocabulary, "##" marking the pieces that continue a word. [CLS] first and [SEP] last.
+bool blip2_tokenize_wordpiece(const blip2_vocab & vocab, const std::string & text, std::vector<blip2_vocab_id> & ids);
+
+// Normalized contrastive text features of a label set, computed once and read from a mapped file
+struct blip2_label_bank {
+    int n_labels = 0;
+    int dim = 0;
+    // n_labels rows of dim floats, in the mapping
+    const float * feats = NULL;
+    std::vector<std::string> labels;
+    struct blip2_mmap mapping;
+};
+
+// Embed the labels, each put in place of "{}" in prompt (e.g. "a photo of a {}"), and write them to fname
+bool blip2_label_bank_build(blip2_ctx * ctx, const std::vector<std::string> & labels, const std::string & prompt, int n_threads, const char * fname);
+// Map a bank file, which must have been built with the text weights of ctx
+bool blip2_label_bank_load(const blip2_ctx * ctx, blip2_label_bank * bank, const char * fname);
+// The k best labels of each image by contrastive similarity, best first, from the image_feats of
+// blip2_itc_image_features. top_ids and top_scores receive n_images*k entries.
+void blip2_label_bank_classify(const blip2_ctx * ctx, const blip2_label_bank * bank, const float * image_feats, int n_images, int k, int n_threads,
+                               int * top_ids, float * top_scores);
+
+// Language model
+
+// Allocate the KV cache of a session for n_ctx positions, those of the model when n_ctx <= 0
+// kv_type is the type the keys and values are stored in: GGML_TYPE_F32, GGML_TYPE_F16, or GGML_TYPE_Q8_0 and
+// GGML_TYPE_Q4_0 at about 1/2 and 1/4 of the F16 size
+bool blip2_text_session_init(const blip2_ctx * ctx, blip2_text_session * session, int n_ctx, enum ggml_type kv_type);
+// Run n_query rows of Q-Former output (none with n_query = 0) and the prompt through the decoder in one
+// graph, after what the cache already holds (kv.n_past = 0 starts over). The logits of the last prompt
+// token are in session->logits.
+bool blip2_text_prefill(const blip2_ctx * ctx, blip2_text_session * session, const float * query_embd, int n_query,
+                        const blip2_vocab_id * prompt, int n_prompt, int n_threads);
+// One more token, only the new token is computed
+bool blip2_text_decode(const blip2_ctx * ctx, blip2_text_session * session, blip2_vocab_id token, int n_threads);
+// Greedy decoding from the logits of the last evaluated token until eos, max_tokens tokens or a full cache
+// The tokens are appended to tokens, eos excluded
+bool blip2_text_generate(const blip2_ctx * ctx, blip2_text_session * session, int max_tokens, blip2_vocab_id eos, int n_threads,
+                         std::vector<blip2_vocab_id> & tokens);
+// Text of tokens of a byte-level BPE vocabulary such as the one of OPT
+std::string blip2_detokenize_bpe(const blip2_vocab & vocab, const blip2_vocab_id * tokens, int n_tokens);
+
+// Run the vision encoder on an image and add the activations of its weight matrices to imatrix
+bool blip2_vision_accumulate_imatrix(blip2_ctx * ctx, const image_u8 * img, int n_threads, blip2_imatrix * imatrix);
+bool blip2_imatrix_save(const blip2_imatrix * imatrix, const char * fname);
+bool blip2_imatrix_load(blip2_imatrix * imatrix, const char * fname);
\ No newline at end of file
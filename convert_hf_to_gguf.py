@@ -4,7 +4,7 @@ import os
 
 import torch
 from gguf import *
-from transformers import Blip2ForConditionalGeneration, Blip2Processor
+from transformers import Blip2ForConditionalGeneration, Blip2ForImageTextRetrieval, Blip2Processor
 
 GGML_MAX_NAME = 64
 
@@ -16,6 +16,173 @@ TEXT = "blip2.text"
 def k(raw_key: str, arch: str) -> str:
     return raw_key.format(arch=arch)
 
+
+# Tensor types understood by --vision-type / --qformer-type / --text-type
+TENSOR_TYPES = {
+    "f32": GGMLQuantizationType.F32,
+    "f16": GGMLQuantizationType.F16,
+    "q8_0": GGMLQuantizationType.Q8_0,
+    "q5_1": GGMLQuantizationType.Q5_1,
+    "q5_0": GGMLQuantizationType.Q5_0,
+    "q4_1": GGMLQuantizationType.Q4_1,
+    "q4_0": GGMLQuantizationType.Q4_0,
+    "q4_K": GGMLQuantizationType.Q4_K,
+}
+
+# general.file_type values, same numbering as llama.cpp
+FILE_TYPES = {
+    "f32": 0,
+    "f16": 1,
+    "q4_0": 2,
+    "q4_1": 3,
+    "q8_0": 7,
+    "q5_0": 8,
+    "q5_1": 9,
+    "q4_K": 14,
+}
+
+
+def block_size(type_name: str) -> int:
+    return GGML_QUANT_SIZES[TENSOR_TYPES[type_name]][0]
+
+
+def fp16_bytes(x: np.ndarray) -> np.ndarray:
+    return x.astype(np.float16).view(np.uint8)
+
+
+# Quantization of rows of a 2-D float32 array into ggml blocks,
+# returned as a uint8 array with one row of packed blocks per input row
+def quantize_q8_0(x: np.ndarray) -> np.ndarray:
+    xb = x.reshape(-1, 32)
+    d = np.abs(xb).max(axis=1, keepdims=True) / 127
+    inv_d = np.divide(1, d, out=np.zeros_like(d), where=d > 0)
+    qs = np.round(xb * inv_d).astype(np.int8).view(np.uint8)
+    return np.concatenate([fp16_bytes(d), qs], axis=1).reshape(x.shape[0], -1)
+
+
+def signed_absmax(xb: np.ndarray) -> np.ndarray:
+    idx = np.abs(xb).argmax(axis=1)
+    return xb[np.arange(xb.shape[0]), idx][:, None]
+
+
+def pack_nibbles(q: np.ndarray) -> np.ndarray:
+    return (q[:, :16] & 0xF) | ((q[:, 16:] & 0xF) << 4)
+
+
+def pack_high_bits(q: np.ndarray) -> np.ndarray:
+    bits = ((q >> 4) & 1).astype(np.uint32)
+    qh = (bits << np.arange(32, dtype=np.uint32)).sum(axis=1, dtype=np.uint32)
+    return np.ascontiguousarray(qh.reshape(-1, 1)).view(np.uint8)
+
+
+def quantize_q4_0(x: np.ndarray) -> np.ndarray:
+    xb = x.reshape(-1, 32)
+    d = signed_absmax(xb) / -8
+    inv_d = np.divide(1, d, out=np.zeros_like(d), where=d != 0)
+    q = np.clip(np.trunc(xb * inv_d + 8.5), 0, 15).astype(np.uint8)
+    return np.concatenate([fp16_bytes(d), pack_nibbles(q)], axis=1).reshape(x.shape[0], -1)
+
+
+def quantize_q4_1(x: np.ndarray) -> np.ndarray:
+    xb = x.reshape(-1, 32)
+    mn = xb.min(axis=1, keepdims=True)
+    d = (xb.max(axis=1, keepdims=True) - mn) / 15
+    inv_d = np.divide(1, d, out=np.zeros_like(d), where=d > 0)
+    q = np.clip(np.trunc((xb - mn) * inv_d + 0.5), 0, 15).astype(np.uint8)
+    return np.concatenate([fp16_bytes(d), fp16_bytes(mn), pack_nibbles(q)], axis=1).reshape(x.shape[0], -1)
+
+
+def quantize_q5_0(x: np.ndarray) -> np.ndarray:
+    xb = x.reshape(-1, 32)
+    d = signed_absmax(xb) / -16
+    inv_d = np.divide(1, d, out=np.zeros_like(d), where=d != 0)
+    q = np.clip(np.trunc(xb * inv_d + 16.5), 0, 31).astype(np.uint8)
+    return np.concatenate([fp16_bytes(d), pack_high_bits(q), pack_nibbles(q)], axis=1).reshape(x.shape[0], -1)
+
+
+def quantize_q5_1(x: np.ndarray) -> np.ndarray:
+    xb = x.reshape(-1, 32)
+    mn = xb.min(axis=1, keepdims=True)
+    d = (xb.max(axis=1, keepdims=True) - mn) / 31
+    inv_d = np.divide(1, d, out=np.zeros_like(d), where=d > 0)
+    q = np.clip(np.trunc((xb - mn) * inv_d + 0.5), 0, 31).astype(np.uint8)
+    return np.concatenate([fp16_bytes(d), fp16_bytes(mn), pack_high_bits(q), pack_nibbles(q)], axis=1).reshape(x.shape[0], -1)
+
+
+# Super-blocks of 256 values made of 8 sub-blocks of 32, each with a 6-bit scale and min.
+# Scales and mins are taken from the sub-block range, without the iterative refinement of ggml.
+def quantize_q4_K(x: np.ndarray) -> np.ndarray:
+    xb = x.reshape(-1, 8, 32)
+    nb = xb.shape[0]
+
+    mins = -np.minimum(xb.min(axis=2), 0)
+    scales = (xb.max(axis=2) + mins) / 15
+
+    max_scale = scales.max(axis=1, keepdims=True)
+    max_min = mins.max(axis=1, keepdims=True)
+    inv_scale = np.divide(63, max_scale, out=np.zeros_like(max_scale), where=max_scale > 0)
+    inv_min = np.divide(63, max_min, out=np.zeros_like(max_min), where=max_min > 0)
+    ls = np.clip(np.round(inv_scale * scales), 0, 63).astype(np.uint8)
+    lm = np.clip(np.round(inv_min * mins), 0, 63).astype(np.uint8)
+
+    d = (max_scale / 63).astype(np.float16)
+    dmin = (max_min / 63).astype(np.float16)
+
+    sc = (d.astype(np.float32) * ls)[:, :, None]
+    m = (dmin.astype(np.float32) * lm)[:, :, None]
+    L = np.divide(xb + m, sc, out=np.zeros_like(xb), where=sc > 0)
+    L = np.clip(np.round(L), 0, 15).astype(np.uint8).reshape(nb, 4, 2, 32)
+
+    packed_scales = np.zeros((nb, 12), dtype=np.uint8)
+    packed_scales[:, 0:4] = ls[:, 0:4] | ((ls[:, 4:8] >> 4) << 6)
+    packed_scales[:, 4:8] = lm[:, 0:4] | ((lm[:, 4:8] >> 4) << 6)
+    packed_scales[:, 8:12] = (ls[:, 4:8] & 0xF) | ((lm[:, 4:8] & 0xF) << 4)
+
+    qs = (L[:, :, 0, :] | (L[:, :, 1, :] << 4)).reshape(nb, 128)
+
+    return np.concatenate([d.view(np.uint8), dmin.view(np.uint8), packed_scales, qs], axis=1).reshape(x.shape[0], -1)
+
+
+QUANTIZERS = {
+    "q8_0": quantize_q8_0,
+    "q5_1": quantize_q5_1,
+    "q5_0": quantize_q5_0,
+    "q4_1": quantize_q4_1,
+    "q4_0": quantize_q4_0,
+    "q4_K": quantize_q4_K,
+}
+
+
+def tensor_tower(name: str) -> str:
+    if name.startswith("vision_model."):
+        return "vision"
+    if name.startswith("qformer.") or name.startswith("query_tokens"):
+        return "qformer"
+    # text embeddings and image-text heads of the retrieval models
+    if name.split(".")[0] in ("embeddings", "vision_projection", "text_projection", "itm_head"):
+        return "qformer"
+    return "text"
+
+
+# Type of a tensor under the per-tower policy:
+# - 1-D tensors (biases, layer norms) and the embeddings that are added to activations stay in f32
+# - the patch embedding convolution kernel stays in f16
+# - matrices use the type of their tower, or the closest type whose block size divides their rows
+def tensor_type(name: str, shape: tuple, tower_types: dict) -> str:
+    if len(shape) != 2:
+        if len(shape) == 4 and tower_types[tensor_tower(name)] != "f32":
+            return "f16"
+        return "f32"
+
+    wanted = tower_types[tensor_tower(name)]
+    for candidate in (wanted, "q8_0", "f16"):
+        if candidate in ("f32", "f16") or shape[-1] % block_size(candidate) == 0:
+            if candidate != wanted:
+                print(f"{name}: rows of {shape[-1]} values do not fit {wanted} blocks, using {candidate}")
+            return candidate
+    return "f16"
+
+
 ap = argparse.ArgumentParser(prog="convert_hf_to_gguf.py")
 ap.add_argument(
     "-m",
@@ -26,6 +193,13 @@ ap.add_argument(
 ap.add_argument(
     "--use-f32", action="store_true", default=False, help="Use f32 instead of f16"
 )
+for tower in ("vision", "qformer", "text"):
+    ap.add_argument(
+        f"--{tower}-type",
+        choices=list(TENSOR_TYPES),
+        default="f16",
+        help=f"Type of the {tower} tower matrices (default: f16)",
+    )
 ap.add_argument(
     "-o",
     "--output-dir",
@@ -37,37 +211,62 @@ args = ap.parse_args()
 
 dir_model = args.model_dir
 
+tower_types = {
+    "vision": args.vision_type,
+    "qformer": args.qformer_type,
+    "text": args.text_type,
+}
+if args.use_f32:
+    tower_types = {tower: "f32" for tower in tower_types}
+
+# Quantization and f32 tensors are computed from the full precision weights
+load_dtype = torch.float16
+if any(t != "f16" for t in tower_types.values()):
+    load_dtype = torch.float32
 
-model = Blip2ForConditionalGeneration.from_pretrained(
-    dir_model, torch_dtype=torch.float16
+
+with open(dir_model + "/config.json", "r", encoding="utf-8") as f:
+    config = json.load(f)
+
+# The retrieval models have the text side of the Q-Former and the image-text heads instead of the OPT decoder
+model_class = Blip2ForConditionalGeneration
+if "Blip2ForImageTextRetrieval" in config.get("architectures", []):
+    model_class = Blip2ForImageTextRetrieval
+
+model = model_class.from_pretrained(
+    dir_model, torch_dtype=load_dtype
 )
 list_vars = model.state_dict()
 processor = Blip2Processor.from_pretrained(dir_model)
 
-with open(dir_model + "/vocab.json", "r", encoding="utf-8") as f:
-    vocab = json.load(f)
-    tokens = [key for key in vocab]
+# BPE vocabulary of OPT, or WordPiece vocabulary of the Q-Former for the retrieval models
+if os.path.exists(dir_model + "/vocab.json"):
+    with open(dir_model + "/vocab.json", "r", encoding="utf-8") as f:
+        vocab = json.load(f)
+        tokens = [key for key in vocab]
+else:
+    with open(dir_model + "/vocab.txt", "r", encoding="utf-8") as f:
+        tokens = [line.rstrip("\n") for line in f]
 
-with open(dir_model + "/config.json", "r", encoding="utf-8") as f:
-    config = json.load(f)
-    v_hparams = config["vision_config"]
-    q_hparams = config["qformer_config"]
-    t_hparams = config["text_config"]
+v_hparams = config["vision_config"]
+q_hparams = config["qformer_config"]
+t_hparams = config["text_config"]
 
 
 fname_middle = "two_tower_blip2"
-ftype_str = "f16"
-ftype = 1
+if len(set(tower_types.values())) == 1:
+    ftype_str = tower_types["text"]
+else:
+    ftype_str = "-".join(tower_types[tower] for tower in ("vision", "qformer", "text"))
 
 output_dir = args.output_dir if args.output_dir is not None else dir_model
 os.makedirs(output_dir, exist_ok=True)
 output_prefix = os.path.basename(output_dir).replace("ggml_", "")
 fname_out = os.path.join(
-    output_dir, f"{output_prefix}_ggml-{fname_middle}-{ftype_str[ftype]}.gguf"
+    output_dir, f"{output_prefix}_ggml-{fname_middle}-{ftype_str}.gguf"
 )
 fout = GGUFWriter(path=fname_out, arch="blip2")
 fout.add_name("BLIP2 ViT-G OPT2.7B")
-fout.add_file_type(ftype)
 fout.add_description("BLIP2 with both vision and text.")
 
 
@@ -117,10 +316,29 @@ fout.add_uint32(k(KEY_BLOCK_COUNT, TEXT), t_hparams["num_hidden_layers"])
 fout.add_token_list(tokens)
 
 
+# The file type is the type holding most of the parameters
+n_params_per_type = {}
+
 for name, data in list_vars.items():
-    data = data.numpy().astype(np.float16)
-    fout.add_tensor(name[:GGML_MAX_NAME - 1], data)
-    print(f"{name[:GGML_MAX_NAME - 1]} - {ftype_str} - shape = {data.shape}")
+    # index buffers, not weights
+    if name.endswith("position_ids"):
+        continue
+    data = data.numpy()
+    shape = data.shape
+    type_name = tensor_type(name, shape, tower_types)
+
+    if type_name in QUANTIZERS:
+        raw = QUANTIZERS[type_name](data.astype(np.float32).reshape(-1, shape[-1]))
+        fout.add_tensor(name[:GGML_MAX_NAME - 1], raw, raw_shape=shape, raw_dtype=TENSOR_TYPES[type_name])
+    else:
+        data = data.astype(np.float32 if type_name == "f32" else np.float16)
+        fout.add_tensor(name[:GGML_MAX_NAME - 1], data)
+
+    n_params_per_type[type_name] = n_params_per_type.get(type_name, 0) + data.size
+    print(f"{name[:GGML_MAX_NAME - 1]} - {type_name} - shape = {shape}")
+
+ftype = FILE_TYPES[max(n_params_per_type, key=n_params_per_type.get)]
+fout.add_file_type(ftype)
 
 
 fout.write_header_to_file()
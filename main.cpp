@@ -0,0 +1,33 @@
+#include <iostream>
+
+#include "blip2.h"
+
+
+int main() {
+    const char* filename = "../models/blip2-opt-2.7b_ggml-two_tower_blip2-f16.gguf";
+    blip2_ctx* new_blip2  = blip2_model_load(filename);
+    blip2_free(new_blip2);
+
+    // Image testing
+    const char* img_filename = "../pascal_muller_panda.jpg";
+    image_u8 img;
+    if (load_image_from_file(img_filename, &img)) {
+        std::cout << "Image Properties:" << std::endl;
+        std::cout << "nx: " << img.nx << std::endl;
+        std::cout << "ny: " << img.ny << std::endl;
+        std::cout << "size: " << img.size << std::endl;
+
+        // Print the first 20 pixel values in the top left corner
+        std::cout << "Top Left Corner Pixel Values:" << std::endl;
+        for (int i = 0; i < 20; i++) {
+            std::cout << "Pixel " << i + 1 << ": ";
+            std::cout << static_cast<int>(img.data[i]) << std::endl; // Assuming uint8_t represents pixel values
+        }
+
+        blip2_image_u8_free(&img); // Free the image data memory when done
+    } else {
+        std::cerr << "Failed to load image." << std::endl;
+    }
+
+    return 0;
+}
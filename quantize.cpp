@@ -0,0 +1,463 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+
+#include "blip2.h"
+#include "ggml/ggml.h"
+
+
+struct quantize_params {
+    std::string fname_inp;
+    std::string fname_out;
+    // target type of the matrices of each tower, in blip2_tower bit order
+    ggml_type tower_types[BLIP2_N_TOWERS] = { GGML_TYPE_Q8_0, GGML_TYPE_F16, GGML_TYPE_Q4_K };
+    std::string fname_imatrix;
+    std::string fname_imatrix_out;
+    std::string calib_dir;
+    bool fold_layer_norm = false;
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+static const ggml_type allowed_types[] = {
+    GGML_TYPE_F32, GGML_TYPE_F16,
+    GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_Q8_0,
+    GGML_TYPE_Q2_K, GGML_TYPE_Q3_K, GGML_TYPE_Q4_K, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K,
+};
+
+// general.file_type values, same numbering as llama.cpp
+static int file_type_of(ggml_type type) {
+    switch (type) {
+        case GGML_TYPE_F32:  return 0;
+        case GGML_TYPE_F16:  return 1;
+        case GGML_TYPE_Q4_0: return 2;
+        case GGML_TYPE_Q4_1: return 3;
+        case GGML_TYPE_Q8_0: return 7;
+        case GGML_TYPE_Q5_0: return 8;
+        case GGML_TYPE_Q5_1: return 9;
+        case GGML_TYPE_Q2_K: return 10;
+        case GGML_TYPE_Q3_K: return 12;
+        case GGML_TYPE_Q4_K: return 14;
+        case GGML_TYPE_Q5_K: return 16;
+        case GGML_TYPE_Q6_K: return 18;
+        default:             return 1;
+    }
+}
+
+static bool parse_type(const char * name, ggml_type * type) {
+    for (ggml_type t : allowed_types) {
+        if (strcmp(name, ggml_type_name(t)) == 0) {
+            *type = t;
+            return true;
+        }
+    }
+
+    fprintf(stderr, "unknown tensor type '%s'\n", name);
+    return false;
+}
+
+static void print_usage(const char * prog) {
+    fprintf(stderr, "usage: %s [options] model-f16.gguf model-out.gguf\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  --vision TYPE        type of the vision matrices (default: q8_0)\n");
+    fprintf(stderr, "  --qformer TYPE       type of the Q-Former matrices (default: f16)\n");
+    fprintf(stderr, "  --text TYPE          type of the language model matrices (default: q4_K)\n");
+    fprintf(stderr, "  --imatrix FILE       importance matrix to quantize with\n");
+    fprintf(stderr, "  --calib-dir DIR      gather an importance matrix by running the vision encoder on the images in DIR\n");
+    fprintf(stderr, "  --imatrix-out FILE   save the gathered importance matrix\n");
+    fprintf(stderr, "  --fold-layer-norm    only fold the vision layernorms into the matrices after them, keeping the types;\n");
+    fprintf(stderr, "                       quantize the output in a second run\n");
+    fprintf(stderr, "  -t N                 number of threads (default: %d)\n", quantize_params().n_threads);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "types:");
+    for (ggml_type t : allowed_types) {
+        fprintf(stderr, " %s", ggml_type_name(t));
+    }
+    fprintf(stderr, "\n");
+}
+
+static bool parse_args(int argc, char ** argv, quantize_params & params) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (arg == "--vision" && has_value) {
+            if (!parse_type(argv[++i], &params.tower_types[0])) return false;
+        } else if (arg == "--qformer" && has_value) {
+            if (!parse_type(argv[++i], &params.tower_types[1])) return false;
+        } else if (arg == "--text" && has_value) {
+            if (!parse_type(argv[++i], &params.tower_types[2])) return false;
+        } else if (arg == "--imatrix" && has_value) {
+            params.fname_imatrix = argv[++i];
+        } else if (arg == "--calib-dir" && has_value) {
+            params.calib_dir = argv[++i];
+        } else if (arg == "--imatrix-out" && has_value) {
+            params.fname_imatrix_out = argv[++i];
+        } else if (arg == "--fold-layer-norm") {
+            params.fold_layer_norm = true;
+        } else if (arg == "-t" && has_value) {
+            params.n_threads = std::max(1, atoi(argv[++i]));
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "unknown or incomplete argument '%s'\n", arg.c_str());
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() != 2) {
+        return false;
+    }
+    params.fname_inp = positional[0];
+    params.fname_out = positional[1];
+
+    return true;
+}
+
+static bool is_image_file(const std::string & name) {
+    std::string ext = name.substr(name.find_last_of('.') + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+    return ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "bmp";
+}
+
+// Run the vision encoder over every image of a directory, accumulating the activation statistics
+static bool gather_imatrix(const quantize_params & params, blip2_imatrix * imatrix) {
+    DIR * dir = opendir(params.calib_dir.c_str());
+    if (!dir) {
+        fprintf(stderr, "%s: failed to open directory '%s'\n", __func__, params.calib_dir.c_str());
+        return false;
+    }
+
+    std::vector<std::string> files;
+    while (struct dirent * entry = readdir(dir)) {
+        if (is_image_file(entry->d_name)) {
+            files.push_back(params.calib_dir + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+
+    if (files.empty()) {
+        fprintf(stderr, "%s: no images found in '%s'\n", __func__, params.calib_dir.c_str());
+        return false;
+    }
+
+    struct blip2_model_params model_params = blip2_model_default_params();
+    model_params.towers = BLIP2_TOWER_VISION;
+
+    blip2_ctx * ctx = blip2_model_load(params.fname_inp.c_str(), model_params);
+    if (!ctx) {
+        return false;
+    }
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        image_u8 img;
+        if (!load_image_from_file_scaled(files[i].c_str(), &img, ctx->vision_image_size)) {
+            continue;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+        const bool ok = blip2_vision_accumulate_imatrix(ctx, &img, params.n_threads, imatrix);
+        blip2_image_u8_free(&img);
+        if (!ok) {
+            blip2_free(ctx);
+            return false;
+        }
+
+        printf("%s: [%zu/%zu] %s (%.2f s)\n", __func__, i + 1, files.size(), files[i].c_str(), (ggml_time_us() - t_start_us) / 1e6);
+    }
+
+    blip2_free(ctx);
+
+    return true;
+}
+
+static int tensor_tower_index(const char * name) {
+    if (strncmp(name, "vision_model.", strlen("vision_model.")) == 0) {
+        return 0;
+    }
+    if (strncmp(name, "qformer.", strlen("qformer.")) == 0 || strncmp(name, "query_tokens", strlen("query_tokens")) == 0) {
+        return 1;
+    }
+
+    return 2;
+}
+
+// Parameters added to the activations rather than multiplied with them. They are 3-D in the HF model,
+// which convert_hf_to_gguf.py keeps in F32, but lose their leading dimension of 1 in the file.
+static const char * f32_tensors[] = {
+    "query_tokens",
+    "vision_model.embeddings.class_embedding",
+    "vision_model.embeddings.position_embedding",
+};
+
+// Same policy as convert_hf_to_gguf.py: only matrices are quantized, falling back to a type
+// with smaller blocks when their rows cannot be split into blocks of the requested type
+static ggml_type target_type(const struct ggml_tensor * t, const quantize_params & params) {
+    for (const char * name : f32_tensors) {
+        if (strcmp(t->name, name) == 0) {
+            return GGML_TYPE_F32;
+        }
+    }
+    if (ggml_n_dims(t) != 2) {
+        return t->type;
+    }
+
+    const ggml_type wanted = params.tower_types[tensor_tower_index(t->name)];
+    for (ggml_type candidate : { wanted, GGML_TYPE_Q8_0, GGML_TYPE_F16 }) {
+        if (t->ne[0] % ggml_blck_size(candidate) == 0) {
+            if (candidate != wanted) {
+                printf("%s: rows of %lld values do not fit %s blocks, using %s\n", t->name,
+                    (long long) t->ne[0], ggml_type_name(wanted), ggml_type_name(candidate));
+            }
+            return candidate;
+        }
+    }
+
+    return GGML_TYPE_F16;
+}
+
+static void to_f32(const struct ggml_tensor * t, const void * src, float * dst, int64_t start, int64_t n) {
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(dst, (const float *) src + start, n*sizeof(float));
+    } else if (t->type == GGML_TYPE_F16) {
+        ggml_fp16_to_fp32_row((const ggml_fp16_t *) src + start, dst, n);
+    } else {
+        const size_t offset = start / ggml_blck_size(t->type) * ggml_type_size(t->type);
+        ggml_internal_get_type_traits(t->type).to_float((const uint8_t *) src + offset, dst, n);
+    }
+}
+
+// Convert and quantize a tensor, each thread taking a contiguous range of rows
+static size_t quantize_tensor(const struct ggml_tensor * t, const void * src, ggml_type type, const float * imatrix,
+                              std::vector<uint8_t> & out, int n_threads) {
+    const int64_t n_per_row = t->ne[0];
+    const int64_t nrows = ggml_nrows(t);
+    const size_t row_size = ggml_row_size(type, n_per_row);
+    out.resize(row_size * nrows);
+
+    std::vector<size_t> sizes(n_threads, 0);
+    auto worker = [&](int ith) {
+        const int64_t r0 = nrows * ith / n_threads;
+        const int64_t r1 = nrows * (ith + 1) / n_threads;
+        if (r0 >= r1) {
+            return;
+        }
+
+        std::vector<float> f32((r1 - r0) * n_per_row);
+        to_f32(t, src, f32.data(), r0*n_per_row, f32.size());
+
+        if (type == GGML_TYPE_F32) {
+            memcpy(out.data() + r0*row_size, f32.data(), f32.size()*sizeof(float));
+            sizes[ith] = f32.size()*sizeof(float);
+        } else if (type == GGML_TYPE_F16) {
+            ggml_fp32_to_fp16_row(f32.data(), (ggml_fp16_t *) (out.data() + r0*row_size), f32.size());
+            sizes[ith] = f32.size()*sizeof(ggml_fp16_t);
+        } else {
+            int64_t hist[16] = {};
+            sizes[ith] = ggml_quantize_chunk(type, f32.data(), out.data() + r0*row_size, 0, r1 - r0, n_per_row, hist, imatrix);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(worker, ith);
+    }
+    worker(0);
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    size_t total = 0;
+    for (size_t size : sizes) {
+        total += size;
+    }
+    GGML_ASSERT(total == out.size());
+
+    return total;
+}
+
+static void write_zeros(std::ofstream & fout, size_t n) {
+    const char zero = 0;
+    for (size_t i = 0; i < n; ++i) {
+        fout.write(&zero, 1);
+    }
+}
+
+static bool quantize_model(const quantize_params & params, const blip2_imatrix * imatrix) {
+    struct ggml_context * meta = NULL;
+    struct gguf_init_params gguf_params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &meta,
+    };
+
+    struct gguf_context * ctx_inp = gguf_init_from_file(params.fname_inp.c_str(), gguf_params);
+    if (!ctx_inp) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, params.fname_inp.c_str());
+        return false;
+    }
+
+    blip2_mmap mapping;
+    if (!mapping.map(params.fname_inp.c_str())) {
+        gguf_free(ctx_inp);
+        ggml_free(meta);
+        return false;
+    }
+
+    const int n_tensors = gguf_get_n_tensors(ctx_inp);
+    const size_t data_offset = gguf_get_data_offset(ctx_inp);
+
+    // Decide every type first so that the header, written before any data, is final
+    std::vector<ggml_type> types(n_tensors);
+    std::vector<int64_t> n_params_per_type(GGML_TYPE_COUNT, 0);
+    for (int i = 0; i < n_tensors; ++i) {
+        const struct ggml_tensor * t = ggml_get_tensor(meta, gguf_get_tensor_name(ctx_inp, i));
+        types[i] = target_type(t, params);
+        n_params_per_type[types[i]] += ggml_nelements(t);
+    }
+    const ggml_type main_type = (ggml_type) (std::max_element(n_params_per_type.begin(), n_params_per_type.end()) - n_params_per_type.begin());
+
+    struct gguf_context * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ctx_inp);
+    gguf_set_val_u32(ctx_out, "general.file_type", file_type_of(main_type));
+
+    for (int i = 0; i < n_tensors; ++i) {
+        const struct ggml_tensor * t = ggml_get_tensor(meta, gguf_get_tensor_name(ctx_inp, i));
+        gguf_add_tensor(ctx_out, t);
+        gguf_set_tensor_type(ctx_out, t->name, types[i]);
+    }
+
+    std::ofstream fout(params.fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, params.fname_out.c_str());
+        gguf_free(ctx_out);
+        gguf_free(ctx_inp);
+        ggml_free(meta);
+        return false;
+    }
+
+    // Placeholder for the header, filled in once all tensor sizes are known
+    write_zeros(fout, gguf_get_meta_size(ctx_out));
+
+    const size_t alignment = gguf_get_alignment(ctx_out);
+    size_t total_size_inp = 0;
+    size_t total_size_out = 0;
+    std::vector<uint8_t> buf;
+    std::vector<float> im_values;
+
+    for (int i = 0; i < n_tensors; ++i) {
+        const struct ggml_tensor * t = ggml_get_tensor(meta, gguf_get_tensor_name(ctx_inp, i));
+        const void * src = (const uint8_t *) mapping.addr + data_offset + gguf_get_tensor_offset(ctx_inp, i);
+
+        const float * im = nullptr;
+        if (imatrix) {
+            auto it = imatrix->entries.find(t->name);
+            if (it != imatrix->entries.end() && it->second.ncall > 0 && (int64_t) it->second.values.size() == t->ne[0]) {
+                // Averaged over the calls, like llama.cpp does when loading an importance matrix
+                im_values = it->second.values;
+                for (float & v : im_values) {
+                    v /= it->second.ncall;
+                }
+                im = im_values.data();
+            }
+        }
+
+        const void * data = src;
+        size_t size = ggml_nbytes(t);
+        if (types[i] != t->type) {
+            size = quantize_tensor(t, src, types[i], im, buf, params.n_threads);
+            data = buf.data();
+        }
+
+        printf("[%4d/%4d] %-64s %-6s -> %-6s %8.2f MB -> %8.2f MB%s\n", i + 1, n_tensors, t->name,
+            ggml_type_name(t->type), ggml_type_name(types[i]),
+            ggml_nbytes(t) / 1024.0 / 1024.0, size / 1024.0 / 1024.0, im ? " (imatrix)" : "");
+
+        gguf_set_tensor_data(ctx_out, t->name, data, size);
+        fout.write((const char *) data, size);
+        write_zeros(fout, GGML_PAD(size, alignment) - size);
+
+        total_size_inp += ggml_nbytes(t);
+        total_size_out += size;
+    }
+
+    std::vector<uint8_t> header(gguf_get_meta_size(ctx_out));
+    gguf_get_meta_data(ctx_out, header.data());
+    fout.seekp(0);
+    fout.write((const char *) header.data(), header.size());
+    fout.close();
+
+    printf("%s: model size: %.2f MB -> %.2f MB\n", __func__, total_size_inp / 1024.0 / 1024.0, total_size_out / 1024.0 / 1024.0);
+
+    gguf_free(ctx_out);
+    gguf_free(ctx_inp);
+    ggml_free(meta);
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    ggml_time_init();
+
+    quantize_params params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Folding runs on the loaded model, in full precision
+    if (params.fold_layer_norm) {
+        struct blip2_model_params model_params = blip2_model_default_params();
+        model_params.fold_layer_norm = true;
+        model_params.n_threads = params.n_threads;
+        blip2_ctx * ctx = blip2_model_load(params.fname_inp.c_str(), model_params);
+        if (!ctx) {
+            return 1;
+        }
+        const bool ok = blip2_model_save(ctx, params.fname_out.c_str());
+        blip2_free(ctx);
+        if (!ok) {
+            return 1;
+        }
+        printf("%s: folded '%s' into '%s'\n", __func__, params.fname_inp.c_str(), params.fname_out.c_str());
+        return 0;
+    }
+
+    blip2_imatrix imatrix;
+    bool use_imatrix = false;
+
+    if (!params.fname_imatrix.empty()) {
+        if (!blip2_imatrix_load(&imatrix, params.fname_imatrix.c_str())) {
+            return 1;
+        }
+        use_imatrix = true;
+    }
+
+    if (!params.calib_dir.empty()) {
+        if (!gather_imatrix(params, &imatrix)) {
+            return 1;
+        }
+        use_imatrix = true;
+
+        if (!params.fname_imatrix_out.empty() && !blip2_imatrix_save(&imatrix, params.fname_imatrix_out.c_str())) {
+            return 1;
+        }
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    if (!quantize_model(params, use_imatrix ? &imatrix : nullptr)) {
+        return 1;
+    }
+    printf("%s: quantized '%s' to '%s' in %.2f s\n", __func__, params.fname_inp.c_str(), params.fname_out.c_str(),
+        (ggml_time_us() - t_start_us) / 1e6);
+
+    return 0;
+}